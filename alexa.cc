@@ -7,21 +7,27 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <curl/curl.h>
 #include <mpg123.h>
 
 #include <vector>
+#include <atomic>
 
 #include <pa_ringbuffer.h>
 #include <pa_util.h>
 #include <portaudio.h>
 
 #include "configini/configini.h"
-#include "json/jsmn.h"
+#include "json/json.h"
 #include "inc/snowboy-detect.h"
 
 #include "alexa.h"
+#include "stats.h"
+#include "trace.h"
+#include "watch.h"
+#include "net.h"
 
 #define WAVE_FORMAT_PCM         0x0001
 #define WAVE_FORMAT_IEEE_FLOAT  0x0003
@@ -33,6 +39,29 @@
 
 #define RING_BUFFER_SIZE        262144
 #define RECORDING_TIME          3500   // mili-seconds
+#define RECORDING_TIME_MAX      15000  // the whole recording must fit the input ring
+#define CONFIG_SAVE_DELAY       500    // mili-seconds to coalesce token updates before saving
+#define CONFIG_SNAPSHOT         ".snap" // compiled config next to the text, rebuilt when the text changes
+
+#define SPEECH_ENDPOINT         "https://access-alexa-na.amazon.com/v1/avs/speechrecognizer/recognize"
+#define TOKEN_ENDPOINT          "https://api.amazon.com/auth/o2/token"
+#define TOKEN_MARGIN            120    // seconds, a token this close to expiry is not used
+#define TOKEN_REFRESH_AHEAD     300    // seconds before the margin to refresh in the background
+#define TOKEN_RETRY             30     // seconds between background refresh attempts
+#define DOWNCHANNEL_RETRY       10     // seconds before a closed downchannel is opened again
+#define PING_INTERVAL           300    // seconds between pings of the shared connection
+#define WARMUP_HOLD             20     // seconds a warmed or used connection is taken to be up
+#define SPECULATION_WINDOW      1500   // mili-seconds the hot word has to confirm a pre-trigger
+#define SPECULATION_PREROLL     500    // mili-seconds of audio before the pre-trigger sent with it
+#define HEDGE_ATTEMPTS          3      // requests one utterance may take, the first one included
+#define HEDGE_DEADLINE          2000   // mili-seconds from the upload to the reply before hedging, until there is a p95
+#define HEDGE_DEADLINE_MIN      200    // mili-seconds, the p95 deadline is never shorter
+#define HEDGE_BACKOFF           250    // mili-seconds before the first retry, doubled for the next, plus jitter
+#define HEDGE_POLL              10     // mili-seconds between looks at the racing requests
+#define ENDPOINT_PROBE_INTERVAL 30     // seconds between round trip probes of the endpoints
+#define ENDPOINT_PROBE_TIMEOUT  5      // seconds, a slower probe marks its endpoint down
+#define ENDPOINT_HYSTERESIS     20     // %, a healthy endpoint is only left for one this much faster
+#define ENDPOINT_HYSTERESIS_MIN 2      // mili-seconds, and by at least this much
 
 #define DATA_HEADER     "--%s\r\nContent-Disposition: form-data; name=\"metadata\"" \
                         "\r\nContent-Type: application/json; charset=UTF-8\r\n" \
@@ -46,15 +75,48 @@
 #define DATA_TAILER     "\r\n\r\n--%s--\r\n\r\n"
 
 static uint8_t debug;
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dump_stats;
 
 static ring_buffer_size_t left_samples;
-//static ring_buffer_size_t lost_samples;
-static input_state is_in;
+static std::atomic<bool> output_playing(false);         // a reply is being written to the output ring
+static int output_primed;                               // audio callback only, the reply reached the ring
+static unsigned int recording_time = RECORDING_TIME;   // changed by the main thread between requests
+
+static alexa_settings_t cli_settings;                  // command line values, the defaults of the config keys
+static alexa_settings_t watch_settings;                // last settings handed over, used by the watcher only
+static std::atomic<alexa_settings_t *> pending_settings(NULL);
+static Config *watch_config;                            // the main thread's, saved by the config writer
+static const char *const token_keys[] = {ALEXA_REFRESH_TOKEN, ALEXA_ACCESS_TOKEN, ALEXA_CREATED_TIME, ALEXA_EXPIRED_IN, NULL};
+
+static json_arena_t json_tokens;                        // one parse at a time, kept across responses
+static json_path_t path_access_token;                   // compiled once by json_paths_init()
+static json_path_t path_refresh_token;
+static json_path_t path_expires_in;
+static json_path_t path_error;
+static json_path_t path_namespace;                      // inside a directive
+static json_path_t path_name;
+static json_path_t path_audio_content;
+static json_path_t path_listen_timeout;
+static json_path_t path_stream_url;
+static json_path_t path_volume;
+static json_path_t path_mute;
+static json_path_t path_directive;                      // in a downchannel part
+static json_path_t path_header_namespace;
+static json_path_t path_header_name;
+
+static std::atomic<int> speaker_volume(100);            // 0-100, set by Speaker directives
+static std::atomic<bool> speaker_muted(false);
+static std::atomic<CURL *> upload_waiting(NULL);        // an upload paused for audio, the capture callback resumes it
+static token_refresh_t token_refresh;                   // main thread only
+static std::atomic<bool> token_refreshed(false);        // set on the network thread once token_refresh is over
+static std::atomic<bool> downchannel_closed(false);     // set on the network thread when its stream ends
+static std::atomic<input_state> is_in(STOP_INPUT);     // the capture callback acts on it, others set it
+static std::atomic<PaUtilRingBuffer *> record_ring(NULL);   // RECORD_INPUT goes here, stored before is_in
+static const char *input_state_name[] = {"STOP_INPUT", "RECORD_INPUT", "REAL_TIME_INPUT"};
 
 static pthread_mutex_t in_ring_mutex;
 static pthread_mutex_t out_ring_mutex;
-static pthread_mutex_t wav_mutex;
-static pthread_cond_t wav_cond;
 
 char *strnstr(char *string, const char *find, ssize_t len)
 {
@@ -94,6 +156,7 @@ static void init_string(string_t *s)
 
 static size_t writefunc(void *ptr, size_t size, size_t nmemb, string_t *s)
 {
+    trace_begin("writefunc");
     if (debug)
     {
         printf("*** Write %ld bytes to file\n", size * nmemb);
@@ -110,105 +173,477 @@ static size_t writefunc(void *ptr, size_t size, size_t nmemb, string_t *s)
     s->ptr[new_len] = '\0';
     s->len = new_len;
 
+    trace_end("writefunc");
     return size * nmemb;
 }
 
-static size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userp)
+/*
+ * Directive handlers run from the write callback as soon as the directive
+ * is parsed. They hand the work to the stage which owns it: audio parts to
+ * the playback after the transfer, the rest takes effect right away.
+ */
+static void directive_speak(speech_response_t *resp, const directive_t *d)
 {
-    data_stream_t *pooh = (data_stream_t *)userp;
-    ring_buffer_size_t read_samples, available_samples;
-    size_t actual_read;
+    json_view_t view;
 
-    if(size * nmemb < 1)
-        return 0;
+    if (json_query_view(&path_audio_content, d->js, d->tokens, d->count, &view) ||
+            view.len < 4 || strncmp(view.ptr, "cid:", 4))
+        return;
+    if (resp->speak_count == SPEAK_MAX)
+    {
+        fprintf(stderr, "More than %d Speak directives, dropping %.*s\n", SPEAK_MAX, (int)view.len, view.ptr);
+        return;
+    }
+    view.ptr += 4;
+    view.len -= 4;
+    if (!json_view_copy(&view, resp->speak[resp->speak_count], sizeof(resp->speak[0])))
+        resp->speak_count++;
+}
+
+/* ExpectSpeech, the main loop opens the mic again once the reply has played out of the output ring */
+static void directive_listen(speech_response_t *resp, const directive_t *d)
+{
+    json_view_t view;
+
+    resp->reask = 1;
+    if (debug && !json_query_view(&path_listen_timeout, d->js, d->tokens, d->count, &view))
+    {
+        printf("Listen within %.*s ms\n", (int)view.len, view.ptr);
+    }
+}
+
+static void directive_play(speech_response_t *resp, const directive_t *d)
+{
+    json_view_t view;
+
+    (void)resp;
+    if (!json_query_view(&path_stream_url, d->js, d->tokens, d->count, &view))
+    {
+        printf("Audio streams are not supported, skipping %.*s\n", (int)view.len, view.ptr);
+    }
+}
+
+/* stop and clearQueue, the player drops what is queued and stops decoding, the output ring is emptied */
+static void directive_stop(speech_response_t *resp, const directive_t *d)
+{
+    (void)d;
+    if (resp->player == NULL || !resp->player->started)
+        return;
+    resp->player->cancelled = resp->player->queued.load();
+    pthread_mutex_lock(&out_ring_mutex);
+    PaUtil_FlushRingBuffer(resp->player->playback);
+    pthread_mutex_unlock(&out_ring_mutex);
+    trace_instant("player_cancel");
+}
+
+static void directive_volume(speech_response_t *resp, const directive_t *d, int adjust)
+{
+    json_view_t view;
+    int volume;
+
+    (void)resp;
+    if (json_query_view(&path_volume, d->js, d->tokens, d->count, &view) || json_view_int(&view, &volume))
+        return;
+    if (adjust)
+        volume += speaker_volume.load();
+    speaker_volume = volume < 0 ? 0 : (volume > 100 ? 100 : volume);
+}
+
+static void directive_set_volume(speech_response_t *resp, const directive_t *d)
+{
+    directive_volume(resp, d, 0);
+}
+
+static void directive_adjust_volume(speech_response_t *resp, const directive_t *d)
+{
+    directive_volume(resp, d, 1);
+}
 
+static void directive_set_mute(speech_response_t *resp, const directive_t *d)
+{
+    json_view_t view;
+
+    (void)resp;
+    if (!json_query_view(&path_mute, d->js, d->tokens, d->count, &view))
+        speaker_muted = json_view_equal(&view, "true");
+}
+
+static constexpr directive_entry_t directive_table[] = {
+    {"SpeechSynthesizer", "speak", directive_speak},
+    {"SpeechRecognizer", "listen", directive_listen},
+    {"AudioPlayer", "play", directive_play},
+    {"AudioPlayer", "stop", directive_stop},
+    {"AudioPlayer", "clearQueue", directive_stop},
+    {"Speaker", "SetVolume", directive_set_volume},
+    {"Speaker", "AdjustVolume", directive_adjust_volume},
+    {"Speaker", "SetMute", directive_set_mute},
+};
+
+/*
+ * Perfect hash of namespace.name, FNV-1a with a seed picked so that the
+ * table gets distinct slots. The compiler checks it and builds the slot
+ * map, a new directive which collides needs another seed.
+ */
+#define DIRECTIVE_SEED          2
+#define DIRECTIVE_BITS          4
+#define DIRECTIVE_SLOTS         (1 << DIRECTIVE_BITS)
+#define DIRECTIVE_COUNT         (int)(sizeof(directive_table) / sizeof(directive_table[0]))
+
+static constexpr uint32_t directive_hash(const char *s, uint32_t h)
+{
+    return *s ? directive_hash(s + 1, (h ^ (uint8_t)*s) * 16777619u) : h;
+}
+
+static constexpr uint32_t directive_slot(int i)
+{
+    return directive_hash(directive_table[i].name,
+            (directive_hash(directive_table[i].ns, DIRECTIVE_SEED) ^ '.') * 16777619u) >> (32 - DIRECTIVE_BITS);
+}
+
+static constexpr bool directive_perfect(int i, int j)
+{
+    return i >= DIRECTIVE_COUNT ? true :
+           j >= DIRECTIVE_COUNT ? directive_perfect(i + 1, i + 2) :
+           directive_slot(i) != directive_slot(j) && directive_perfect(i, j + 1);
+}
+
+static constexpr int directive_find(uint32_t slot, int i)
+{
+    return i >= DIRECTIVE_COUNT ? -1 : directive_slot(i) == slot ? i : directive_find(slot, i + 1);
+}
+
+static_assert(directive_perfect(0, 1), "directive slots collide, change DIRECTIVE_SEED");
+static_assert(DIRECTIVE_SLOTS == 16, "directive_slots lists every slot");
+
+static const int8_t directive_slots[DIRECTIVE_SLOTS] = {
+    directive_find(0, 0), directive_find(1, 0), directive_find(2, 0), directive_find(3, 0),
+    directive_find(4, 0), directive_find(5, 0), directive_find(6, 0), directive_find(7, 0),
+    directive_find(8, 0), directive_find(9, 0), directive_find(10, 0), directive_find(11, 0),
+    directive_find(12, 0), directive_find(13, 0), directive_find(14, 0), directive_find(15, 0),
+};
+
+static uint32_t directive_key(const json_view_t *ns, const json_view_t *name)
+{
+    uint32_t h = DIRECTIVE_SEED;
+    size_t i;
+
+    for (i = 0; i < ns->len; i++)
+        h = (h ^ (uint8_t)ns->ptr[i]) * 16777619u;
+    h = (h ^ '.') * 16777619u;
+    for (i = 0; i < name->len; i++)
+        h = (h ^ (uint8_t)name->ptr[i]) * 16777619u;
+    return h;
+}
+
+/* Runs the handler of ns.name on the directive under tokens[0] */
+static void directive_dispatch(speech_response_t *resp, const char *js, const jsmntok_t *tokens, int count,
+        const json_view_t *ns, const json_view_t *name)
+{
+    const directive_entry_t *entry;
+    directive_t d;
+    int i;
+
+    trace_instant("directive");
     if (debug)
     {
-        printf("*** Read %ld bytes from buffer size %ld\n", size * nmemb, pooh->sizeleft);
+        printf("Directive: %.*s\n", tokens[0].end - tokens[0].start, js + tokens[0].start);
     }
 
-    if(pooh->sizeleft >= (size * nmemb))
+    i = directive_slots[directive_key(ns, name) >> (32 - DIRECTIVE_BITS)];
+    entry = i < 0 ? NULL : &directive_table[i];
+    if (!entry || !json_view_equal(ns, entry->ns) || !json_view_equal(name, entry->name))
     {
-        /*if (lost_samples > 0)
-        {
-            fprintf(stderr, "Lost %ld samples due to ring buffer overflow\n", lost_samples);
-            lost_samples = 0;
-        }*/
+        printf("Unhandled directive %.*s.%.*s\n", (int)ns->len, ns->ptr, (int)name->len, name->ptr);
+        return;
+    }
 
-        while (1)
-        {
-            available_samples = PaUtil_GetRingBufferReadAvailable(pooh->pa_ring_buf);
-            if (available_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL) >= size * nmemb)
-            {
-                break;
-            }
-            Pa_Sleep(10);
-        }
+    d.js = js;
+    d.tokens = tokens;
+    d.count = count;
+    entry->handler(resp, &d);
+}
 
-        actual_read = (size * nmemb) / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+static void speech_directive(void *arg, const char *js, const jsmntok_t *tokens, int count)
+{
+    json_view_t ns, name;
 
-        pthread_mutex_lock(&in_ring_mutex);
-        read_samples = PaUtil_ReadRingBuffer(pooh->pa_ring_buf, ptr, actual_read);
-        pthread_mutex_unlock(&in_ring_mutex);
-        if (read_samples != actual_read)
+    if (json_query_view(&path_namespace, js, tokens, count, &ns) ||
+            json_query_view(&path_name, js, tokens, count, &name))
+        return;
+    directive_dispatch((speech_response_t *)arg, js, tokens, count, &ns, &name);
+}
+
+/*
+ * Finds the JSON part of the reply and feeds what arrived of it to the
+ * stream parser, so directives are known before the audio parts finish.
+ */
+static void speech_response_scan(speech_response_t *resp)
+{
+    char *body = resp->body.ptr;
+    size_t len = resp->body.len;
+    size_t bond_len;
+    char *tmp;
+    int ret;
+
+    if (resp->json_done)
+        return;
+
+    if (!resp->boundary[0])
+    {
+        size_t start = strspn(body, " \t\r\n");
+        size_t end = start + strcspn(body + start, " \t\r\n");
+
+        if (end == len)
+            return;
+        if (end - start >= sizeof(resp->boundary))
         {
-            fprintf(stderr, "%ld samples were available, but only %ld samples were read\n",
-                    available_samples, read_samples);
+            fprintf(stderr, "Response boundary too long\n");
+            resp->json_done = 1;
+            return;
         }
+        memcpy(resp->boundary, body + start, end - start);
+        resp->boundary[end - start] = '\0';
+    }
+    bond_len = strlen(resp->boundary);
+
+    if (!resp->json_start)
+    {
+        if (!(tmp = strnstr(body, "application/json", len)) ||
+            !(tmp = strnstr(tmp, "\r\n\r\n", len - (tmp - body))))
+            return;
+        resp->json_start = resp->scanned = tmp + 4 - body;
+    }
+
+    /* the part ends with CRLF and the boundary */
+    if ((tmp = strnstr(body + resp->scanned, resp->boundary, len - resp->scanned)))
+    {
+        resp->json_end = tmp - 2 - body;
+        resp->json_done = 1;
+    }
+    else
+    {
+        resp->json_end = len;
+        if (len >= resp->scanned + bond_len)
+            resp->scanned = len - bond_len + 1;
+    }
+
+    ret = json_stream_feed(&resp->json, body + resp->json_start, resp->json_end - resp->json_start);
+    if (ret < 0)
+    {
+        printf("Failed to parse JSON: %d\n", ret);
+        resp->json_done = 1;
+    }
+    else if (ret > 0)
+    {
+        resp->json_done = 1;
+    }
+}
+
+static size_t speech_writefunc(void *ptr, size_t size, size_t nmemb, speech_response_t *resp)
+{
+    size_t ret;
+
+    if (resp->hedge != NULL)
+    {
+        struct speech_response *first = NULL;
+        long code = 0;
+
+        /* an error reply finishes without claiming the race, a slower request may still answer */
+        curl_easy_getinfo(resp->curl, CURLINFO_RESPONSE_CODE, &code);
+        if (code / 100 == 2)
+            resp->hedge->winner.compare_exchange_strong(first, resp);
+        else
+            first = resp->hedge->winner;
+        /* a slower request of the race drops its reply, it is cancelled anyway */
+        if (first != NULL && first != resp)
+            return size * nmemb;
+    }
+
+    ret = writefunc(ptr, size, nmemb, &resp->body);
+    if (resp->first_byte_at == 0)
+        resp->first_byte_at = stats_now();
+    speech_response_scan(resp);
+    return ret;
+}
+
+static size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    data_stream_t *pooh = (data_stream_t *)userp;
+    ring_buffer_size_t read_samples, available_samples, actual_read;
+    char *out = (char *)ptr;
+    size_t room = size * nmemb;
+    size_t copied = 0, n;
 
-        pooh->sizeleft -= (read_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
-        return (read_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
+    trace_begin("read_callback");
+    if (debug)
+    {
+        printf("*** Read %ld bytes from buffer size %ld\n", size * nmemb, pooh->sizeleft);
     }
-    else if (pooh->sizeleft > 0)
+
+    while (room > 0 && pooh->segment < BODY_SEGMENTS)
     {
-        /*if (lost_samples > 0)
+        body_segment_t *seg = &pooh->segments[pooh->segment];
+
+        n = seg->len - pooh->offset;
+        if (n == 0)
         {
-            fprintf(stderr, "Lost %ld samples due to ring buffer overflow\n", lost_samples);
-            lost_samples = 0;
-        }*/
+            pooh->segment++;
+            pooh->offset = 0;
+            continue;
+        }
+        if (n > room)
+            n = room;
 
-        while (1)
+        if (seg->ptr != NULL)
         {
+            memcpy(out + copied, seg->ptr + pooh->offset, n);
+        }
+        else
+        {
+            /* audio goes from the capture ring straight into curl's buffer, as soon as there is some */
+            actual_read = n / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+            if (actual_read == 0)
+                break;
             available_samples = PaUtil_GetRingBufferReadAvailable(pooh->pa_ring_buf);
-            if (available_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL) >= pooh->sizeleft)
+            /* the stop is acquired before the last look, so the samples written ahead of it are seen */
+            if (available_samples == 0 && seg->len == BODY_OPEN && is_in.load(std::memory_order_acquire) == STOP_INPUT &&
+                    record_ring.load() == pooh->pa_ring_buf && PaUtil_GetRingBufferReadAvailable(pooh->pa_ring_buf) == 0)
             {
-                break;
+                /* the recording ended and is all sent, the tailer follows */
+                int i;
+                seg->len = pooh->offset;
+                pooh->sizeleft = 0;
+                for (i = pooh->segment + 1; i < BODY_SEGMENTS; i++)
+                    pooh->sizeleft += pooh->segments[i].len;
+                continue;
             }
-            Pa_Sleep(10);
-        }
-
-        actual_read = pooh->sizeleft / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+            if (available_samples == 0 && copied == 0)
+            {
+                /*
+                 * Published before the second look, so audio or a stop arriving
+                 * in between still wakes us. The fence pairs with the one in the
+                 * capture callback, one side always sees the other's store.
+                 */
+                upload_waiting = pooh->curl;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                available_samples = PaUtil_GetRingBufferReadAvailable(pooh->pa_ring_buf);
+                if (available_samples == 0 &&
+                        !(seg->len == BODY_OPEN && is_in.load() == STOP_INPUT && record_ring.load() == pooh->pa_ring_buf))
+                {
+                    net_paused(pooh->curl);
+                    trace_instant("upload_pause");
+                    trace_end("read_callback");
+                    return CURL_READFUNC_PAUSE;
+                }
+                upload_waiting = NULL;
+                if (available_samples == 0)
+                    continue;       // the recording just ended, the check above closes the body
+            }
+            if (available_samples == 0)
+                break;      // send the headers now, the audio in the next call
+            if (actual_read > available_samples)
+                actual_read = available_samples;
 
-        pthread_mutex_lock(&in_ring_mutex);
-        read_samples = PaUtil_ReadRingBuffer(pooh->pa_ring_buf, ptr, actual_read);
-        pthread_mutex_unlock(&in_ring_mutex);
-        if (read_samples != actual_read)
-        {
-            fprintf(stderr, "%ld samples were available, but only %ld samples were read\n",
-                    available_samples, read_samples);
+            pthread_mutex_lock(&in_ring_mutex);
+            read_samples = PaUtil_ReadRingBuffer(pooh->pa_ring_buf, out + copied, actual_read);
+            pthread_mutex_unlock(&in_ring_mutex);
+            n = read_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+            if (pooh->audio != NULL && pooh->audio_len + n <= pooh->audio_size)
+            {
+                memcpy(pooh->audio + pooh->audio_len, out + copied, n);
+                pooh->audio_len += n;
+            }
+            else if (pooh->audio != NULL)
+            {
+                /* a partial copy is no use to anyone */
+                free(pooh->audio);
+                pooh->audio = NULL;
+            }
+            if (read_samples != actual_read)
+            {
+                fprintf(stderr, "%ld samples were available, but only %ld samples were read\n",
+                        available_samples, read_samples);
+                stats_count(&audio_stats.partial_reads, 1, &audio_stats.last_partial_read);
+            }
+            room = n;       // the rest of the room waits for more audio
         }
 
-        pooh->sizeleft -= (read_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
-        return (read_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
+        pooh->offset += n;
+        if (seg->len != BODY_OPEN)
+            pooh->sizeleft -= n;
+        copied += n;
+        room -= n;
     }
+    pooh->sent += copied;
 
-    return 0; /* no more data left to deliver */
+    if (pooh->sizeleft == 0 && pooh->sent_at == 0)
+    {
+        pooh->sent_at = stats_now();
+        if (pooh->hedge != NULL)
+            pooh->hedge->sent_at = pooh->sent_at;
+    }
+    trace_end("read_callback");
+    return copied; /* 0 once there is no more data left to deliver */
 }
 
-static void json_get_str(jsmntok_t *t, const char *data, char *name)
+static void json_paths_init(void)
 {
-    int len = t->end - t->start;
-    memcpy(name, data + t->start, len);
-    name[len] = '\0';
+    json_path_compile(&path_access_token, "access_token");
+    json_path_compile(&path_refresh_token, "refresh_token");
+    json_path_compile(&path_expires_in, "expires_in");
+    json_path_compile(&path_error, "error");
+    json_path_compile(&path_namespace, "namespace");
+    json_path_compile(&path_name, "name");
+    json_path_compile(&path_audio_content, "payload.audioContent");
+    json_path_compile(&path_listen_timeout, "payload.timeoutIntervalInMillis");
+    json_path_compile(&path_stream_url, "payload.audioItem.streams[0].streamUrl");
+    json_path_compile(&path_volume, "payload.volume");
+    json_path_compile(&path_mute, "payload.mute");
+    json_path_compile(&path_directive, "directive");
+    json_path_compile(&path_header_namespace, "header.namespace");
+    json_path_compile(&path_header_name, "header.name");
 }
 
-static void json_get_int(jsmntok_t *t, const char *data, int *number)
+/* Reads the reply of the token endpoint, the values it lacks are left as they are */
+static int token_response_parse(const char *js, size_t len, char *refresh_token, char *access_token, int *expired_in)
 {
-    char str[10] = {'\0'};
-    int len = t->end - t->start;
-    memcpy(str, data + t->start, len);
+    json_view_t view;
+    jsmntok_t *t;
+    int ret;
 
-    *number = atoi(str);
+    ret = json_parse(&json_tokens, js, len);
+    t = json_tokens.tokens;
+    if(ret < 0)
+    {
+        printf("Failed to parse JSON: %d\n", ret);
+        return 1;
+    }
+    else if(ret < 1 || t[0].type != JSMN_OBJECT)
+    {
+        printf("Object expected\n");
+        return 1;
+    }
+
+    if (!json_query_view(&path_access_token, js, t, ret, &view) && json_view_copy(&view, access_token, MAXBUF))
+    {
+        fprintf(stderr, "Access token too long\n");
+        return 1;
+    }
+    if (!json_query_view(&path_refresh_token, js, t, ret, &view) && json_view_copy(&view, refresh_token, MAXBUF))
+    {
+        fprintf(stderr, "Refresh token too long\n");
+        return 1;
+    }
+    if (!json_query_view(&path_expires_in, js, t, ret, &view) && json_view_int(&view, expired_in))
+    {
+        fprintf(stderr, "Invalid expires_in: %.*s\n", (int)view.len, view.ptr);
+        return 1;
+    }
+    if (!json_query_view(&path_error, js, t, ret, &view))
+    {
+        printf("Error: %.*s", (int)view.len, view.ptr);
+    }
+    return 0;
 }
 
 static void wav_format_init(unsigned short *bitspersample, unsigned short *wavformat, int enc)
@@ -344,7 +779,7 @@ static int wav_buffer_init(char *buf, unsigned short bitspersample,
     char *total_ptr, *data_ptr, *ptr = buf;
     unsigned int tmp32 = 0;
     unsigned short tmp16 = 0;
-    unsigned int total = RECORDING_TIME * ALEXA_SAMPLE_RATE * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL) / 1000;
+    unsigned int total = recording_time * ALEXA_SAMPLE_RATE * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL) / 1000;
 
     sprintf(ptr, "RIFF"); ptr += 4;
     total_ptr = ptr; ptr += 4;          // save total size ptr
@@ -379,228 +814,697 @@ static int wav_buffer_init(char *buf, unsigned short bitspersample,
     return (ptr - buf);
 }
 
-static int get_refresh_token(const char *client_id, const char *client_secret, const char *code,
-        char *refresh_token, char *access_token, int *expired_in)
+/* HTTP/2 where the server offers it. A transfer started while the connection
+ * to its host is still being set up waits for it instead of opening another,
+ * so requests, pings and the downchannel share one TLS connection. */
+static void http2_setopt(CURL *curl)
 {
-    CURL *curl;
-    char getRefreshToken[] = "https://api.amazon.com/auth/o2/token";
-    char error_str[128];
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+}
 
-    curl = curl_easy_init();
-    if(curl)
-    {
-        struct curl_slist *chunk = NULL;
-        char content[512] = {'\0'};
-        string_t response;
-        CURLcode res;
-
-        int ret, i;
-        jsmn_parser p;
-        char name[32];
-        jsmntok_t t[16]; /* We expect no more than 128 tokens */
-
-        init_string(&response);
-
-        sprintf(content, "grant_type=authorization_code&code=%s&client_id=%s&"
-                "client_secret=%s&redirect_uri=https://localhost",
-                code, client_id, client_secret);
-
-        chunk = curl_slist_append(chunk, "Host: api.amazon.com");
-        chunk = curl_slist_append(chunk, "Content-Type: application/x-www-form-urlencoded");
-        chunk = curl_slist_append(chunk, "Cache-Control: no-cache");
-
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, content);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-        curl_easy_setopt(curl, CURLOPT_URL, getRefreshToken);
-        if (debug)
-        {
-            curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-        }
-        else
-        {
-            curl_easy_setopt(curl, CURLOPT_VERBOSE, 0);
-        }
+static size_t discard_writefunc(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    (void)ptr;
+    (void)userp;
+    return size * nmemb;
+}
 
-        if (debug)
-        {
-            printf("Body: %s\n", content);
-        }
+static void downchannel_match(void *arg, const char *js, const jsmntok_t *t)
+{
+    (void)js;
+    if (*(const jsmntok_t **)arg == NULL)
+        *(const jsmntok_t **)arg = t;
+}
 
-        res = curl_easy_perform(curl);
-        curl_slist_free_all(chunk);
-        curl_easy_cleanup(curl);
+/* One JSON part of the downchannel, {"directive":{"header":{..},"payload":{..}}} */
+static void downchannel_part(downchannel_t *dc, const char *js, size_t len)
+{
+    const jsmntok_t *t = NULL;
+    json_view_t ns, name;
+    int count, n;
 
-        if(res != CURLE_OK)
-        {
-            fprintf(stderr, "get_refresh_token failed: %s\n", curl_easy_strerror(res));
-            return res;
-        }
+    count = json_parse(&dc->tokens, js, len);
+    if (count < 1)
+    {
+        printf("Failed to parse JSON: %d\n", count);
+        return;
+    }
+    if (!json_query(&path_directive, js, dc->tokens.tokens, count, downchannel_match, &t) ||
+            t->type != JSMN_OBJECT)
+        return;
+
+    /* the directive and its children */
+    for (n = 1; t + n < dc->tokens.tokens + count && t[n].start < t->end; n++)
+        ;
+    if (json_query_view(&path_header_namespace, js, t, n, &ns) ||
+            json_query_view(&path_header_name, js, t, n, &name))
+        return;
+    directive_dispatch(&dc->context, js, t, n, &ns, &name);
+
+    /* Speak and ExpectSpeech follow a recognize reply, here there is none to play or answer */
+    if (dc->context.speak_count || dc->context.reask)
+    {
+        printf("%.*s.%.*s is not supported on the downchannel, skipping\n",
+                (int)ns.len, ns.ptr, (int)name.len, name.ptr);
+        dc->context.speak_count = 0;
+        dc->context.reask = 0;
+    }
+}
 
-        jsmn_init(&p);
-        ret = jsmn_parse(&p, response.ptr, strlen(response.ptr), t, sizeof(t) / sizeof(t[0]));
-        if(ret < 0)
-        {
-            printf("Failed to parse JSON: %d\n", ret);
-            ret = 1;
-        }
-        else if(ret < 1 || t[0].type != JSMN_OBJECT)
+/*
+ * The downchannel never ends while the connection is up, so each part is
+ * dispatched as soon as the next boundary closes it and only the part
+ * still arriving is kept.
+ */
+static size_t downchannel_writefunc(void *ptr, size_t size, size_t nmemb, downchannel_t *dc)
+{
+    size_t ret = writefunc(ptr, size, nmemb, &dc->body);
+    char *body = dc->body.ptr;
+    size_t len = dc->body.len;
+    char *part, *next, *json;
+    size_t bond_len;
+
+    if (!dc->boundary[0])
+    {
+        size_t start = strspn(body, " \t\r\n");
+        size_t end = start + strcspn(body + start, " \t\r\n");
+
+        if (end == len)
+            return ret;
+        if (end - start >= sizeof(dc->boundary))
         {
-            printf("Object expected\n");
-            ret = 1;
+            fprintf(stderr, "Downchannel boundary too long\n");
+            return 0;
         }
-        else
+        memcpy(dc->boundary, body + start, end - start);
+        dc->boundary[end - start] = '\0';
+    }
+    bond_len = strlen(dc->boundary);
+
+    trace_begin("downchannel_writefunc");
+    part = strnstr(body, dc->boundary, len);
+    while (part && (next = strnstr(part + bond_len, dc->boundary, len - (part + bond_len - body))))
+    {
+        if ((json = strnstr(part, "application/json", next - part)) &&
+            (json = strnstr(json, "\r\n\r\n", next - json)))
         {
-            for (i = 0; i < ret; i++)
-            {
-                if(t[i].type == JSMN_STRING && t[i].size == 1) // must be key
-                {
-                    json_get_str(&t[i], response.ptr, name);
-                    if (!strcmp(name, "access_token"))
-                    {
-                        json_get_str(&t[++i], response.ptr, access_token);
-                    }
-                    else if (!strcmp(name, "refresh_token"))
-                    {
-                        json_get_str(&t[++i], response.ptr, refresh_token);
-                    }
-                    else if (!strcmp(name, "expires_in"))
-                    {
-                        json_get_int(&t[++i], response.ptr, expired_in);
-                    }
-                    else if (!strcmp(name, "error"))
-                    {
-                        json_get_str(&t[++i], response.ptr, error_str);
-                        printf("Error: %s", error_str);
-                    }
-                }
-            }
-            ret = 0;
+            downchannel_part(dc, json + 4, (next - 2) - (json + 4));
         }
-
-        free(response.ptr);
-        return ret;
+        part = next;
     }
-    return 1;
+    if (part && part > body)
+    {
+        dc->body.len = len - (part - body);
+        memmove(body, part, dc->body.len);
+        body[dc->body.len] = '\0';
+    }
+    trace_end("downchannel_writefunc");
+    return ret;
 }
 
-static int get_access_token(const char *client_id, const char *client_secret,
-        char *refresh_token, char *access_token, int *expired_in)
+static void downchannel_done(void *arg, CURL *curl, CURLcode result)
 {
-    CURL *curl;
-    char getAccessToken[] = "https://api.amazon.com/auth/o2/token";
-    char error_str[128];
+    downchannel_t *dc = (downchannel_t *)arg;
 
-    curl = curl_easy_init();
-    if(curl)
-    {
-        struct curl_slist *chunk = NULL;
-        char content[1024] = {'\0'};
-        string_t response;
-        CURLcode res;
-
-        int ret, i;
-        jsmn_parser p;
-        char name[32];
-        jsmntok_t t[16]; /* We expect no more than 128 tokens */
-
-        init_string(&response);
-
-        sprintf(content, "grant_type=refresh_token&refresh_token=%s&client_id=%s&client_secret=%s",
-                refresh_token, client_id, client_secret);
-
-        chunk = curl_slist_append(chunk, "Host: api.amazon.com");
-        chunk = curl_slist_append(chunk, "Content-Type: application/x-www-form-urlencoded");
-        chunk = curl_slist_append(chunk, "Cache-Control: no-cache");
-
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, content);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-        curl_easy_setopt(curl, CURLOPT_URL, getAccessToken);
-        if (debug)
-        {
-            curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-        }
-        else
-        {
-            curl_easy_setopt(curl, CURLOPT_VERBOSE, 0);
-        }
+    (void)curl;
+    dc->result = result;
+    downchannel_closed.store(true, std::memory_order_release);
+}
 
-        if (debug)
-        {
-            printf("Body: %s\n", content);
-        }
+static void downchannel_free(downchannel_t *dc)
+{
+    if (dc->curl == NULL)
+        return;
+    curl_slist_free_all(dc->headers);
+    curl_easy_cleanup(dc->curl);
+    free(dc->body.ptr);
+    dc->body.ptr = NULL;
+    dc->curl = NULL;
+}
 
-        res = curl_easy_perform(curl);
-        curl_slist_free_all(chunk);
-        curl_easy_cleanup(curl);
+/*
+ * Keeps the downchannel open, on the main thread. One which closed is
+ * opened again after DOWNCHANNEL_RETRY, with the access token of the
+ * moment. access_token is NULL while there is no usable token.
+ */
+static void downchannel_poll(downchannel_t *dc, const char *url, const char *access_token, time_t now)
+{
+    char header_token[MAXBUF + 32];
 
-        if(res != CURLE_OK)
-        {
-            fprintf(stderr, "get_access_token failed: %s\n", curl_easy_strerror(res));
-            return res;
-        }
+    if (dc->curl != NULL)
+    {
+        if (!downchannel_closed.load(std::memory_order_acquire))
+            return;
+        downchannel_closed = false;
+        fprintf(stderr, "Downchannel closed: %s\n", curl_easy_strerror(dc->result));
+        downchannel_free(dc);
+        dc->retry_at = now + DOWNCHANNEL_RETRY;
+        return;
+    }
+    if (!url[0] || access_token == NULL || now < dc->retry_at)
+        return;
 
-        jsmn_init(&p);
-        ret = jsmn_parse(&p, response.ptr, strlen(response.ptr), t, sizeof(t) / sizeof(t[0]));
-        if(ret < 0)
-        {
-            printf("Failed to parse JSON: %d\n", ret);
-            ret = 1;
-        }
-        else if(ret < 1 || t[0].type != JSMN_OBJECT)
-        {
-            printf("Object expected\n");
-            ret = 1;
-        }
-        else
-        {
-            for (i = 0; i < ret; i++)
+    dc->curl = curl_easy_init();
+    if (dc->curl == NULL)
+    {
+        dc->retry_at = now + DOWNCHANNEL_RETRY;
+        return;
+    }
+    init_string(&dc->body);
+    dc->boundary[0] = '\0';
+    sprintf(header_token, "Authorization: Bearer %s", access_token);
+    dc->headers = curl_slist_append(NULL, header_token);
+
+    /* no CURLOPT_TIMEOUT, the stream lasts as long as the service keeps it */
+    curl_easy_setopt(dc->curl, CURLOPT_HTTPHEADER, dc->headers);
+    curl_easy_setopt(dc->curl, CURLOPT_WRITEFUNCTION, downchannel_writefunc);
+    curl_easy_setopt(dc->curl, CURLOPT_WRITEDATA, dc);
+    curl_easy_setopt(dc->curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(dc->curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(dc->curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(dc->curl, CURLOPT_URL, url);
+    curl_easy_setopt(dc->curl, CURLOPT_VERBOSE, debug ? 1L : 0L);
+    http2_setopt(dc->curl);
+
+    if (net_submit(dc->curl, downchannel_done, dc))
+    {
+        downchannel_free(dc);
+        dc->retry_at = now + DOWNCHANNEL_RETRY;
+        return;
+    }
+    trace_instant("downchannel_open");
+}
+
+static void ping_done(void *arg, CURL *curl, CURLcode result)
+{
+    ping_t *ping = (ping_t *)arg;
+
+    if (result != CURLE_OK)
+        fprintf(stderr, "Ping failed: %s\n", curl_easy_strerror(result));
+    curl_slist_free_all(ping->headers);
+    curl_easy_cleanup(curl);
+    free(ping);
+}
+
+/* A request on the shared connection so that it is never idle long enough
+ * to be dropped. It cleans up after itself on the network thread. */
+static void ping_send(const char *url, const char *access_token)
+{
+    char header_token[MAXBUF + 32];
+    ping_t *ping;
+    CURL *curl;
+
+    ping = (ping_t *)malloc(sizeof(ping_t));
+    if (ping == NULL)
+        return;
+    curl = curl_easy_init();
+    if (curl == NULL)
+    {
+        free(ping);
+        return;
+    }
+    sprintf(header_token, "Authorization: Bearer %s", access_token);
+    ping->headers = curl_slist_append(NULL, header_token);
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, ping->headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_writefunc);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, debug ? 1L : 0L);
+    http2_setopt(curl);
+
+    if (net_submit(curl, ping_done, ping))
+        ping_done(ping, curl, CURLE_FAILED_INIT);
+    else
+        trace_instant("ping");
+}
+
+static void warmup_done(void *arg, CURL *curl, CURLcode result)
+{
+    (void)arg;
+    if (result != CURLE_OK && debug)
+        fprintf(stderr, "Warm-up failed: %s\n", curl_easy_strerror(result));
+    curl_easy_cleanup(curl);
+}
+
+/*
+ * Opens the connection of the next speech request ahead of it, so DNS, TCP
+ * and TLS overlap with the earcon and the start of the utterance. A HEAD
+ * of the endpoint is enough: its connection stays in the pool, and a
+ * request made while it is still being set up waits for it (PIPEWAIT).
+ */
+static void warmup_start(const char *endpoint)
+{
+    CURL *curl;
+
+    curl = curl_easy_init();
+    if (curl == NULL)
+        return;
+
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl, CURLOPT_URL, endpoint);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, debug ? 1L : 0L);
+    http2_setopt(curl);
+
+    if (net_submit(curl, warmup_done, NULL))
+    {
+        curl_easy_cleanup(curl);
+        return;
+    }
+    trace_instant("warmup");
+    stats_count(&request_stats.warmups, 1, NULL);
+}
+
+/* Round trip of a HEAD, from the request going out to the reply, the connection setup left out */
+static void endpoint_probe_done(void *arg, CURL *curl, CURLcode result)
+{
+    endpoint_t *ep = (endpoint_t *)arg;
+    curl_off_t pretransfer = 0, starttransfer = 0;
+    long code = 0;
+
+    ep->sample_us = -1;
+    if (result == CURLE_OK)
+    {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+        curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        if (code > 0 && code < 500)
+            ep->sample_us = starttransfer > pretransfer ? starttransfer - pretransfer : 1;
+    }
+    else if (debug)
+    {
+        fprintf(stderr, "Probe of %s failed: %s\n", ep->url, curl_easy_strerror(result));
+    }
+    ep->probed = true;
+}
+
+/* A HEAD like warmup_start(), on the shared connection once there is one */
+static void endpoint_probe_start(endpoint_t *ep)
+{
+    ep->curl = curl_easy_init();
+    if (ep->curl == NULL)
+        return;
+
+    curl_easy_setopt(ep->curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(ep->curl, CURLOPT_CONNECTTIMEOUT, (long)ENDPOINT_PROBE_TIMEOUT);
+    curl_easy_setopt(ep->curl, CURLOPT_TIMEOUT, (long)ENDPOINT_PROBE_TIMEOUT);
+    curl_easy_setopt(ep->curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(ep->curl, CURLOPT_URL, ep->url);
+    curl_easy_setopt(ep->curl, CURLOPT_VERBOSE, debug ? 1L : 0L);
+    http2_setopt(ep->curl);
+
+    ep->probed = false;
+    if (net_submit(ep->curl, endpoint_probe_done, ep))
+    {
+        curl_easy_cleanup(ep->curl);
+        ep->curl = NULL;
+    }
+}
+
+static void endpoint_init(endpoint_t *ep, const char *url, size_t len)
+{
+    snprintf(ep->url, sizeof(ep->url), "%.*s", (int)len, url);
+    ep->curl = NULL;
+    ep->probed = false;
+    ep->sample_us = 0;
+    ep->srtt_us = 0;
+    ep->healthy = 1;
+}
+
+/* The endpoint setting lists URLs separated by commas or spaces, the first one is used until probed */
+static void endpoint_set_parse(endpoint_set_t *set, const char *list)
+{
+    const char *p = list;
+    size_t n;
+
+    snprintf(set->list, sizeof(set->list), "%s", list);
+    set->count = 0;
+    set->current = 0;
+    set->next_probe = 0;
+    while (*p && set->count < ENDPOINT_MAX)
+    {
+        p += strspn(p, ", \t");
+        n = strcspn(p, ", \t");
+        if (n == 0)
+            break;
+        endpoint_init(&set->endpoints[set->count++], p, n);
+        p += n;
+    }
+    if (set->count == 0)
+    {
+        endpoint_init(&set->endpoints[0], SPEECH_ENDPOINT, strlen(SPEECH_ENDPOINT));
+        set->count = 1;
+    }
+}
+
+/*
+ * Moves requests to the fastest healthy endpoint. A current endpoint which
+ * is down is left at once, a healthy one only for an endpoint faster by the
+ * hysteresis, so two about as fast do not take turns.
+ */
+static void endpoint_select(endpoint_set_t *set)
+{
+    endpoint_t *cur = &set->endpoints[set->current];
+    long margin;
+    int i, best = -1;
+
+    for (i = 0; i < set->count; i++)
+    {
+        endpoint_t *ep = &set->endpoints[i];
+        if (ep->healthy && ep->srtt_us && (best < 0 || ep->srtt_us < set->endpoints[best].srtt_us))
+            best = i;
+    }
+    if (best < 0 || best == set->current)
+        return;
+
+    margin = cur->srtt_us * ENDPOINT_HYSTERESIS / 100;
+    if (margin < ENDPOINT_HYSTERESIS_MIN * 1000)
+        margin = ENDPOINT_HYSTERESIS_MIN * 1000;
+    if (cur->healthy && cur->srtt_us && set->endpoints[best].srtt_us + margin >= cur->srtt_us)
+        return;
+
+    set->current = best;
+    printf("Speech endpoint %s (%.1f ms)\n", set->endpoints[best].url, set->endpoints[best].srtt_us / 1e3);
+    trace_instant("endpoint_switch");
+}
+
+/*
+ * Main thread, once per detection round. Folds in the probes which are
+ * over, probes every endpoint each ENDPOINT_PROBE_INTERVAL when there is
+ * more than one, and picks up a changed endpoint setting.
+ */
+static void endpoint_poll(endpoint_set_t *set, const char *list, time_t now)
+{
+    int i, probing = 0;
+
+    for (i = 0; i < set->count; i++)
+    {
+        endpoint_t *ep = &set->endpoints[i];
+        if (ep->curl != NULL && ep->probed)
+        {
+            curl_easy_cleanup(ep->curl);
+            ep->curl = NULL;
+            if (ep->sample_us < 0)
             {
-                if(t[i].type == JSMN_STRING && t[i].size == 1) // must be key
-                {
-                    json_get_str(&t[i], response.ptr, name);
-                    if (!strcmp(name, "access_token"))
-                    {
-                        json_get_str(&t[++i], response.ptr, access_token);
-                    }
-                    else if (!strcmp(name, "refresh_token"))
-                    {
-                        json_get_str(&t[++i], response.ptr, refresh_token);
-                    }
-                    else if (!strcmp(name, "expires_in"))
-                    {
-                        json_get_int(&t[++i], response.ptr, expired_in);
-                    }
-                    else if (!strcmp(name, "error"))
-                    {
-                        json_get_str(&t[++i], response.ptr, error_str);
-                        printf("Error: %s", error_str);
-                    }
-                }
+                ep->healthy = 0;
             }
-            ret = 0;
+            else
+            {
+                ep->srtt_us = ep->srtt_us ? (ep->srtt_us * 7 + ep->sample_us) / 8 : ep->sample_us;
+                ep->healthy = 1;
+            }
+            trace_counter("endpoint_rtt_us", ep->sample_us);
         }
+        if (ep->curl != NULL)
+            probing++;
+    }
+
+    /* probes write into their slots, so a new list waits for them */
+    if (strcmp(set->list, list))
+    {
+        if (probing)
+            return;
+        endpoint_set_parse(set, list);
+    }
+
+    if (set->count > 1 && now >= set->next_probe)
+    {
+        for (i = 0; i < set->count; i++)
+            if (set->endpoints[i].curl == NULL)
+                endpoint_probe_start(&set->endpoints[i]);
+        set->next_probe = now + ENDPOINT_PROBE_INTERVAL;
+    }
+    endpoint_select(set);
+}
+
+static const char *endpoint_url(const endpoint_set_t *set)
+{
+    return set->endpoints[set->current].url;
+}
+
+/* Where hedges and retries go, the best other healthy endpoint or the current one */
+static const char *endpoint_alternate(const endpoint_set_t *set)
+{
+    int i, best = set->current;
+
+    for (i = 0; i < set->count; i++)
+    {
+        const endpoint_t *ep = &set->endpoints[i];
+        if (i != set->current && ep->healthy &&
+                (best == set->current || ep->srtt_us < set->endpoints[best].srtt_us))
+            best = i;
+    }
+    return set->endpoints[best].url;
+}
+
+/* A request to the current endpoint failed, it is down until a probe goes through.
+ * A single endpoint is never probed, and there is nowhere else to go anyway. */
+static void endpoint_failed(endpoint_set_t *set)
+{
+    if (set->count == 1)
+        return;
+    set->endpoints[set->current].healthy = 0;
+    endpoint_select(set);
+}
+
+static void endpoint_set_free(endpoint_set_t *set)
+{
+    int i;
+
+    for (i = 0; i < set->count; i++)
+    {
+        if (set->endpoints[i].curl != NULL)
+            curl_easy_cleanup(set->endpoints[i].curl);
+        set->endpoints[i].curl = NULL;
+    }
+    set->count = 0;
+}
+
+/* Builds a request to the token endpoint, the caller sends it through the network thread */
+static CURL *token_request(const char *content, string_t *response, struct curl_slist **chunk)
+{
+    CURL *curl;
+
+    curl = curl_easy_init();
+    if (curl == NULL)
+        return NULL;
+
+    *chunk = curl_slist_append(NULL, "Host: api.amazon.com");
+    *chunk = curl_slist_append(*chunk, "Content-Type: application/x-www-form-urlencoded");
+    *chunk = curl_slist_append(*chunk, "Cache-Control: no-cache");
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *chunk);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, content);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl, CURLOPT_URL, TOKEN_ENDPOINT);
+    if (debug)
+    {
+        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+        printf("Body: %s\n", content);
+    }
+    else
+    {
+        curl_easy_setopt(curl, CURLOPT_VERBOSE, 0);
+    }
+    return curl;
+}
+
+static int get_refresh_token(const char *client_id, const char *client_secret, const char *code,
+        char *refresh_token, char *access_token, int *expired_in)
+{
+    struct curl_slist *chunk = NULL;
+    char content[512] = {'\0'};
+    string_t response;
+    CURLcode res;
+    CURL *curl;
+    int ret;
+
+    if (snprintf(content, sizeof(content), "grant_type=authorization_code&code=%s&client_id=%s&"
+            "client_secret=%s&redirect_uri=https://localhost",
+            code, client_id, client_secret) >= (int)sizeof(content))
+    {
+        fprintf(stderr, "get_refresh_token failed: request too long\n");
+        return 1;
+    }
 
+    init_string(&response);
+    curl = token_request(content, &response, &chunk);
+    if (curl == NULL)
+    {
         free(response.ptr);
-        return ret;
+        return 1;
     }
-    return 1;
+    res = net_perform(curl);
+    curl_slist_free_all(chunk);
+    curl_easy_cleanup(curl);
+
+    if(res != CURLE_OK)
+    {
+        fprintf(stderr, "get_refresh_token failed: %s\n", curl_easy_strerror(res));
+        free(response.ptr);
+        return res;
+    }
+
+    ret = token_response_parse(response.ptr, response.len, refresh_token, access_token, expired_in);
+
+    free(response.ptr);
+    return ret;
+}
+
+static int get_access_token(const char *client_id, const char *client_secret,
+        char *refresh_token, char *access_token, int *expired_in)
+{
+    struct curl_slist *chunk = NULL;
+    char content[1024] = {'\0'};
+    string_t response;
+    CURLcode res;
+    CURL *curl;
+    int ret;
+
+    if (snprintf(content, sizeof(content), "grant_type=refresh_token&refresh_token=%s&client_id=%s&client_secret=%s",
+            refresh_token, client_id, client_secret) >= (int)sizeof(content))
+    {
+        fprintf(stderr, "get_access_token failed: request too long\n");
+        return 1;
+    }
+
+    init_string(&response);
+    curl = token_request(content, &response, &chunk);
+    if (curl == NULL)
+    {
+        free(response.ptr);
+        return 1;
+    }
+    res = net_perform(curl);
+    curl_slist_free_all(chunk);
+    curl_easy_cleanup(curl);
+
+    if(res != CURLE_OK)
+    {
+        fprintf(stderr, "get_access_token failed: %s\n", curl_easy_strerror(res));
+        free(response.ptr);
+        return res;
+    }
+
+    ret = token_response_parse(response.ptr, response.len, refresh_token, access_token, expired_in);
+
+    free(response.ptr);
+    return ret;
+}
+
+/* Token older than its lifetime less the safety margin and `ahead` seconds */
+static int token_expiring(const alexa_config_t *config, time_t now, int ahead)
+{
+    return !strlen(config->access_token) || config->created_time == 0 || config->expired_in == 0 ||
+            (now - config->created_time) > (config->expired_in - TOKEN_MARGIN - ahead);
+}
+
+static void token_refresh_done(void *arg, CURL *curl, CURLcode result)
+{
+    token_refresh_t *refresh = (token_refresh_t *)arg;
+
+    (void)curl;
+    refresh->result = result;
+    token_refreshed.store(true, std::memory_order_release);
+}
+
+/*
+ * Refreshes the access token in the background before it expires, so a
+ * hotword rarely has to wait for the token endpoint. Nothing happens while
+ * a refresh is in flight or after a failure until retry_at.
+ */
+static void token_refresh_start(const alexa_config_t *config, time_t now)
+{
+    if (token_refresh.curl != NULL || now < token_refresh.retry_at)
+        return;
+
+    init_string(&token_refresh.response);
+    token_refresh.headers = NULL;
+    if (snprintf(token_refresh.content, sizeof(token_refresh.content),
+            "grant_type=refresh_token&refresh_token=%s&client_id=%s&client_secret=%s",
+            config->refresh_token, config->client_id, config->client_secret) < (int)sizeof(token_refresh.content))
+        token_refresh.curl = token_request(token_refresh.content, &token_refresh.response, &token_refresh.headers);
+    else
+        fprintf(stderr, "Refresh access token failed: request too long\n");
+    if (token_refresh.curl != NULL && !net_submit(token_refresh.curl, token_refresh_done, &token_refresh))
+    {
+        trace_instant("token_refresh");
+        return;
+    }
+
+    if (token_refresh.curl != NULL)
+        curl_easy_cleanup(token_refresh.curl);
+    curl_slist_free_all(token_refresh.headers);
+    free(token_refresh.response.ptr);
+    token_refresh.curl = NULL;
+    token_refresh.retry_at = now + TOKEN_RETRY;
+}
+
+/* Takes the result of a finished background refresh, on the main thread */
+static void token_refresh_apply(Config *cfg, alexa_config_t *config, time_t now)
+{
+    char refresh_token[MAXBUF], access_token[MAXBUF] = {'\0'};
+    int expired_in = config->expired_in;
+
+    if (token_refresh.curl == NULL || !token_refreshed.load(std::memory_order_acquire))
+        return;
+    token_refreshed = false;
+    curl_slist_free_all(token_refresh.headers);
+    curl_easy_cleanup(token_refresh.curl);
+    token_refresh.curl = NULL;
+
+    strcpy(refresh_token, config->refresh_token);
+    if (token_refresh.result != CURLE_OK)
+    {
+        fprintf(stderr, "Refresh access token failed: %s\n", curl_easy_strerror(token_refresh.result));
+        token_refresh.retry_at = now + TOKEN_RETRY;
+    }
+    else if (token_response_parse(token_refresh.response.ptr, token_refresh.response.len,
+            refresh_token, access_token, &expired_in) || !strlen(access_token))
+    {
+        fprintf(stderr, "Refresh access token failed\n");
+        token_refresh.retry_at = now + TOKEN_RETRY;
+    }
+    else
+    {
+        strcpy(config->refresh_token, refresh_token);
+        strcpy(config->access_token, access_token);
+        config->expired_in = expired_in;
+        config->created_time = now;
+        ConfigAddString(cfg, ALEXA_SECTION, ALEXA_ACCESS_TOKEN, config->access_token);
+        ConfigAddUnsignedInt(cfg, ALEXA_SECTION, ALEXA_CREATED_TIME, config->created_time);
+        ConfigAddUnsignedInt(cfg, ALEXA_SECTION, ALEXA_EXPIRED_IN, config->expired_in);
+    }
+    free(token_refresh.response.ptr);
+}
+
+/* Drops a refresh still in flight at exit, once the network thread has stopped */
+static void token_refresh_free(void)
+{
+    if (token_refresh.curl == NULL)
+        return;
+    curl_slist_free_all(token_refresh.headers);
+    curl_easy_cleanup(token_refresh.curl);
+    free(token_refresh.response.ptr);
+    token_refresh.curl = NULL;
 }
 
 static ring_buffer_size_t stream_read(PaUtilRingBuffer *pa_ring_buf, std::vector<int16_t>* data)
 {
     ring_buffer_size_t read_samples, available_samples = 0;
-    /*if (lost_samples > 0)
-    {
-        fprintf(stderr, "Lost %ld samples due to ring buffer overflow\n", lost_samples);
-        lost_samples = 0;
-    }*/
+    stats_warn();
 
-    while (1)
+    trace_begin("stream_read");
+    trace_begin("ring_wait");
+    while (running)
     {
         available_samples = PaUtil_GetRingBufferReadAvailable(pa_ring_buf);
         if (available_samples >= (ALEXA_SAMPLE_RATE * 0.1))
@@ -609,6 +1513,12 @@ static ring_buffer_size_t stream_read(PaUtilRingBuffer *pa_ring_buf, std::vector
         }
         Pa_Sleep(10);
     }
+    trace_end("ring_wait");
+    if (!running)
+    {
+        trace_end("stream_read");
+        return 0;
+    }
 
     data->resize(available_samples);
     pthread_mutex_lock(&in_ring_mutex);
@@ -618,155 +1528,539 @@ static ring_buffer_size_t stream_read(PaUtilRingBuffer *pa_ring_buf, std::vector
     {
         fprintf(stderr, "%ld samples were available, but only %ld samples were read\n",
                 available_samples, read_samples);
+        stats_count(&audio_stats.partial_reads, 1, &audio_stats.last_partial_read);
     }
 
+    trace_end("stream_read");
     return read_samples;
 }
 
-static void *create_multipart_wav_buffer(void *userData)
+/*
+ * Chains the request body and starts recording its audio. The capture
+ * ring only ever holds audio, the text parts are sent from their own
+ * buffers. An open body leaves the ring and the recording alone, its audio
+ * ends once a recording into the ring is over and drained.
+ */
+static void speech_body_init(data_stream_t *pooh, int open)
+{
+    static char header[MAXBUF];
+    static char tailer[128];
+    size_t audio_size;
+    int i;
+
+    trace_begin("speech_body_init");
+    if (!header[0])
+    {
+        sprintf(header, DATA_HEADER, BOUNDARY, ALEXA_SAMPLE_RATE, BOUNDARY, ALEXA_SAMPLE_RATE);
+        sprintf(tailer, DATA_TAILER, BOUNDARY);
+    }
+
+    if (open)
+    {
+        audio_size = BODY_OPEN;
+    }
+    else
+    {
+        pthread_mutex_lock(&in_ring_mutex);
+        PaUtil_FlushRingBuffer(pooh->pa_ring_buf);
+        left_samples = recording_time * ALEXA_SAMPLE_RATE / 1000;
+        audio_size = left_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+        record_ring = pooh->pa_ring_buf;
+        is_in = RECORD_INPUT;
+        pthread_mutex_unlock(&in_ring_mutex);
+    }
+
+    pooh->segments[0].ptr = header;
+    pooh->segments[0].len = strlen(header);
+    pooh->segments[1].ptr = pooh->wav_header;
+    pooh->segments[1].len = wav_buffer_init(pooh->wav_header, BYTES_PER_SAMPLE * 8,
+            WAVE_FORMAT_PCM, ALEXA_SAMPLE_RATE, NUMBER_OF_CHANNEL);
+    pooh->segments[2].ptr = NULL;
+    pooh->segments[2].len = audio_size;
+    pooh->segments[3].ptr = tailer;
+    pooh->segments[3].len = strlen(tailer);
+
+    pooh->segment = 0;
+    pooh->offset = 0;
+    pooh->sent_at = 0;
+    pooh->sent = 0;
+    pooh->sizeleft = 0;
+    for (i = 0; i < BODY_SEGMENTS; i++)
+        if (pooh->segments[i].len != BODY_OPEN)
+            pooh->sizeleft += pooh->segments[i].len;
+    trace_end("speech_body_init");
+}
+
+/* Headers and options shared by a speech request and its replays */
+static void speech_request_setopt(speech_request_t *req, const char *endpoint, const char *access_token, int open)
+{
+    char header_token[1024] = {'\0'};
+    char header_type[128] = {'\0'};
+
+    sprintf(header_token, "Authorization: Bearer %s", access_token);
+    sprintf(header_type, "Content-Type: multipart/form-data; boundary=%s", BOUNDARY);
+
+    req->headers = NULL;
+    req->headers = curl_slist_append(req->headers, header_token);
+    req->headers = curl_slist_append(req->headers, header_type);
+
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(req->curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(req->curl, CURLOPT_READFUNCTION, read_callback);
+    curl_easy_setopt(req->curl, CURLOPT_READDATA, &req->pooh);
+    /* without a size HTTP/2 just sends DATA frames until the read callback ends the body */
+    if (!open)
+        curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE, req->pooh.sizeleft);
+    curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, speech_writefunc);
+    curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, req->response);
+    req->response->curl = req->curl;
+    curl_easy_setopt(req->curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(req->curl, CURLOPT_TIMEOUT, 10L);
+    curl_easy_setopt(req->curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(req->curl, CURLOPT_URL, endpoint);
+    http2_setopt(req->curl);
+    if (debug)
+    {
+        curl_easy_setopt(req->curl, CURLOPT_VERBOSE, 1L);
+    }
+    else
+    {
+        curl_easy_setopt(req->curl, CURLOPT_VERBOSE, 0);
+    }
+}
+
+/*
+ * Starts a speech request on the network thread and returns, the response
+ * fills in while the caller goes on. An open request streams whatever
+ * audio the ring gets until a recording into it ends, with no length up
+ * front. The JSON part is parsed with arena.
+ */
+static int speech_request_start(speech_request_t *req, const char *endpoint, const char *access_token,
+        PaUtilRingBuffer *pa_ring_buf, json_arena_t *arena, int open)
+{
+    speech_response_t *response = req->response;
+
+    req->curl = curl_easy_init();
+    if (req->curl == NULL)
+        return 1;
+
+    req->hedge.winner = NULL;
+    req->hedge.sent_at = 0;
+    req->pooh.pa_ring_buf = pa_ring_buf;
+    req->pooh.curl = req->curl;
+    req->pooh.hedge = &req->hedge;
+    speech_body_init(&req->pooh, open);
+    /* kept for a hedge or a retry, which sends the whole utterance again */
+    req->pooh.audio_len = 0;
+    req->pooh.audio_size = open ? (SPECULATION_PREROLL + SPECULATION_WINDOW + RECORDING_TIME_MAX) *
+            (ALEXA_SAMPLE_RATE / 1000) * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL) : req->pooh.segments[2].len;
+    req->pooh.audio = (char *)malloc(req->pooh.audio_size);
+
+    init_string(&response->body);
+    response->first_byte_at = 0;
+    response->hedge = &req->hedge;
+    json_stream_init(&response->json, arena, "directives", speech_directive, response);
+
+    speech_request_setopt(req, endpoint, access_token, open);
+
+    /* the transfer runs on the network thread, its callbacks fill response */
+    net_submit_wait(req->curl, &req->wait);
+    return 0;
+}
+
+/*
+ * Sends the utterance of first again from its copy. To the same endpoint
+ * it goes fresh on a connection of its own, so a stalled one does not
+ * hold it up. Requests of a race parse their replies at the same time on
+ * the network thread, so each has its own arena.
+ */
+static int speech_request_replay(speech_request_t *req, speech_request_t *first, const char *endpoint,
+        int fresh, const char *access_token)
+{
+    speech_response_t *response = req->response;
+    int i;
+
+    req->curl = curl_easy_init();
+    if (req->curl == NULL)
+        return 1;
+
+    memcpy(req->pooh.segments, first->pooh.segments, sizeof(req->pooh.segments));
+    req->pooh.segments[2].ptr = first->pooh.audio;
+    req->pooh.segments[2].len = first->pooh.audio_len;
+    req->pooh.pa_ring_buf = NULL;
+    req->pooh.curl = req->curl;
+    req->pooh.hedge = NULL;
+    req->pooh.audio = NULL;
+    req->pooh.segment = 0;
+    req->pooh.offset = 0;
+    req->pooh.sent_at = 0;
+    req->pooh.sent = 0;
+    req->pooh.sizeleft = 0;
+    for (i = 0; i < BODY_SEGMENTS; i++)
+        req->pooh.sizeleft += req->pooh.segments[i].len;
+
+    memset(response, 0, sizeof(speech_response_t));
+    init_string(&response->body);
+    response->player = first->response->player;
+    response->hedge = &first->hedge;
+    json_stream_init(&response->json, &req->tokens, "directives", speech_directive, response);
+
+    speech_request_setopt(req, endpoint, access_token, 0);
+    if (fresh)
+    {
+        curl_easy_setopt(req->curl, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(req->curl, CURLOPT_PIPEWAIT, 0L);
+    }
+
+    net_submit_wait(req->curl, &req->wait);
+    return 0;
+}
+
+/* The part of the recording a failed upload did not send, into its copy */
+static void speech_audio_rest(data_stream_t *pooh)
 {
-    data_stream_t *pooh = (data_stream_t *)userData;
-    ring_buffer_size_t read_samples, written_samples;
-    size_t total_size = 0;
-    char buffer[MAXBUF];
+    ring_buffer_size_t n;
+    size_t len;
+
+    while (running && is_in == RECORD_INPUT)
+        Pa_Sleep(HEDGE_POLL);
+    if (pooh->audio == NULL)
+        return;
 
     pthread_mutex_lock(&in_ring_mutex);
-    PaUtil_FlushRingBuffer(pooh->pa_ring_buf);
-    sprintf(buffer, DATA_HEADER, BOUNDARY, ALEXA_SAMPLE_RATE, BOUNDARY, ALEXA_SAMPLE_RATE);
+    n = PaUtil_GetRingBufferReadAvailable(pooh->pa_ring_buf);
+    len = n * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+    if (pooh->audio_len + len <= pooh->audio_size)
+    {
+        PaUtil_ReadRingBuffer(pooh->pa_ring_buf, pooh->audio + pooh->audio_len, n);
+        pooh->audio_len += len;
+    }
+    else
+    {
+        free(pooh->audio);
+        pooh->audio = NULL;
+    }
+    pthread_mutex_unlock(&in_ring_mutex);
+}
+
+/* Waits for a started speech request, 0 once it got its reply */
+static int speech_request_finish(speech_request_t *req)
+{
+    speech_response_t *response = req->response;
+    CURLcode res;
+    long code = 0, connects = 0;
+    curl_off_t setup = 0;
+
+    res = net_wait(&req->wait);
+    upload_waiting = NULL;
+    /* the status line reads HTTP/1.1 or HTTP/2, curl has the code either way */
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (res == CURLE_OK)
+    {
+        /* connections opened by this request, none when a warm one was found */
+        curl_easy_getinfo(req->curl, CURLINFO_NUM_CONNECTS, &connects);
+        curl_easy_getinfo(req->curl, CURLINFO_PRETRANSFER_TIME_T, &setup);
+        stats_request(setup, (response->first_byte_at > req->pooh.sent_at && req->pooh.sent_at) ?
+                (response->first_byte_at - req->pooh.sent_at) / 1000 : 0, connects == 0);
+        trace_counter("connection_setup_us", (long)setup);
+    }
+    curl_slist_free_all(req->headers);
+    curl_easy_cleanup(req->curl);
+    req->curl = NULL;
+
+    if(res != CURLE_OK)
+    {
+        /* a cancelled request was abandoned on purpose */
+        if (res != CURLE_ABORTED_BY_CALLBACK)
+            fprintf(stderr, "upload_file failed: %s\n", curl_easy_strerror(res));
+        if (res == CURLE_OPERATION_TIMEDOUT)
+        {
+            if (response->body.ptr) free(response->body.ptr);
+            response->body.ptr = NULL;
+        }
+        return res;
+    }
+
+    if (code != 200)
+    {
+        fprintf(stderr, "Response nothing with code %ld\n", code);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Waits for a started speech request like speech_request_finish(), but
+ * keeps the utterance until it has an answer. When no reply has started by
+ * the p95 reply time after the latest upload, a hedge goes out. When every
+ * request failed, a retry follows after a jittered backoff. Both are sent
+ * from the copy of the audio. The first 2xx reply wins and the other
+ * requests are cancelled, an error reply is only taken when nothing is left
+ * to beat it. The answer ends up in first's response. Hedges and
+ * retries go to endpoint, fresh when first went there too.
+ */
+static int speech_request_settle(speech_request_t *first, const char *endpoint, int fresh, const char *access_token)
+{
+    speech_request_t more[HEDGE_ATTEMPTS - 1];
+    speech_response_t more_response[HEDGE_ATTEMPTS - 1];
+    speech_request_t *req[HEDGE_ATTEMPTS];
+    int res[HEDGE_ATTEMPTS], over[HEDGE_ATTEMPTS], hedge[HEDGE_ATTEMPTS];
+    uint64_t sent_at[HEDGE_ATTEMPTS];       // 0 while the body is still going out
+    int count = 1, live, answer = -1, i;
+    uint64_t deadline, latest, retry_at = 0, backoff, now;
+    struct speech_response *winner;
+
+    deadline = stats_reply_p95();
+    if (deadline == 0)
+        deadline = HEDGE_DEADLINE * 1000;
+    else if (deadline < HEDGE_DEADLINE_MIN * 1000)
+        deadline = HEDGE_DEADLINE_MIN * 1000;
+
+    req[0] = first;
+    over[0] = 0;
+    hedge[0] = 0;
+    for (i = 1; i < HEDGE_ATTEMPTS; i++)
+    {
+        req[i] = &more[i - 1];
+        req[i]->response = &more_response[i - 1];
+        json_arena_init(&req[i]->tokens);
+    }
+
+    while (answer < 0)
+    {
+        live = 0;
+        for (i = 0; i < count && answer < 0; i++)
+        {
+            if (over[i])
+                continue;
+            /* sleeps on the request which is answering, or else the first one still going */
+            winner = first->hedge.winner;
+            if (!net_wait_for(&req[i]->wait, (winner == req[i]->response || (winner == NULL && live == 0)) ? HEDGE_POLL : 0))
+            {
+                live++;
+                continue;
+            }
+            over[i] = 1;
+            res[i] = speech_request_finish(req[i]);
+            winner = first->hedge.winner;
+            if (winner == req[i]->response || (winner == NULL && res[i] == 0))
+                answer = i;
+        }
+        if (answer >= 0)
+            break;
+
+        now = stats_now();
+        if (live == 0)
+        {
+            /* HTTP errors are answers too once nothing better can come, only a transfer which failed is sent again */
+            for (i = count - 1; i > 0 && res[i] > 0; i--)
+                ;
+            if (res[i] <= 0 || count == HEDGE_ATTEMPTS || !running)
+            {
+                answer = res[i] <= 0 ? i : count - 1;
+                break;
+            }
+            if (retry_at == 0)
+            {
+                backoff = (uint64_t)(HEDGE_BACKOFF << (count - 1)) * 1000000;
+                retry_at = now + backoff + now % backoff;
+            }
+            if (now < retry_at)
+            {
+                Pa_Sleep(HEDGE_POLL);
+                continue;
+            }
+            retry_at = 0;
+            if (first->hedge.sent_at == 0)
+                speech_audio_rest(&first->pooh);
+            if (first->pooh.audio == NULL || speech_request_replay(req[count], first, endpoint, fresh, access_token))
+            {
+                answer = count - 1;
+                break;
+            }
+            sent_at[count] = stats_now();
+            hedge[count] = 0;
+            over[count++] = 0;
+            stats_count(&request_stats.retries, 1, NULL);
+            trace_instant("speech_retry");
+            continue;
+        }
+
+        /* a replayed body is out as soon as it is sent, the first one once the recording is */
+        sent_at[0] = first->hedge.sent_at;
+        for (i = 0, latest = 0; i < count; i++)
+        {
+            if (!over[i] && (sent_at[i] == 0 || sent_at[i] > latest))
+                latest = sent_at[i] ? sent_at[i] : now;
+        }
+        if (count < HEDGE_ATTEMPTS && first->hedge.winner.load() == NULL && latest &&
+                now > latest + deadline * 1000 && first->pooh.audio != NULL &&
+                !speech_request_replay(req[count], first, endpoint, fresh, access_token))
+        {
+            sent_at[count] = now;
+            hedge[count] = 1;
+            over[count++] = 0;
+            stats_count(&request_stats.hedges, 1, NULL);
+            trace_instant("speech_hedge");
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (!over[i])
+        {
+            net_cancel(req[i]->curl);
+            speech_request_finish(req[i]);
+        }
+        if (i > 0 && i != answer)
+            free(req[i]->response->body.ptr);
+    }
+    if (answer > 0)
+    {
+        if (hedge[answer])
+            stats_count(&request_stats.hedge_wins, 1, NULL);
+        free(first->response->body.ptr);
+        memcpy(first->response, req[answer]->response, sizeof(speech_response_t));
+    }
+    for (i = 1; i < HEDGE_ATTEMPTS; i++)
+        json_arena_free(&req[i]->tokens);
+    first->response->hedge = NULL;
+    first->response->first_failed = answer > 0 && over[0] && res[0] > 0;
+    free(first->pooh.audio);
+    first->pooh.audio = NULL;
+
+    if (res[answer] > 0)
+    {
+        pthread_mutex_lock(&in_ring_mutex);
+        PaUtil_FlushRingBuffer(first->pooh.pa_ring_buf);
+        pthread_mutex_unlock(&in_ring_mutex);
+    }
+    return res[answer];
+}
+
+static int speech_request(const char *endpoint, const char *alternate, const char *access_token,
+        speech_response_t *response, PaUtilRingBuffer *pa_ring_buf)
+{
+    speech_request_t req;
+
+    req.response = response;
+    if (speech_request_start(&req, endpoint, access_token, pa_ring_buf, &json_tokens, 0))
+        return -1;
+    return speech_request_settle(&req, alternate, !strcmp(alternate, endpoint), access_token);
+}
+
+/* The capture callback and speculation_feed() hand the paused upload its audio, without a lock or an allocation */
+static void upload_wake(void)
+{
+    CURL *curl;
 
-    written_samples = PaUtil_WriteRingBuffer(pooh->pa_ring_buf, buffer,
-            strlen(buffer) / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
-    //lost_samples += strlen(buffer) / (g_bytes_per_sample * g_num_channels) - written_samples;
-    total_size += written_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+    if (upload_waiting.load() != NULL && (curl = upload_waiting.exchange(NULL)) != NULL)
+        net_resume(curl);
+}
 
-    read_samples = wav_buffer_init(buffer, BYTES_PER_SAMPLE * 8,
-            WAVE_FORMAT_PCM, ALEXA_SAMPLE_RATE, NUMBER_OF_CHANNEL);
-    written_samples = PaUtil_WriteRingBuffer(pooh->pa_ring_buf, buffer,
-            read_samples / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
-    //lost_samples += read_samples / (g_bytes_per_sample * g_num_channels) - written_samples;
-    total_size += written_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+/*
+ * A pre-trigger of the second, more sensitive detector starts an open
+ * speech request with the audio before it. Detection audio keeps going
+ * into the upload until the hot word commits it or SPECULATION_WINDOW
+ * runs out and it is cancelled.
+ */
+static int speculation_start(speculation_t *spec, const char *endpoint, const char *access_token,
+        const std::vector<int16_t> *preroll, player_t *player)
+{
+    if (spec->ring_buf == NULL)
+    {
+        spec->ring_buf = (char *)PaUtil_AllocateMemory(RING_BUFFER_SIZE * BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+        if (spec->ring_buf == NULL)
+            return 1;
+        PaUtil_InitializeRingBuffer(&spec->ring, BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL, RING_BUFFER_SIZE, spec->ring_buf);
+    }
 
-    left_samples = RECORDING_TIME * ALEXA_SAMPLE_RATE / 1000;
-    total_size += left_samples * (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+    PaUtil_FlushRingBuffer(&spec->ring);
+    spec->teed = PaUtil_WriteRingBuffer(&spec->ring, preroll->data(), preroll->size());
 
-    is_in = RECORD_INPUT;
-    pthread_mutex_unlock(&in_ring_mutex);
+    memset(&spec->response, 0, sizeof(speech_response_t));
+    spec->response.player = player;
+    spec->request.response = &spec->response;
+    if (speech_request_start(&spec->request, endpoint, access_token, &spec->ring, &spec->tokens, 1))
+        return 1;
 
-    sprintf(buffer, DATA_TAILER, BOUNDARY);
-    total_size += strlen(buffer);
+    snprintf(spec->endpoint, sizeof(spec->endpoint), "%s", endpoint);
+    spec->active = 1;
+    spec->started = stats_now();
+    stats_count(&request_stats.speculations, 1, NULL);
+    trace_instant("speculation_start");
+    return 0;
+}
 
-    pooh->sizeleft = total_size;
-    pthread_cond_signal(&wav_cond);
+/* Detection audio after the pre-trigger, main thread only */
+static void speculation_feed(speculation_t *spec, const std::vector<int16_t> *data)
+{
+    spec->teed += PaUtil_WriteRingBuffer(&spec->ring, data->data(), data->size());
+    upload_wake();
+}
 
-    while(is_in == RECORD_INPUT)
-    {
-        usleep(10000);
-    }
+/* The hot word confirmed the pre-trigger, the utterance is recorded into the running upload */
+static void speculation_commit(speculation_t *spec, PaUtilRingBuffer *input)
+{
+    int16_t samples[1024];
+    ring_buffer_size_t n;
 
     pthread_mutex_lock(&in_ring_mutex);
-    written_samples = PaUtil_WriteRingBuffer(pooh->pa_ring_buf, buffer,
-            strlen(buffer) / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
-    //lost_samples += strlen(buffer) / (g_bytes_per_sample * g_num_channels) - written_samples;
+    /* audio detection has not read yet comes first */
+    while ((n = PaUtil_ReadRingBuffer(input, samples, sizeof(samples) / sizeof(samples[0]))) > 0)
+        spec->teed += PaUtil_WriteRingBuffer(&spec->ring, samples, n);
+    left_samples = recording_time * ALEXA_SAMPLE_RATE / 1000;
+    record_ring = &spec->ring;
+    is_in = RECORD_INPUT;
     pthread_mutex_unlock(&in_ring_mutex);
+    upload_wake();
 
-    return NULL;
+    stats_speculation(1, spec->teed * BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL, (stats_now() - spec->started) / 1000);
+    trace_instant("speculation_commit");
 }
 
-static int speech_request(const char *access_token, char **resp, int *length, PaUtilRingBuffer *pa_ring_buf)
+/* Waits for the committed upload like speech_request() would, endpoint is where it went */
+static int speculation_finish(speculation_t *spec, const char *endpoint, const char *alternate,
+        const char *access_token, speech_response_t *response)
 {
-    char speechRequestLink[] = "https://access-alexa-na.amazon.com/v1/avs/speechrecognizer/recognize";
-    CURL *curl;
-
-    curl = curl_easy_init();
-    if(curl)
-    {
-        struct curl_slist *chunk = NULL;
-        char header_token[1024] = {'\0'};
-        char header_type[128] = {'\0'};
-        pthread_t thread_wav;
-        data_stream_t pooh;
-        string_t response;
-        string_t header;
-        CURLcode res;
-        char *ptr;
-        int code;
-
-        pooh.pa_ring_buf = pa_ring_buf;
-        pooh.sizeleft = 0;
-
-        pthread_create (&thread_wav, NULL, &create_multipart_wav_buffer, (void *)&pooh);
-        while(!pooh.sizeleft) pthread_cond_wait(&wav_cond, &wav_mutex);
-
-        memset(&header, 0, sizeof(string_t));
-        memset(&response, 0, sizeof(string_t));
-        init_string(&header);
-        init_string(&response);
-
-        sprintf(header_token, "Authorization: Bearer %s", access_token);
-        sprintf(header_type, "Content-Type: multipart/form-data; boundary=%s", BOUNDARY);
-
-        chunk = curl_slist_append(chunk, "Host: access-alexa-na.amazon.com");
-        chunk = curl_slist_append(chunk, header_token);
-        chunk = curl_slist_append(chunk, header_type);
-        chunk = curl_slist_append(chunk, "Transfer-Encoding: chunked");
-
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chunk);
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-        curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback);
-        curl_easy_setopt(curl, CURLOPT_READDATA, &pooh);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, pooh.sizeleft);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &header);
-        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-        curl_easy_setopt(curl, CURLOPT_URL, speechRequestLink);
-        if (debug)
-        {
-            curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-        }
-        else
-        {
-            curl_easy_setopt(curl, CURLOPT_VERBOSE, 0);
-        }
+    int res = speech_request_settle(&spec->request, alternate, !strcmp(alternate, endpoint), access_token);
 
-        res = curl_easy_perform(curl);
-        curl_slist_free_all(chunk);
-        curl_easy_cleanup(curl);
-
-        pthread_join(thread_wav, NULL);
+    memcpy(response, &spec->response, sizeof(speech_response_t));
+    spec->active = 0;
+    return res;
+}
 
-        if(res != CURLE_OK)
-        {
-            fprintf(stderr, "upload_file failed: %s\n", curl_easy_strerror(res));
-            if (res == CURLE_OPERATION_TIMEDOUT)
-            {
-                if (header.ptr) free(header.ptr);
-                if (response.ptr) free(response.ptr);
-            }
-            pthread_mutex_lock(&in_ring_mutex);
-            PaUtil_FlushRingBuffer(pa_ring_buf);
-            pthread_mutex_unlock(&in_ring_mutex);
-            return res;
-        }
+static void speculation_cancel(speculation_t *spec)
+{
+    net_cancel(spec->request.curl);
+    speech_request_finish(&spec->request);
+    stats_speculation(0, spec->request.pooh.sent, 0);
+    free(spec->request.pooh.audio);
+    free(spec->response.body.ptr);
+    spec->active = 0;
+    trace_instant("speculation_cancel");
+}
 
-        ptr = strrstr(header.ptr, "HTTP/1.1", strlen(header.ptr));
-        sscanf(ptr + 8, "%d", &code);
-        free(header.ptr);
+static void speculation_free(speculation_t *spec)
+{
+    if (spec->active)
+        speculation_cancel(spec);
+    if (spec->ring_buf)
+        PaUtil_FreeMemory(spec->ring_buf);
+    spec->ring_buf = NULL;
+    json_arena_free(&spec->tokens);
+}
 
-        *resp = response.ptr;
-        *length = response.len;
+/* Speaker volume and mute, applied as the samples leave the output ring */
+static void output_volume(int16_t *samples, unsigned long count)
+{
+    int volume = speaker_muted.load() ? 0 : speaker_volume.load();
+    unsigned long i;
 
-        if (code != 200)
-        {
-            fprintf(stderr, "Response nothing with code %d\n", code);
-            return -1;
-        }
-        return 0;
-    }
-    return -1;
+    if (volume == 100)
+        return;
+    for (i = 0; i < count; i++)
+        samples[i] = samples[i] * volume / 100;
 }
 
 int pa_stream_callback(
@@ -777,15 +2071,32 @@ int pa_stream_callback(
     PaStreamCallbackFlags statusFlags,
     void *userData )
 {
-    ring_buffer_size_t read_samples, written_samples, available_samples;
+    ring_buffer_size_t read_samples, written_samples = 0, available_samples;
     ring_buf_t *fifo = (ring_buf_t *)userData;
+    input_state state;
+    unsigned long frames = frameCount;
+    uint64_t start = stats_now();
+
+    trace_thread_name("portaudio");
+    trace_begin("pa_stream_callback");
+    if (statusFlags)
+    {
+        stats_xrun(statusFlags);
+    }
 
     available_samples = PaUtil_GetRingBufferReadAvailable(&fifo->pa_output_ring_buf);
-    if (available_samples >= frameCount)
+    stats_high_water(&audio_stats.out_ring_high_water, available_samples);
+    if (!output_playing)
+        output_primed = 0;
+    else if (available_samples > 0)
+        output_primed = 1;
+    /* once the reply is all written its tail plays too, padded with silence, and the ring runs empty */
+    if (available_samples >= frameCount || (available_samples > 0 && !output_playing))
     {
         pthread_mutex_lock(&out_ring_mutex);
         read_samples = PaUtil_ReadRingBuffer(&fifo->pa_output_ring_buf, output, frameCount);
         pthread_mutex_unlock(&out_ring_mutex);
+        output_volume((int16_t *)output, read_samples * NUMBER_OF_CHANNEL);
         output = (uint8_t*)output + read_samples * BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL;
         frameCount -= read_samples;
 
@@ -794,28 +2105,57 @@ int pa_stream_callback(
             memset(output, 0, frameCount * BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
         }
     }
+    else
+    {
+        /* Short of a full buffer before the reply is all written, playback ran dry in its middle */
+        if (output_primed)
+        {
+            stats_count(&audio_stats.output_underflows, 1, &audio_stats.last_output_underflow);
+            stats_count(&audio_stats.output_zero_samples, frameCount, NULL);
+        }
+        memset(output, 0, frameCount * BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL);
+    }
 
+    state = is_in.load(std::memory_order_acquire);
     available_samples = PaUtil_GetRingBufferWriteAvailable(&fifo->pa_input_ring_buf);
-    if (available_samples >= frameCount && is_in != STOP_INPUT)
+    if (available_samples < frameCount && state != STOP_INPUT)
+    {
+        stats_count(&audio_stats.input_overflows, 1, &audio_stats.last_input_overflow);
+        stats_count(&audio_stats.input_lost_samples, frameCount, NULL);
+    }
+    else if (state != STOP_INPUT)
     {
         pthread_mutex_lock(&in_ring_mutex);
-        if (is_in == REAL_TIME_INPUT)
+        /* the main thread switches it under the mutex, it may have done so meanwhile */
+        state = is_in.load(std::memory_order_acquire);
+        if (state == REAL_TIME_INPUT)
             written_samples = PaUtil_WriteRingBuffer(&fifo->pa_input_ring_buf, input, frameCount);
-        else if (is_in == RECORD_INPUT)
-            written_samples = PaUtil_WriteRingBuffer(&fifo->pa_input_ring_buf, input,
+        else if (state == RECORD_INPUT)
+            written_samples = PaUtil_WriteRingBuffer(record_ring.load(), input,
                     (frameCount > left_samples) ? left_samples : frameCount);
-        //lost_samples += frameCount - written_samples;
         pthread_mutex_unlock(&in_ring_mutex);
-        if (is_in == RECORD_INPUT)
+        stats_high_water(&audio_stats.in_ring_high_water,
+                PaUtil_GetRingBufferReadAvailable(&fifo->pa_input_ring_buf));
+        if (state == RECORD_INPUT)
         {
             left_samples >= written_samples ? left_samples -= written_samples : left_samples = 0;
             if (!left_samples)
             {
-                is_in = STOP_INPUT;
+                /* released after the last samples are in the ring, read_callback() ends the body on it */
+                state = STOP_INPUT;
+                is_in.store(STOP_INPUT, std::memory_order_release);
+            }
+            /* after the stop, an open upload waking up to an empty ring then ends its body */
+            if (written_samples > 0 || state == STOP_INPUT)
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                upload_wake();
             }
         }
     }
 
+    trace_end("pa_stream_callback");
+    stats_callback(start, stats_now(), frames, ALEXA_SAMPLE_RATE, input_state_name[state]);
     return paContinue;
 }
 
@@ -923,11 +2263,20 @@ static int stream_close(PaStream *pa_stream, ring_buf_t *fifo)
     return 0;
 }
 
-static int stream_write(const char *output, PaUtilRingBuffer *pa_ring_buf, const char *ptr, size_t len)
+/* Player thread, the job being decoded was cancelled or the player is stopping */
+static int player_cancelled(player_t *pl)
+{
+    return pl != NULL && (!pl->running || pl->played.load() < pl->cancelled.load());
+}
+
+/* Decodes an mp3 into the output ring, pl NULL when there is no player to cancel it */
+static int stream_write(player_t *pl, const char *output, PaUtilRingBuffer *pa_ring_buf, const char *ptr, size_t len)
 {
     FILE *out = NULL;
     int ret = 0;
 
+    trace_begin("stream_write");
+    output_playing = true;
     if (output != NULL)
         out = fopen(output, "wb");
 
@@ -993,7 +2342,9 @@ static int stream_write(const char *output, PaUtilRingBuffer *pa_ring_buf, const
 
         do
         {
+            trace_begin("mpg123_decode_frame");
             err = mpg123_decode_frame(mh, &frame_offset, &audio, &done);
+            trace_end("mpg123_decode_frame");
             switch(err)
             {
                 case MPG123_NEW_FORMAT:
@@ -1012,7 +2363,8 @@ static int stream_write(const char *output, PaUtilRingBuffer *pa_ring_buf, const
                     }
                     {
                         ring_buffer_size_t available_samples;
-                        while (1)
+                        trace_begin("ring_wait");
+                        while (!player_cancelled(pl))
                         {
                             available_samples = PaUtil_GetRingBufferWriteAvailable(pa_ring_buf);
                             if (available_samples >= done / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL))
@@ -1021,9 +2373,14 @@ static int stream_write(const char *output, PaUtilRingBuffer *pa_ring_buf, const
                             }
                             Pa_Sleep(10);
                         }
+                        trace_end("ring_wait");
 
                         pthread_mutex_lock(&out_ring_mutex);
-                        PaUtil_WriteRingBuffer(pa_ring_buf, audio, done / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
+                        /* a frame written after the cancel flushed the ring goes too */
+                        if (player_cancelled(pl))
+                            PaUtil_FlushRingBuffer(pa_ring_buf);
+                        else
+                            PaUtil_WriteRingBuffer(pa_ring_buf, audio, done / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
                         pthread_mutex_unlock(&out_ring_mutex);
                     }
                     break;
@@ -1032,7 +2389,7 @@ static int stream_write(const char *output, PaUtilRingBuffer *pa_ring_buf, const
                 default:
                     break;
             }
-        } while(err != MPG123_ERR && err != MPG123_NEED_MORE);
+        } while(err != MPG123_ERR && err != MPG123_NEED_MORE && !player_cancelled(pl));
 
         if (out != NULL)
         {
@@ -1050,51 +2407,113 @@ __MPG_EXIT:
             fclose(out);
         }
     }
+    output_playing = false;
+    trace_end("stream_write");
     return ret;
 }
 
-int is_reask(const char *json_ptr, size_t json_size)
+/*
+ * The player thread decodes reply audio into the output ring, so a long
+ * reply no longer holds the main thread away from the input ring. Jobs
+ * come through a PaUtil ring like the audio does, the mutex and condition
+ * are only there to sleep on while it is empty.
+ */
+static void *player_loop(void *arg)
 {
-    int ret, i;
-    jsmn_parser p;
-    char name[32];
-    jsmntok_t t[64];
+    player_t *pl = (player_t *)arg;
+    play_job_t job;
 
-    jsmn_init(&p);
-    ret = jsmn_parse(&p, json_ptr, json_size, t, sizeof(t) / sizeof(t[0]));
-    if(ret < 0)
+    trace_thread_name("player");
+    while (1)
     {
-        printf("Failed to parse JSON: %d\n", ret);
-        ret = -1;
+        pthread_mutex_lock(&pl->mutex);
+        while (pl->running && PaUtil_GetRingBufferReadAvailable(&pl->jobs) == 0)
+            pthread_cond_wait(&pl->cond, &pl->mutex);
+        pthread_mutex_unlock(&pl->mutex);
+
+        /* once stopped or cancelled the jobs left are only freed */
+        if (PaUtil_ReadRingBuffer(&pl->jobs, &job, 1) == 0)
+            break;
+        if (job.ptr != NULL && !player_cancelled(pl))
+            stream_write(pl, pl->output, pl->playback, job.ptr, job.len);
+        free(job.body);
+        pl->played++;
     }
-    else if(ret < 1 || t[0].type != JSMN_OBJECT)
+    return NULL;
+}
+
+static int player_start(player_t *pl, const char *output, PaUtilRingBuffer *playback)
+{
+    pl->output = output;
+    pl->playback = playback;
+    pl->queued = 0;
+    pl->played = 0;
+    pl->cancelled = 0;
+    pl->running = true;
+    PaUtil_InitializeRingBuffer(&pl->jobs, sizeof(play_job_t), PLAYER_JOBS, pl->job_buf);
+    pthread_mutex_init(&pl->mutex, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+
+    if (pthread_create(&pl->thread, NULL, player_loop, pl))
     {
-        printf("Object expected\n");
-        ret = -1;
+        fprintf(stderr, "Start player thread failed\n");
+        pthread_cond_destroy(&pl->cond);
+        pthread_mutex_destroy(&pl->mutex);
+        return 1;
     }
-    else
+    pl->started = 1;
+    return 0;
+}
+
+/* Main thread only. A part with ptr NULL frees body once the parts queued before it are played. */
+static void player_queue(player_t *pl, const char *ptr, size_t len, char *body)
+{
+    play_job_t job = {ptr, len, body};
+
+    if (!pl->started)
     {
-        for (i = 0; i < ret; i++)
-        {
-            if(t[i].type == JSMN_STRING && t[i].size == 1) // must be key
-            {
-                json_get_str(&t[i], json_ptr, name);
-                if (!strcmp(name, "namespace"))
-                {
-                    json_get_str(&t[++i], json_ptr, name);
-                    if (!strcmp(name, "SpeechRecognizer"))
-                    {
-                        return 1;
-                    }
-                }
-            }
-        }
-        ret = 0;
+        free(body);
+        return;
     }
-    return ret;
+    while (running && PaUtil_GetRingBufferWriteAvailable(&pl->jobs) == 0)
+        Pa_Sleep(10);
+    if (PaUtil_GetRingBufferWriteAvailable(&pl->jobs) == 0)
+    {
+        free(body);
+        return;
+    }
+
+    pl->queued++;
+    PaUtil_WriteRingBuffer(&pl->jobs, &job, 1);
+    pthread_mutex_lock(&pl->mutex);
+    pthread_cond_signal(&pl->cond);
+    pthread_mutex_unlock(&pl->mutex);
 }
 
-int load_config(Config *cfg, char *conf_file, alexa_config_t *config, time_t *now)
+/* Main thread, a reply is still being decoded or played out of the output ring */
+static int player_busy(player_t *pl)
+{
+    return pl->played.load() != pl->queued.load() || PaUtil_GetRingBufferReadAvailable(pl->playback) > 0;
+}
+
+/* Stops the player before stream_close(), so a stream_write() waiting for room in the output ring can return */
+static void player_stop(player_t *pl)
+{
+    if (!pl->started)
+        return;
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->running = false;
+    pthread_cond_signal(&pl->cond);
+    pthread_mutex_unlock(&pl->mutex);
+    pthread_join(pl->thread, NULL);
+
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->mutex);
+    pl->started = 0;
+}
+
+int load_config(Config *cfg, alexa_config_t *config, time_t *now)
 {
     char code[64] = {'\0'};
     int ret = 0;
@@ -1106,6 +2525,8 @@ int load_config(Config *cfg, char *conf_file, alexa_config_t *config, time_t *no
     ConfigReadString(cfg, ALEXA_SECTION, ALEXA_ACCESS_TOKEN, config->access_token, sizeof(config->access_token), "");
     ConfigReadUnsignedInt(cfg, ALEXA_SECTION, ALEXA_CREATED_TIME, &config->created_time, 0);
     ConfigReadInt(cfg, ALEXA_SECTION, ALEXA_EXPIRED_IN, &config->expired_in, 0);
+    ConfigReadString(cfg, ALEXA_SECTION, ALEXA_DOWNCHANNEL, config->downchannel, sizeof(config->downchannel), "");
+    ConfigReadString(cfg, ALEXA_SECTION, ALEXA_PING, config->ping, sizeof(config->ping), "");
 
     if (!strlen(config->refresh_token))
     {
@@ -1137,7 +2558,6 @@ int load_config(Config *cfg, char *conf_file, alexa_config_t *config, time_t *no
                 ConfigAddString(cfg, ALEXA_SECTION, ALEXA_ACCESS_TOKEN, config->access_token);
                 ConfigAddUnsignedInt(cfg, ALEXA_SECTION, ALEXA_CREATED_TIME, config->created_time);
                 ConfigAddInt(cfg, ALEXA_SECTION, ALEXA_EXPIRED_IN, config->expired_in);
-                ConfigPrintToFile(cfg, conf_file);
             }
         }
         else
@@ -1152,6 +2572,209 @@ __LOAD_EXIT:
     return ret;
 }
 
+/* Loads a wav earcon padded to whole frames, an empty file name loads nothing */
+static int sound_load(const char *filename, char **sound, size_t *size)
+{
+    FILE *fp;
+    uint8_t add_size;
+
+    *sound = NULL;
+    *size = 0;
+    if (filename[0] == '\0')
+        return 0;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        printf("Cannot access to %s\n", filename);
+        return 1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (wav_file_read(fp, size))
+    {
+        fclose(fp);
+        *size = 0;
+        return 1;
+    }
+
+    add_size = (*size % (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
+    if (add_size > 0)
+        add_size = (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL) - add_size;
+    *sound = (char *)calloc(*size + add_size, sizeof(char));
+    fread(*sound, 1, *size, fp);
+    fclose(fp);
+
+    *size += add_size;
+    return 0;
+}
+
+/* Keys in the config file override the command line, invalid values fall back to it */
+static void settings_read(Config *cfg, const alexa_settings_t *defaults, alexa_settings_t *settings)
+{
+    char *end;
+    float sensitivity;
+
+    memcpy(settings, defaults, sizeof(alexa_settings_t));
+    settings->listen_sound = settings->lost_sound = NULL;
+    settings->sound_size = settings->lost_size = 0;
+
+    ConfigReadString(cfg, ALEXA_SECTION, ALEXA_SENSITIVITY, settings->sensitivity, sizeof(settings->sensitivity), defaults->sensitivity);
+    sensitivity = strtof(settings->sensitivity, &end);
+    if (end == settings->sensitivity || *end != '\0' || sensitivity < 0 || sensitivity > 1)
+    {
+        fprintf(stderr, "Invalid %s %s, using %s\n", ALEXA_SENSITIVITY, settings->sensitivity, defaults->sensitivity);
+        strcpy(settings->sensitivity, defaults->sensitivity);
+    }
+
+    ConfigReadString(cfg, ALEXA_SECTION, ALEXA_PRETRIGGER, settings->pretrigger_sensitivity, sizeof(settings->pretrigger_sensitivity), defaults->pretrigger_sensitivity);
+    sensitivity = strtof(settings->pretrigger_sensitivity, &end);
+    if (settings->pretrigger_sensitivity[0] && (end == settings->pretrigger_sensitivity || *end != '\0' || sensitivity < 0 || sensitivity > 1))
+    {
+        fprintf(stderr, "Invalid %s %s, speculative upload is off\n", ALEXA_PRETRIGGER, settings->pretrigger_sensitivity);
+        settings->pretrigger_sensitivity[0] = '\0';
+    }
+
+    if (ConfigReadFloat(cfg, ALEXA_SECTION, ALEXA_AUDIO_GAIN, &settings->audio_gain, defaults->audio_gain) == CONFIG_ERR_INVALID_VALUE ||
+            settings->audio_gain <= 0)
+    {
+        fprintf(stderr, "Invalid %s, using %g\n", ALEXA_AUDIO_GAIN, defaults->audio_gain);
+        settings->audio_gain = defaults->audio_gain;
+    }
+
+    if (ConfigReadUnsignedInt(cfg, ALEXA_SECTION, ALEXA_RECORDING_TIME, &settings->recording_time, defaults->recording_time) == CONFIG_ERR_INVALID_VALUE ||
+            settings->recording_time == 0 || settings->recording_time > RECORDING_TIME_MAX)
+    {
+        fprintf(stderr, "Invalid %s, using %u\n", ALEXA_RECORDING_TIME, defaults->recording_time);
+        settings->recording_time = defaults->recording_time;
+    }
+
+    ConfigReadString(cfg, ALEXA_SECTION, ALEXA_ENDPOINT, settings->endpoint, sizeof(settings->endpoint), defaults->endpoint);
+    ConfigReadString(cfg, ALEXA_SECTION, ALEXA_LISTEN_SOUND, settings->listen_sound_file, sizeof(settings->listen_sound_file), defaults->listen_sound_file);
+    ConfigReadString(cfg, ALEXA_SECTION, ALEXA_LOST_SOUND, settings->lost_sound_file, sizeof(settings->lost_sound_file), defaults->lost_sound_file);
+}
+
+static int settings_load_sounds(alexa_settings_t *settings)
+{
+    if (sound_load(settings->listen_sound_file, &settings->listen_sound, &settings->sound_size))
+        return 1;
+    return sound_load(settings->lost_sound_file, &settings->lost_sound, &settings->lost_size);
+}
+
+static int settings_equal(const alexa_settings_t *a, const alexa_settings_t *b)
+{
+    return !strcmp(a->sensitivity, b->sensitivity) && !strcmp(a->pretrigger_sensitivity, b->pretrigger_sensitivity) &&
+           a->audio_gain == b->audio_gain &&
+           a->recording_time == b->recording_time && !strcmp(a->endpoint, b->endpoint) &&
+           !strcmp(a->listen_sound_file, b->listen_sound_file) && !strcmp(a->lost_sound_file, b->lost_sound_file);
+}
+
+static void settings_free(alexa_settings_t *settings)
+{
+    if (settings == NULL)
+        return;
+    free(settings->listen_sound);
+    free(settings->lost_sound);
+    free(settings);
+}
+
+/*
+ * Runs on the watcher thread when alexa.conf changes. The file is parsed
+ * into a new Config and the resulting settings are only published, the
+ * main thread applies them between detections so the audio stream keeps
+ * running. The edit is also merged into the Config the writer saves, so a
+ * later token save keeps it, only the token keys stay ours. Token saves of
+ * our own config writer end up here as well, they merge without a change
+ * and their settings are dropped as equal.
+ */
+static void settings_reload(void *arg)
+{
+    const char *conf_file = (const char *)arg;
+    alexa_settings_t *settings = NULL;
+    Config *cfg = NULL;
+
+    trace_begin("settings_reload");
+    if (ConfigReadFile(conf_file, &cfg) != CONFIG_OK)
+    {
+        fprintf(stderr, "Reload %s failed, keeping the current settings\n", conf_file);
+        goto __RELOAD_EXIT;
+    }
+    if (watch_config != NULL && ConfigMerge(watch_config, cfg, ALEXA_SECTION, token_keys) != CONFIG_OK)
+        fprintf(stderr, "Merge %s failed, a token save may undo the edit\n", conf_file);
+    settings = (alexa_settings_t *)malloc(sizeof(alexa_settings_t));
+    settings_read(cfg, &cli_settings, settings);
+    if (settings_equal(settings, &watch_settings))
+        goto __RELOAD_EXIT;
+    if (settings_load_sounds(settings))
+    {
+        fprintf(stderr, "Reload %s failed, keeping the current settings\n", conf_file);
+        goto __RELOAD_EXIT;
+    }
+
+    settings->generation = watch_settings.generation + 1;
+    memcpy(&watch_settings, settings, sizeof(alexa_settings_t));
+    /* A previous reload the main thread did not pick up yet is superseded */
+    settings = pending_settings.exchange(settings, std::memory_order_acq_rel);
+
+__RELOAD_EXIT:
+    settings_free(settings);
+    ConfigFree(cfg);
+    trace_end("settings_reload");
+}
+
+/* Main thread only, swaps in settings published by settings_reload() */
+static void settings_apply(alexa_settings_t **current, snowboy::SnowboyDetect *detector,
+        snowboy::SnowboyDetect *pretrigger)
+{
+    alexa_settings_t *settings;
+
+    if (pending_settings.load(std::memory_order_relaxed) == NULL)
+        return;
+    settings = pending_settings.exchange(NULL, std::memory_order_acq_rel);
+    if (settings == NULL)
+        return;
+
+    if (strcmp(settings->sensitivity, (*current)->sensitivity))
+        detector->SetSensitivity(settings->sensitivity);
+    if (strcmp(settings->pretrigger_sensitivity, (*current)->pretrigger_sensitivity) && settings->pretrigger_sensitivity[0])
+    {
+        /* it did not hear the audio while it was off */
+        pretrigger->SetSensitivity(settings->pretrigger_sensitivity);
+        pretrigger->Reset();
+    }
+    if (settings->audio_gain != (*current)->audio_gain)
+    {
+        detector->SetAudioGain(settings->audio_gain);
+        pretrigger->SetAudioGain(settings->audio_gain);
+    }
+    recording_time = settings->recording_time;
+
+    printf("Settings reloaded (generation %lu)\n", settings->generation);
+    settings_free(*current);
+    *current = settings;
+}
+
+#ifndef ALEXA_NO_MAIN   /* bench/ harnesses include this file to reach its static functions */
+
+static downchannel_t downchannel;                       // opened and closed by the main thread
+static speculation_t speculation;                       // main thread only
+static endpoint_set_t endpoints;                        // main thread only, probes report on the network thread
+static player_t player;                                 // decodes replies into the output ring
+
+static void stop_handler(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+static void stats_handler(int sig)
+{
+    (void)sig;
+    dump_stats = 1;
+}
+
 void usage(const char *name)
 {
     printf("The app can be used to speak command to alexa.\n");
@@ -1162,7 +2785,11 @@ void usage(const char *name)
     //printf("-r | --res <resource_input>  Resource file.\n");
     printf("-s | --sound <listen_sound>  Sound file to confirm alexa ready to listen.\n");
     printf("-l | --lost <lost_sound>     Sound file to confirm alexa lost connection.\n");
+    printf("                             Both can be overridden by keys in the config file.\n");
     printf("-o | --output <audio_output> Audio output file with response from alexa.\n");
+    printf("-t | --trace <trace_file>    Record a Chrome/Perfetto timeline of the audio pipeline.\n");
+    printf("-S | --stats                 Print audio statistics on exit (or on SIGUSR1).\n");
+    printf("-w | --slowest <count>       Include the slowest audio callbacks in the statistics.\n");
     printf("-v | --verbose               Display detailed message.\n");
     printf("-h | --help                  Display usage instructions.\n");
 }
@@ -1173,27 +2800,34 @@ int main(int argc, char *argv[])
     alexa_config_t config;
 
     char *conf_file;
+    char snap_file[MAXBUF];
     //char *model_input = NULL;
     //char *res_input = NULL;
-    char *listen_sound = NULL;
-    char *lost_sound = NULL;
     char *audio_output = NULL;
-    size_t sound_size = 0;
-    size_t lost_size = 0;
+    char *trace_file = NULL;
+    uint8_t print_stats = 0;
+    alexa_settings_t *settings = NULL;
 
-    int i, reask = 0, ret = EXIT_SUCCESS;
-    time_t now = time(0);
+    int i, reask = 0, silent = 1, ret = EXIT_SUCCESS;
+    time_t now = time(0), next_ping = 0, next_warmup = 0;
 
     PaStream *pa_stream = NULL;
     ring_buf_t fifo;
-    float audio_gain = 1;
 
     std::vector<int16_t> data;
+    std::vector<int16_t> preroll;       // the last SPECULATION_PREROLL of detection audio
 
     std::string resource_filename = "res/common.res";
     std::string model_filename = "res/alexa.umdl";
-    std::string sensitivity_str = "0.5";
     snowboy::SnowboyDetect detector(resource_filename, model_filename);
+    snowboy::SnowboyDetect pretrigger(resource_filename, model_filename);
+
+    json_paths_init();
+
+    strcpy(cli_settings.sensitivity, "0.5");
+    cli_settings.audio_gain = 1;
+    strcpy(cli_settings.endpoint, SPEECH_ENDPOINT);
+    cli_settings.recording_time = RECORDING_TIME;
 
     if (argc == 1)
     {
@@ -1216,16 +2850,29 @@ int main(int argc, char *argv[])
         }*/
         else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--sound")) && i + 1 < argc)
         {
-        	listen_sound = argv[++i];
+            snprintf(cli_settings.listen_sound_file, sizeof(cli_settings.listen_sound_file), "%s", argv[++i]);
         }
         else if ((!strcmp(argv[i], "-l") || !strcmp(argv[i], "--lost")) && i + 1 < argc)
         {
-            lost_sound = argv[++i];
+            snprintf(cli_settings.lost_sound_file, sizeof(cli_settings.lost_sound_file), "%s", argv[++i]);
         }
         else if ((!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) && i + 1 < argc)
         {
             audio_output = argv[++i];
         }
+        else if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--trace")) && i + 1 < argc)
+        {
+            trace_file = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-S") || !strcmp(argv[i], "--stats"))
+        {
+            print_stats = 1;
+        }
+        else if ((!strcmp(argv[i], "-w") || !strcmp(argv[i], "--slowest")) && i + 1 < argc)
+        {
+            stats_slowest(atoi(argv[++i]));
+            print_stats = 1;
+        }
         else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose"))
         {
             debug = 1;
@@ -1270,118 +2917,169 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }*/
 
-    if (listen_sound != NULL)
-	{
-        if (-1 == access(listen_sound, F_OK))
-        {
-            printf("Cannot access to %s\n", listen_sound);
-            return EXIT_FAILURE;
-        }
-	    else
-	    {
-	        FILE *fp = fopen(listen_sound, "rb");
-	        uint8_t add_size;
-
-	        fseek(fp, 0, SEEK_END);
-	        sound_size = ftell(fp);
-	        fseek(fp, 0, SEEK_SET);
-	        if (wav_file_read(fp, &sound_size))
-	        {
-	            fclose(fp);
-	            ret = EXIT_FAILURE;
-	            goto __EXIT;
-	        }
-
-	        add_size = (sound_size % (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
-	        if (add_size > 0)
-	            add_size = (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL) - add_size;
-	        listen_sound = (char *)calloc(sound_size + add_size, sizeof(char));
-	        fread(listen_sound, 1, sound_size, fp);
-	        fclose(fp);
-
-	        sound_size += add_size;
-	    }
-	}
-
-    if (lost_sound != NULL)
-    {
-        if (-1 == access(lost_sound, F_OK))
-        {
-            printf("Cannot access to %s\n", lost_sound);
-            return EXIT_FAILURE;
-        }
-        else
-        {
-            FILE *fp = fopen(lost_sound, "rb");
-            uint8_t add_size;
-
-            fseek(fp, 0, SEEK_END);
-            lost_size = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
-            if (wav_file_read(fp, &lost_size))
-            {
-                fclose(fp);
-                ret = EXIT_FAILURE;
-                goto __EXIT;
-            }
-
-            add_size = (lost_size % (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
-            if (add_size > 0)
-                add_size = (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL) - add_size;
-            lost_sound = (char *)calloc(lost_size + add_size, sizeof(char));
-            fread(lost_sound, 1, lost_size, fp);
-            fclose(fp);
-
-            lost_size += add_size;
-        }
+    if (trace_file != NULL && trace_open(trace_file))
+    {
+        ret = EXIT_FAILURE;
+        goto __EXIT;
     }
 
     pthread_mutex_init(&in_ring_mutex, NULL);
     pthread_mutex_init(&out_ring_mutex, NULL);
-    pthread_mutex_init(&wav_mutex, NULL);
-    pthread_cond_init (&wav_cond, NULL);
 
-    cfg = ConfigNew();
-    if (ConfigReadFile(conf_file, &cfg) != CONFIG_OK)
+    snprintf(snap_file, sizeof(snap_file), "%s" CONFIG_SNAPSHOT, conf_file);
+    if (ConfigReadFileCached(conf_file, snap_file, &cfg) != CONFIG_OK)
     {
         fprintf(stderr, "Read failed from file\n");
         ret = EXIT_FAILURE;
         goto __EXIT;
     }
-    if (load_config(cfg, conf_file, &config, &now))
+    /* Token updates are saved by a background writer, ConfigFree() flushes them */
+    if (ConfigPersistStart(cfg, conf_file, CONFIG_SAVE_DELAY) != CONFIG_OK)
+    {
+        fprintf(stderr, "Start config writer failed\n");
+        ret = EXIT_FAILURE;
+        goto __FREE;
+    }
+    if (net_start())
+    {
+        ret = EXIT_FAILURE;
+        goto __FREE;
+    }
+    if (load_config(cfg, &config, &now))
     {
         ret = EXIT_FAILURE;
         goto __FREE;
     }
 
-    detector.SetSensitivity(sensitivity_str);
-    detector.SetAudioGain(audio_gain);
-
+    settings = (alexa_settings_t *)calloc(1, sizeof(alexa_settings_t));
+    settings_read(cfg, &cli_settings, settings);
+    if (settings_load_sounds(settings))
+    {
+        ret = EXIT_FAILURE;
+        goto __FREE;
+    }
+    memcpy(&watch_settings, settings, sizeof(alexa_settings_t));
+    recording_time = settings->recording_time;
+    endpoint_set_parse(&endpoints, settings->endpoint);
+    detector.SetSensitivity(settings->sensitivity);
+    detector.SetAudioGain(settings->audio_gain);
+    if (settings->pretrigger_sensitivity[0])
+        pretrigger.SetSensitivity(settings->pretrigger_sensitivity);
+    pretrigger.SetAudioGain(settings->audio_gain);
+
+    stats_init();
+    if (player_start(&player, audio_output, &(fifo.pa_output_ring_buf)))
+    {
+        ret = EXIT_FAILURE;
+        goto __FREE;
+    }
     if (stream_init(&pa_stream, &fifo))
     {
         ret = EXIT_FAILURE;
         goto __FREE;
     }
 
+    downchannel.context.player = &player;
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    signal(SIGUSR1, stats_handler);
+
+    /* Without a watcher the app still runs, it just needs a restart for new settings */
+    watch_config = cfg;
+    watch_start(conf_file, settings_reload, conf_file);
+
+    trace_thread_name("main");
     printf("Listening... Press Ctrl+C to exit\n");
     is_in = REAL_TIME_INPUT;
 
-    while (1)
+    while (running)
     {
+        if (dump_stats)
+        {
+            dump_stats = 0;
+            stats_print(stdout);
+        }
+        settings_apply(&settings, &detector, &pretrigger);
+
+        now = time(0);
+        endpoint_poll(&endpoints, settings->endpoint, now);
+        token_refresh_apply(cfg, &config, now);
+        if (token_expiring(&config, now, TOKEN_REFRESH_AHEAD))
+            token_refresh_start(&config, now);
+        downchannel_poll(&downchannel, config.downchannel,
+                token_expiring(&config, now, 0) ? NULL : config.access_token, now);
+        if (config.ping[0] && now >= next_ping && !token_expiring(&config, now, 0))
+        {
+            ping_send(config.ping, config.access_token);
+            next_ping = now + PING_INTERVAL;
+        }
+
         ring_buffer_size_t sz = stream_read(&(fifo.pa_input_ring_buf), &data);
         if (sz > 0)
         {
+            trace_begin("RunDetection");
             int result = detector.RunDetection(data.data(), data.size());
-            if (result > 0 || reask > 0)
+            int early = settings->pretrigger_sensitivity[0] ? pretrigger.RunDetection(data.data(), data.size()) : 0;
+            trace_end("RunDetection");
+
+            /* without echo cancellation the reply being played would trigger both detectors */
+            int playing = player_busy(&player);
+            if (playing && (result > 0 || early > 0))
+            {
+                trace_instant("hotword_ignored");
+                result = result > 0 ? 0 : result;
+                early = 0;
+            }
+
+            if (playing)
+            {
+                preroll.clear();
+            }
+            else if (settings->pretrigger_sensitivity[0])
+            {
+                preroll.insert(preroll.end(), data.begin(), data.end());
+                if (preroll.size() > ALEXA_SAMPLE_RATE * SPECULATION_PREROLL / 1000)
+                    preroll.erase(preroll.begin(), preroll.end() - ALEXA_SAMPLE_RATE * SPECULATION_PREROLL / 1000);
+            }
+            /* the pre-trigger streams ahead, the hot word below commits it */
+            if (speculation.active)
+            {
+                speculation_feed(&speculation, &data);
+            }
+            else if (early > 0 && result <= 0 && reask == 0 && !token_expiring(&config, now, 0))
+            {
+                if (speculation_start(&speculation, endpoint_url(&endpoints), config.access_token,
+                        &preroll, &player))
+                    fprintf(stderr, "Speculative upload failed to start\n");
+            }
+            if (speculation.active && result <= 0 &&
+                    stats_now() - speculation.started > (uint64_t)SPECULATION_WINDOW * 1000000)
             {
+                speculation_cancel(&speculation);
+            }
+
+            /* voice after silence may be the hotword starting, warm up while it is said */
+            if ((result > 0 || (result == 0 && silent)) && !playing && now >= next_warmup)
+            {
+                warmup_start(endpoint_url(&endpoints));
+                next_warmup = now + WARMUP_HOLD;
+            }
+            silent = result == -2;
+            /* a reask waits for the reply to play out, or the recording would hear it and the earcon queue behind it */
+            if (result > 0 || (reask > 0 && !playing))
+            {
+                trace_instant(result > 0 ? "hotword" : "reask");
                 printf("Hot word %d detected!\n", result);
-                if (sound_size > 0)
+                if (speculation.active)
+                    speculation_commit(&speculation, &(fifo.pa_input_ring_buf));
+                if (settings->sound_size > 0)
                 {
                     ring_buffer_size_t available_samples;
                     while (1)
                     {
                         available_samples = PaUtil_GetRingBufferWriteAvailable(&(fifo.pa_output_ring_buf));
-                        if (available_samples >= sound_size / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL))
+                        if (available_samples >= settings->sound_size / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL))
                         {
                             break;
                         }
@@ -1390,12 +3088,12 @@ int main(int argc, char *argv[])
 
                     pthread_mutex_lock(&out_ring_mutex);
                     PaUtil_WriteRingBuffer(&(fifo.pa_output_ring_buf),
-                            listen_sound, sound_size / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
+                            settings->listen_sound, settings->sound_size / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
                     pthread_mutex_unlock(&out_ring_mutex);
                 }
 
-                if (!strlen(config.access_token) || config.created_time == 0 || config.expired_in == 0 ||
-                        (now - config.created_time) > (config.expired_in - 120))
+                /* a speculative upload already has its token, and its recording runs */
+                if (!speculation.active && token_expiring(&config, now, 0))
                 {
                     config.access_token[0] = '\0';
                     if (get_access_token(config.client_id, config.client_secret, config.refresh_token,
@@ -1413,23 +3111,41 @@ int main(int argc, char *argv[])
                         ConfigAddString(cfg, ALEXA_SECTION, ALEXA_ACCESS_TOKEN, config.access_token);
                         ConfigAddUnsignedInt(cfg, ALEXA_SECTION, ALEXA_CREATED_TIME, config.created_time);
                         ConfigAddUnsignedInt(cfg, ALEXA_SECTION, ALEXA_EXPIRED_IN, config.expired_in);
-                        ConfigPrintToFile(cfg, conf_file);
                     }
                 }
 
-                if (strlen(config.access_token) > 0 && config.created_time > 0 && config.expired_in > 0 &&
-                        (now - config.created_time) < (config.expired_in - 120))
+                if (speculation.active || (strlen(config.access_token) > 0 && config.created_time > 0 && config.expired_in > 0 &&
+                        (now - config.created_time) < (config.expired_in - TOKEN_MARGIN)))
                 {
+                    speech_response_t response;
                     int length, res;
                     char *ptr = NULL;
 
+                    memset(&response, 0, sizeof(speech_response_t));
+                    response.player = &player;
+
                     printf("Please ask something!\n");
-                    res = speech_request(config.access_token, &ptr, &length, &(fifo.pa_input_ring_buf));
+                    trace_begin("speech_request");
+                    if (speculation.active)
+                        res = speculation_finish(&speculation, speculation.endpoint, endpoint_alternate(&endpoints),
+                                config.access_token, &response);
+                    else
+                        res = speech_request(endpoint_url(&endpoints), endpoint_alternate(&endpoints),
+                                config.access_token, &response, &(fifo.pa_input_ring_buf));
+                    /* the endpoint did not get the utterance through, the next request tries elsewhere */
+                    if (res > 0 || response.first_failed)
+                        endpoint_failed(&endpoints);
+                    trace_end("speech_request");
+                    if (!res)
+                        next_warmup = time(0) + WARMUP_HOLD;
+                    ptr = response.body.ptr;
+                    length = response.body.len;
                     if (!res && length)
                     {
                         char bond[64];
                         char *begin = NULL, *end = NULL, *tmp = NULL;
 
+                        reask = response.reask;
                         sscanf(ptr, "%s", bond);
                         begin = ptr + strlen(bond);
 
@@ -1437,25 +3153,39 @@ int main(int argc, char *argv[])
                             (end = strnstr(tmp, bond, length - (tmp - ptr))))
                         {
                             if (debug) printf("Result: %.*s\n", (int)((end - 2) - (tmp + 20)), tmp + 20);
-                            reask = is_reask(tmp + 20, (end - 2) - (tmp + 20));
                             begin = end + strlen(bond);
                         }
 
-                        while ((tmp = strnstr(begin, "audio/mpeg", length - (begin - ptr))) &&
+                        /* Speak directives pick the audio parts and their order */
+                        for (i = 0; i < response.speak_count; i++)
+                        {
+                            char content_id[sizeof(response.speak[0]) + 16];
+
+                            sprintf(content_id, "Content-ID: <%s>", response.speak[i]);
+                            if ((tmp = strnstr(begin, content_id, length - (begin - ptr))) &&
+                                (tmp = strnstr(tmp, "\r\n\r\n", length - (tmp - ptr))) &&
+                                (end = strnstr(tmp, bond, length - (tmp - ptr))))
+                            {
+                                player_queue(&player, tmp + 4, (end - 2) - (tmp + 4), NULL);
+                            }
+                        }
+
+                        while (!response.speak_count && (tmp = strnstr(begin, "audio/mpeg", length - (begin - ptr))) &&
                                (end = strnstr(tmp, bond, length - (begin - ptr))))
                         {
-                            stream_write(audio_output, &(fifo.pa_output_ring_buf), tmp + 14, (end - 2) - (tmp + 14));
+                            player_queue(&player, tmp + 14, (end - 2) - (tmp + 14), NULL);
                             begin = end + strlen(bond);
                         }
-                        free(ptr);
+                        /* the parts point into the body, the player frees it after them */
+                        player_queue(&player, NULL, 0, ptr);
                     }
-                    else if (res > 0 && lost_size > 0)
+                    else if (res > 0 && settings->lost_size > 0)
                     {
                         ring_buffer_size_t available_samples;
                         while (1)
                         {
                             available_samples = PaUtil_GetRingBufferWriteAvailable(&(fifo.pa_output_ring_buf));
-                            if (available_samples >= lost_size / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL))
+                            if (available_samples >= settings->lost_size / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL))
                             {
                                 break;
                             }
@@ -1464,7 +3194,7 @@ int main(int argc, char *argv[])
 
                         pthread_mutex_lock(&out_ring_mutex);
                         PaUtil_WriteRingBuffer(&(fifo.pa_output_ring_buf),
-                                lost_sound, lost_size / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
+                                settings->lost_sound, settings->lost_size / (BYTES_PER_SAMPLE * NUMBER_OF_CHANNEL));
                         pthread_mutex_unlock(&out_ring_mutex);
                         reask = 0;
                     }
@@ -1483,16 +3213,31 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (lost_size > 0) free(lost_sound);
-    if (sound_size > 0) free(listen_sound);
+    watch_stop();
+    speculation_free(&speculation);
+    player_stop(&player);
     stream_close(pa_stream, &fifo);
+    if (print_stats)
+    {
+        stats_print(stdout);
+    }
     pthread_mutex_destroy(&in_ring_mutex);
     pthread_mutex_destroy(&out_ring_mutex);
-    pthread_mutex_destroy(&wav_mutex);
-    pthread_cond_destroy (&wav_cond);
 
 __FREE:
+    player_stop(&player);
+    net_stop();
+    endpoint_set_free(&endpoints);
+    token_refresh_free();
+    downchannel_free(&downchannel);
+    json_arena_free(&downchannel.tokens);
+    json_arena_free(&json_tokens);
+    settings_free(pending_settings.exchange(NULL));
+    settings_free(settings);
     ConfigFree(cfg);
 __EXIT:
+    trace_close();
     return ret;
 }
+
+#endif // ALEXA_NO_MAIN
@@ -7,8 +7,14 @@
 #define __CLOUDUPLOADER_H__
 
 #include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <curl/curl.h>
 #include <pa_ringbuffer.h>
 
+#include "json/json.h"
+#include "net.h"
+
 #define MAXBUF      1024
 
 #define ALEXA_SECTION          "alexa"
@@ -18,6 +24,21 @@
 #define ALEXA_ACCESS_TOKEN     "access_token"
 #define ALEXA_CREATED_TIME     "created_time"
 #define ALEXA_EXPIRED_IN       "expired_in"
+#define ALEXA_SENSITIVITY      "sensitivity"
+#define ALEXA_PRETRIGGER       "pretrigger_sensitivity"
+#define ALEXA_AUDIO_GAIN       "audio_gain"
+#define ALEXA_ENDPOINT         "endpoint"
+#define ALEXA_RECORDING_TIME   "recording_time"
+#define ALEXA_LISTEN_SOUND     "listen_sound"
+#define ALEXA_LOST_SOUND       "lost_sound"
+#define ALEXA_DOWNCHANNEL      "downchannel"
+#define ALEXA_PING             "ping"
+
+#define SPEAK_MAX              4        // Speak directives played from one reply
+#define ENDPOINT_MAX           4        // recognize endpoints the endpoint setting may list
+#define PLAYER_JOBS            16       // audio parts queued for the player, a power of 2
+#define BODY_SEGMENTS          4        // metadata and part headers, WAV header, audio, tailer
+#define BODY_OPEN              ((size_t)-1) // audio length of a body which ends with the recording
 
 enum input_state {
     STOP_INPUT = 0,
@@ -25,9 +46,37 @@ enum input_state {
     REAL_TIME_INPUT
 };
 
+typedef struct body_segment
+{
+    const char *ptr;                // NULL for audio taken from the capture ring
+    size_t len;
+}body_segment_t;
+
+struct speech_response;
+struct player;
+
+/* Requests racing for one utterance, the first byte of a 2xx reply picks the answer */
+typedef struct hedge
+{
+    std::atomic<struct speech_response *> winner;
+    std::atomic<uint64_t> sent_at;  // the first request handed its whole body to curl
+}hedge_t;
+
+/* Request body, sent segment by segment without being copied together */
 typedef struct data_stream {
     PaUtilRingBuffer *pa_ring_buf;
     size_t sizeleft;
+    char wav_header[64];
+    body_segment_t segments[BODY_SEGMENTS];
+    int segment;                    // segment being sent
+    size_t offset;                  // bytes of it already sent
+    CURL *curl;                     // resumed by the capture callback when audio arrives
+    uint64_t sent_at;               // stats_now() once the whole body was handed to curl
+    size_t sent;                    // bytes handed to curl so far
+    char *audio;                    // copy of the audio sent, to send it again, NULL for none
+    size_t audio_len;
+    size_t audio_size;
+    hedge_t *hedge;                 // told when the body is sent, NULL outside a race
 }data_stream_t;
 
 typedef struct string {
@@ -35,6 +84,119 @@ typedef struct string {
     size_t len;
 }string_t;
 
+/* Background refresh of the access token, started and applied by the main thread */
+typedef struct token_refresh
+{
+    CURL *curl;                     // NULL while no refresh is in flight
+    struct curl_slist *headers;
+    char content[MAXBUF * 3];
+    string_t response;
+    CURLcode result;                // set on the network thread when the transfer is over
+    time_t retry_at;                // a failed refresh is not retried before
+}token_refresh_t;
+
+/* Multipart reply of a speech request, its JSON part is parsed while it arrives */
+typedef struct speech_response
+{
+    string_t body;
+    char boundary[64];              // first line of the body, empty until it is complete
+    size_t json_start;              // offset of the JSON part, 0 until its headers are complete
+    size_t json_end;                // end of the JSON part found so far
+    size_t scanned;                 // the boundary search resumes here
+    int json_done;
+    json_stream_t json;
+    int reask;                      // a SpeechRecognizer directive was seen
+    char speak[SPEAK_MAX][128];     // content IDs of the audio parts to play, in order
+    int speak_count;
+    struct player *player;          // AudioPlayer stop cancels what it queued, set by the caller
+    uint64_t first_byte_at;         // stats_now() of the first byte of the body
+    hedge_t *hedge;                 // NULL outside a race
+    CURL *curl;                     // transfer filling it in, only a 2xx status of it wins the race
+    int first_failed;               // the first request of the race failed, another one answered
+}speech_response_t;
+
+/* One directive of a reply, tokens[0] is its object */
+typedef struct directive
+{
+    const char *js;
+    const jsmntok_t *tokens;
+    int count;
+}directive_t;
+
+typedef void (*directive_fn)(speech_response_t *resp, const directive_t *d);
+
+typedef struct directive_entry
+{
+    const char *ns;
+    const char *name;
+    directive_fn handler;
+}directive_entry_t;
+
+/* Long-lived GET of the directives endpoint, the service pushes directives down it */
+typedef struct downchannel
+{
+    CURL *curl;                     // NULL while closed
+    struct curl_slist *headers;
+    string_t body;                  // from the part still arriving on
+    char boundary[64];
+    json_arena_t tokens;            // network thread only
+    speech_response_t context;      // what the directive handlers act on
+    CURLcode result;                // set on the network thread when the stream ends
+    time_t retry_at;
+}downchannel_t;
+
+/* Speech request running on the network thread between its start and finish */
+typedef struct speech_request
+{
+    CURL *curl;
+    struct curl_slist *headers;
+    data_stream_t pooh;
+    speech_response_t *response;
+    net_wait_t wait;
+    hedge_t hedge;                  // of this request and the ones sent after it
+    json_arena_t tokens;            // a hedge or a retry parses its reply here
+}speech_request_t;
+
+/* Upload started on the pre-trigger, the hot word commits it or the window runs out */
+typedef struct speculation
+{
+    int active;
+    uint64_t started;               // stats_now() of the pre-trigger
+    size_t teed;                    // samples written to the ring before the hot word
+    PaUtilRingBuffer ring;          // pre-roll and detection audio, then the recording
+    char *ring_buf;
+    json_arena_t tokens;            // the main thread parses token replies meanwhile
+    speech_request_t request;
+    speech_response_t response;
+    char endpoint[MAXBUF];          // the request went to
+}speculation_t;
+
+/* One recognize endpoint, probed in the background */
+typedef struct endpoint
+{
+    char url[MAXBUF];
+    CURL *curl;                     // probe in flight, NULL when none
+    std::atomic<bool> probed;       // set on the network thread once the probe is over
+    long sample_us;                 // round trip the probe took, -1 when it failed
+    long srtt_us;                   // smoothed round trip, 0 before the first sample
+    int healthy;                    // its last probe or request went through
+}endpoint_t;
+
+/* The endpoints a recognize request can go to, main thread only */
+typedef struct endpoint_set
+{
+    endpoint_t endpoints[ENDPOINT_MAX];
+    int count;
+    int current;                    // where requests go
+    time_t next_probe;
+    char list[MAXBUF];              // the setting it was parsed from
+}endpoint_set_t;
+
+typedef struct ping
+{
+    struct curl_slist *headers;
+}ping_t;
+
 typedef struct alexa_config
 {
     char client_id[MAXBUF];
@@ -43,9 +205,54 @@ typedef struct alexa_config
     char access_token[MAXBUF];
     unsigned int created_time;
     int expired_in;
+    char downchannel[MAXBUF];       // directives endpoint, empty to go without
+    char ping[MAXBUF];              // pinged every PING_INTERVAL, empty to go without
 
 }alexa_config_t;
 
+/* Settings which are reloaded while running, the command line gives their defaults */
+typedef struct alexa_settings
+{
+    char sensitivity[16];
+    char pretrigger_sensitivity[16];    // higher than sensitivity, empty for no speculative upload
+    float audio_gain;
+    char endpoint[MAXBUF];
+    unsigned int recording_time;    // mili-seconds
+    char listen_sound_file[MAXBUF];
+    char lost_sound_file[MAXBUF];
+
+    char *listen_sound;             // loaded earcons, NULL when not set
+    size_t sound_size;
+    char *lost_sound;
+    size_t lost_size;
+    unsigned long generation;
+}alexa_settings_t;
+
+/* An audio part of a reply for the player, or with ptr NULL the reply body to free after them */
+typedef struct play_job
+{
+    const char *ptr;
+    size_t len;
+    char *body;
+}play_job_t;
+
+/* Long-lived decode worker, the main thread queues replies and goes back to detection */
+typedef struct player
+{
+    pthread_t thread;
+    int started;
+    PaUtilRingBuffer jobs;          // main thread to player, lock-free
+    play_job_t job_buf[PLAYER_JOBS];
+    pthread_mutex_t mutex;          // only to sleep on while there are no jobs
+    pthread_cond_t cond;
+    std::atomic<bool> running;
+    std::atomic<unsigned long> queued;
+    std::atomic<unsigned long> played;
+    std::atomic<unsigned long> cancelled;   // jobs up to this many queued are dropped, not played
+    const char *output;             // --output, the decoded audio is also written there
+    PaUtilRingBuffer *playback;
+}player_t;
+
 typedef struct ring_buf
 {
     PaUtilRingBuffer pa_input_ring_buf;
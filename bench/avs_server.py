@@ -0,0 +1,349 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2016 Trung Huynh
+# All rights reserved
+#
+
+"""Local stand-in for the Alexa service, to measure the transport.
+
+Usage: avs_server.py [--port PORT] [--think MS] [--push SECONDS] [--mp3 FILE]
+                     [--stall-every N [--stall MS]] [--drop-every N]
+                     [--fail-every N] [--rtt MS]
+
+Serves HTTP/2 over TLS (ALPN h2) and falls back to HTTP/1.1 for clients
+which do not offer it. Point the endpoint, downchannel and ping keys of
+alexa.conf at https://localhost:PORT/... :
+
+  POST .../recognize    v1 multipart reply, a Speak directive and its audio
+  GET  .../directives   downchannel, a Speaker directive every --push seconds
+  GET  .../ping         204
+  HEAD of any of them   200, the warm-up before a request
+
+Every connection and request is logged to stderr with its protocol and
+timing, so the handshakes saved by sharing one connection show up as the
+number of connections, and head-of-line blocking as requests waiting on a
+slow --think. --stall-every and --drop-every hold back or reset every Nth
+recognize request, to see the client hedge and retry. --fail-every answers
+every Nth one at once with a 500, which must not beat a slower good reply.
+--rtt delays every reply, so several of these on different ports stand in
+for regions further away for the endpoint probes. Needs the h2 package (pip install h2) and openssl to make a
+self-signed certificate when --cert is not given.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import ssl
+import subprocess
+import sys
+import tempfile
+import time
+
+import h2.config
+import h2.connection
+import h2.events
+import h2.exceptions
+
+BOUNDARY = "avs-stand-in-boundary"
+CONTENT_ID = "amzn1.as-ct.v1.stand-in"
+
+FAIL = "fail"
+
+args = None
+connections = 0
+recognizes = 0
+
+
+def log(conn, fmt, *values):
+    sys.stderr.write("%.3f conn %d: %s\n" % (time.monotonic(), conn, fmt % values))
+
+
+def recognize_fate():
+    """Extra mili-seconds before replying to the next recognize request, None to reset it, FAIL for a 500."""
+    global recognizes
+    recognizes += 1
+    if args.drop_every and recognizes % args.drop_every == 0:
+        return None
+    if args.fail_every and recognizes % args.fail_every == 0:
+        return FAIL
+    if args.stall_every and recognizes % args.stall_every == 0:
+        return args.stall
+    return 0
+
+
+def recognize_reply():
+    directive = {"namespace": "SpeechSynthesizer", "name": "speak",
+                 "payload": {"contentIdentifier": CONTENT_ID, "audioContent": "cid:" + CONTENT_ID}}
+    body = json.dumps({"messageHeader": {}, "messageBody": {"directives": [directive]}})
+    audio = open(args.mp3, "rb").read() if args.mp3 else b""
+    return (("--%s\r\nContent-Type: application/json\r\n\r\n%s\r\n"
+             "--%s\r\nContent-ID: <%s>\r\nContent-Type: audio/mpeg\r\n\r\n")
+            % (BOUNDARY, body, BOUNDARY, CONTENT_ID)).encode() + audio + ("\r\n--%s--\r\n" % BOUNDARY).encode()
+
+
+def pushed_directive(volume):
+    directive = {"directive": {"header": {"namespace": "Speaker", "name": "SetVolume", "messageId": str(volume)},
+                               "payload": {"volume": volume}}}
+    return ("--%s\r\nContent-Type: application/json; charset=UTF-8\r\n\r\n%s\r\n"
+            % (BOUNDARY, json.dumps(directive))).encode()
+
+
+def error_reply():
+    return json.dumps({"header": {"namespace": "System", "name": "Exception"},
+                       "payload": {"code": "INTERNAL_SERVICE_EXCEPTION", "description": "stand-in failure"}}).encode()
+
+
+def multipart_headers(status="200"):
+    return [(":status", status), ("content-type", "multipart/related; boundary=%s" % BOUNDARY)]
+
+
+class H2Connection:
+    """One HTTP/2 connection, each request runs as its own task."""
+
+    def __init__(self, conn, reader, writer):
+        self.conn = conn
+        self.reader = reader
+        self.writer = writer
+        self.h2 = h2.connection.H2Connection(config=h2.config.H2Configuration(client_side=False))
+        self.streams = {}
+        self.windows = {}
+        self.count = 0
+
+    def flush(self):
+        self.writer.write(self.h2.data_to_send())
+
+    async def send(self, stream_id, data, end=False):
+        while data:
+            window = min(self.h2.local_flow_control_window(stream_id), self.h2.max_outbound_frame_size)
+            if window <= 0:
+                self.windows[stream_id] = asyncio.Event()
+                await self.windows[stream_id].wait()
+                continue
+            self.h2.send_data(stream_id, data[:window])
+            data = data[window:]
+            self.flush()
+        if end:
+            self.h2.end_stream(stream_id)
+            self.flush()
+        await self.writer.drain()
+
+    async def handle(self, stream_id, headers, body):
+        try:
+            await self.respond(stream_id, headers, body)
+        except h2.exceptions.ProtocolError:
+            log(self.conn, "stream %d cancelled by the client", stream_id)
+
+    async def respond(self, stream_id, headers, body):
+        method, path = headers[":method"], headers[":path"]
+        start = time.monotonic()
+        await asyncio.sleep(args.rtt / 1000.0)
+        if path.endswith("/directives"):
+            log(self.conn, "stream %d %s %s downchannel open", stream_id, method, path)
+            self.h2.send_headers(stream_id, multipart_headers())
+            self.flush()
+            volume = 0
+            while args.push > 0:
+                await asyncio.sleep(args.push)
+                volume = (volume + 10) % 110
+                await self.send(stream_id, pushed_directive(volume))
+                log(self.conn, "stream %d pushed SetVolume %d", stream_id, volume)
+            return
+        if method == "HEAD":
+            self.h2.send_headers(stream_id, [(":status", "200")], end_stream=True)
+            self.flush()
+        elif path.endswith("/ping"):
+            self.h2.send_headers(stream_id, [(":status", "204")], end_stream=True)
+            self.flush()
+        elif path.endswith("/recognize"):
+            data = await body
+            stall = recognize_fate()
+            if stall is None:
+                self.h2.reset_stream(stream_id)
+                self.flush()
+                log(self.conn, "stream %d received %d bytes, dropped", stream_id, len(data))
+                return
+            if stall is FAIL:
+                self.h2.send_headers(stream_id, [(":status", "500"), ("content-type", "application/json")])
+                await self.send(stream_id, error_reply(), end=True)
+                log(self.conn, "stream %d received %d bytes, failed", stream_id, len(data))
+                return
+            await asyncio.sleep((args.think + stall) / 1000.0)
+            self.h2.send_headers(stream_id, multipart_headers())
+            await self.send(stream_id, recognize_reply(), end=True)
+            log(self.conn, "stream %d received %d bytes", stream_id, len(data))
+        else:
+            self.h2.send_headers(stream_id, [(":status", "404")], end_stream=True)
+            self.flush()
+        log(self.conn, "stream %d %s %s done in %.1f ms", stream_id, method, path, (time.monotonic() - start) * 1000)
+
+    async def run(self):
+        self.h2.initiate_connection()
+        self.flush()
+        while True:
+            data = await self.reader.read(65536)
+            if not data:
+                break
+            for event in self.h2.receive_data(data):
+                if isinstance(event, h2.events.RequestReceived):
+                    headers = dict((k.decode() if isinstance(k, bytes) else k, v.decode() if isinstance(v, bytes) else v)
+                                   for k, v in event.headers)
+                    body = asyncio.get_running_loop().create_future()
+                    self.streams[event.stream_id] = [bytearray(), body]
+                    self.count += 1
+                    asyncio.ensure_future(self.handle(event.stream_id, headers, body))
+                elif isinstance(event, h2.events.DataReceived):
+                    self.streams[event.stream_id][0] += event.data
+                    self.h2.acknowledge_received_data(event.flow_controlled_length, event.stream_id)
+                elif isinstance(event, h2.events.StreamEnded):
+                    buf, body = self.streams.pop(event.stream_id)
+                    if not body.done():
+                        body.set_result(bytes(buf))
+                elif isinstance(event, h2.events.WindowUpdated):
+                    for stream_id in ([event.stream_id] if event.stream_id else list(self.windows)):
+                        waiting = self.windows.pop(stream_id, None)
+                        if waiting:
+                            waiting.set()
+                elif isinstance(event, h2.events.PingReceived):
+                    log(self.conn, "PING")
+                elif isinstance(event, h2.events.ConnectionTerminated):
+                    break
+            self.flush()
+            await self.writer.drain()
+        log(self.conn, "closed after %d streams", self.count)
+
+
+async def http1(conn, reader, writer):
+    """Plain HTTP/1.1 keep-alive, one request at a time on the connection."""
+    count = 0
+    while True:
+        line = await reader.readline()
+        if not line:
+            break
+        method, path = line.decode().split()[:2]
+        headers = {}
+        while True:
+            line = (await reader.readline()).decode().strip()
+            if not line:
+                break
+            key, value = line.split(":", 1)
+            headers[key.strip().lower()] = value.strip()
+        body = b""
+        if headers.get("transfer-encoding") == "chunked":
+            while True:
+                size = int((await reader.readline()).strip(), 16)
+                body += await reader.readexactly(size + 2)
+                if size == 0:
+                    break
+        elif "content-length" in headers:
+            body = await reader.readexactly(int(headers["content-length"]))
+        count += 1
+        start = time.monotonic()
+        await asyncio.sleep(args.rtt / 1000.0)
+        if path.endswith("/directives"):
+            log(conn, "%s %s downchannel open, the connection is taken", method, path)
+            writer.write(("HTTP/1.1 200 OK\r\nContent-Type: multipart/related; boundary=%s\r\n"
+                          "Transfer-Encoding: chunked\r\n\r\n" % BOUNDARY).encode())
+            volume = 0
+            while args.push > 0:
+                await asyncio.sleep(args.push)
+                volume = (volume + 10) % 110
+                part = pushed_directive(volume)
+                writer.write(b"%x\r\n%s\r\n" % (len(part), part))
+                await writer.drain()
+            await asyncio.Event().wait()
+        if method == "HEAD":
+            writer.write(b"HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n")
+        elif path.endswith("/ping"):
+            writer.write(b"HTTP/1.1 204 No Content\r\n\r\n")
+        elif path.endswith("/recognize"):
+            stall = recognize_fate()
+            if stall is None:
+                log(conn, "received %d bytes, dropped", len(body))
+                break
+            if stall is FAIL:
+                reply = error_reply()
+                writer.write(("HTTP/1.1 500 Internal Server Error\r\nContent-Type: application/json\r\n"
+                              "Content-Length: %d\r\n\r\n" % len(reply)).encode() + reply)
+                await writer.drain()
+                log(conn, "received %d bytes, failed", len(body))
+                continue
+            await asyncio.sleep((args.think + stall) / 1000.0)
+            reply = recognize_reply()
+            writer.write(("HTTP/1.1 200 OK\r\nContent-Type: multipart/related; boundary=%s\r\n"
+                          "Content-Length: %d\r\n\r\n" % (BOUNDARY, len(reply))).encode() + reply)
+            log(conn, "received %d bytes", len(body))
+        else:
+            writer.write(b"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n")
+        await writer.drain()
+        log(conn, "%s %s done in %.1f ms", method, path, (time.monotonic() - start) * 1000)
+    log(conn, "closed after %d requests", count)
+
+
+async def accept(reader, writer):
+    global connections
+    connections += 1
+    conn = connections
+    proto = writer.get_extra_info("ssl_object").selected_alpn_protocol() or "http/1.1"
+    log(conn, "open %s from %s, %d connections so far", proto, writer.get_extra_info("peername")[0], connections)
+    try:
+        if proto == "h2":
+            await H2Connection(conn, reader, writer).run()
+        else:
+            await http1(conn, reader, writer)
+    except (ConnectionError, asyncio.IncompleteReadError):
+        log(conn, "reset")
+    writer.close()
+
+
+def certificate(directory):
+    cert, key = os.path.join(directory, "cert.pem"), os.path.join(directory, "key.pem")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1",
+                    "-subj", "/CN=localhost", "-addext", "subjectAltName=DNS:localhost,IP:127.0.0.1",
+                    "-keyout", key, "-out", cert], check=True, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+async def serve(cert, key):
+    context = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+    context.load_cert_chain(cert, key)
+    context.set_alpn_protocols(["h2", "http/1.1"])
+    server = await asyncio.start_server(accept, "127.0.0.1", args.port, ssl=context)
+    sys.stderr.write("Listening on https://localhost:%d\n" % args.port)
+    async with server:
+        await server.serve_forever()
+
+
+def main():
+    global args
+    parser = argparse.ArgumentParser(description="Stand-in for the Alexa service over HTTP/2.")
+    parser.add_argument("-p", "--port", type=int, default=8443)
+    parser.add_argument("--think", type=float, default=0,
+                        help="mili-seconds between the end of an utterance and the reply")
+    parser.add_argument("--push", type=float, default=0,
+                        help="seconds between directives pushed down the downchannel, 0 for none")
+    parser.add_argument("--mp3", help="audio of the Speak directive")
+    parser.add_argument("--stall-every", type=int, default=0,
+                        help="hold back the reply to every Nth recognize request by --stall")
+    parser.add_argument("--stall", type=float, default=15000,
+                        help="mili-seconds a held back reply waits on top of --think")
+    parser.add_argument("--drop-every", type=int, default=0,
+                        help="reset every Nth recognize request instead of replying")
+    parser.add_argument("--fail-every", type=int, default=0,
+                        help="answer every Nth recognize request at once with a 500")
+    parser.add_argument("--rtt", type=float, default=0,
+                        help="mili-seconds added to every reply, as if the server were further away")
+    parser.add_argument("--cert", help="PEM certificate, a self-signed one is made when missing")
+    parser.add_argument("--key", help="PEM key of --cert")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as directory:
+        cert, key = (args.cert, args.key) if args.cert else certificate(directory)
+        try:
+            asyncio.run(serve(cert, key))
+        except KeyboardInterrupt:
+            pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2016 Trung Huynh
+# All rights reserved
+#
+
+"""Compares two bench/microbench results and flags regressions.
+
+Usage: compare.py [--threshold PERCENT] <baseline.json> <result.json>
+
+Exits with 1 when any benchmark got slower than the threshold allows.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {b["name"]: b for b in json.load(f)["benchmarks"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Flag microbenchmark regressions against a baseline.")
+    parser.add_argument("baseline")
+    parser.add_argument("result")
+    parser.add_argument("-t", "--threshold", type=float, default=10.0,
+                        help="allowed slowdown in percent (default: 10)")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    result = load(args.result)
+    regressions = 0
+
+    print("%-28s %14s %14s %9s" % ("benchmark", "baseline ns", "result ns", "change"))
+    for name, cur in result.items():
+        base = baseline.get(name)
+        if base is None:
+            print("%-28s %14s %14.1f %9s" % (name, "-", cur["ns_per_op"], "new"))
+            continue
+        change = (cur["ns_per_op"] / base["ns_per_op"] - 1) * 100
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print("%-28s %14.1f %14.1f %+8.1f%%%s" % (name, base["ns_per_op"], cur["ns_per_op"], change, flag))
+    for name in baseline:
+        if name not in result:
+            print("%-28s %14.1f %14s %9s" % (name, baseline[name]["ns_per_op"], "-", "missing"))
+
+    if regressions:
+        print("%d benchmark(s) regressed by more than %.1f%%" % (regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
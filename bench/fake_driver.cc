@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2016 Trung Huynh
+ * All rights reserved
+ */
+
+/*
+ * Fake PortAudio driver.
+ *
+ * Stands in for the PortAudio front-end with a simulated device that calls
+ * pa_stream_callback from its own thread on a configurable clock. Frame count,
+ * jitter and statusFlags are scripted, input comes from a WAV file or a tone,
+ * and output is captured, so the rings, the RECORD_INPUT -> STOP_INPUT
+ * transition and the upload path can be measured reproducibly and faster than
+ * real time. Only the ring buffer is linked from libportaudio.
+ */
+
+#define ALEXA_NO_MAIN
+#include "../alexa.cc"
+
+#include <math.h>
+
+#define FAKE_MAX_FRAMES         8192
+#define FAKE_READ_SIZE          16384   // bytes curl asks read_callback for (CURL_MAX_WRITE_SIZE)
+
+typedef struct fake_device
+{
+    PaStreamCallback *callback;
+    void *user_data;
+    pthread_t thread;
+    volatile int started;
+
+    unsigned long frames;           // frames per callback
+    unsigned long jitter;           // +/- frames around `frames`
+    PaStreamCallbackFlags flags;    // statusFlags to inject ...
+    unsigned long flags_every;      // ... on every n-th callback
+    double speed;                   // device clock speed-up, 0 runs unpaced
+    unsigned long stall;            // mili-seconds the playback writer stops halfway, 0 for none
+
+    int16_t *input;                 // scripted input, looped
+    size_t input_len;
+    size_t input_pos;
+
+    volatile int capture;
+    std::vector<int16_t> output;
+
+    volatile uint64_t clock;        // simulated device time, in frames
+    volatile unsigned long callbacks;
+    volatile uint64_t record_start;
+    volatile uint64_t record_stop;
+}fake_device_t;
+
+static fake_device_t dev;
+
+static double frames_ms(uint64_t frames)
+{
+    return frames * 1000.0 / ALEXA_SAMPLE_RATE;
+}
+
+static double wall_ms(uint64_t start)
+{
+    return (stats_now() - start) / 1e6;
+}
+
+static void *fake_device_run(void *arg)
+{
+    static int16_t in[FAKE_MAX_FRAMES], out[FAKE_MAX_FRAMES];
+    PaStreamCallbackTimeInfo time_info;
+    PaStreamCallbackFlags flags;
+    uint64_t deadline = stats_now();
+    input_state state;
+    unsigned long i, n;
+
+    (void)arg;
+    while (dev.started)
+    {
+        n = dev.frames;
+        if (dev.jitter > 0)
+            n = n - dev.jitter + rand() % (2 * dev.jitter + 1);
+        if (n < 1) n = 1;
+        if (n > FAKE_MAX_FRAMES) n = FAKE_MAX_FRAMES;
+
+        for (i = 0; i < n; i++)
+        {
+            in[i] = dev.input[dev.input_pos];
+            dev.input_pos = (dev.input_pos + 1) % dev.input_len;
+        }
+
+        flags = (dev.flags_every > 0 && (dev.callbacks + 1) % dev.flags_every == 0) ? dev.flags : 0;
+        time_info.currentTime = dev.clock / (double)ALEXA_SAMPLE_RATE;
+        time_info.inputBufferAdcTime = time_info.currentTime;
+        time_info.outputBufferDacTime = time_info.currentTime + n / (double)ALEXA_SAMPLE_RATE;
+
+        state = is_in;
+        dev.callback(in, out, n, &time_info, flags, dev.user_data);
+        if (state == RECORD_INPUT && dev.record_start == 0)
+            dev.record_start = dev.clock;
+        if (state == RECORD_INPUT && is_in == STOP_INPUT)
+            dev.record_stop = dev.clock + n;
+
+        if (dev.capture)
+            dev.output.insert(dev.output.end(), out, out + n);
+
+        dev.clock += n;
+        dev.callbacks++;
+
+        if (dev.speed > 0)
+        {
+            uint64_t now = stats_now();
+            deadline += (uint64_t)(n * 1e9 / ALEXA_SAMPLE_RATE / dev.speed);
+            if (deadline > now)
+                usleep((deadline - now) / 1000);
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/* PortAudio front-end used by stream_init()/stream_close() */
+
+PaError Pa_Initialize(void) { return paNoError; }
+PaError Pa_Terminate(void) { return paNoError; }
+const char *Pa_GetErrorText(PaError errorCode) { (void)errorCode; return "fake driver error"; }
+
+PaError Pa_OpenDefaultStream(PaStream **stream, int numInputChannels, int numOutputChannels,
+        PaSampleFormat sampleFormat, double sampleRate, unsigned long framesPerBuffer,
+        PaStreamCallback *streamCallback, void *userData)
+{
+    (void)numInputChannels; (void)numOutputChannels; (void)sampleFormat;
+    (void)sampleRate; (void)framesPerBuffer;
+
+    dev.callback = streamCallback;
+    dev.user_data = userData;
+    *stream = &dev;
+    return paNoError;
+}
+
+PaError Pa_StartStream(PaStream *stream)
+{
+    (void)stream;
+    dev.started = 1;
+    if (pthread_create(&dev.thread, NULL, fake_device_run, NULL))
+        return -1;
+    return paNoError;
+}
+
+PaError Pa_StopStream(PaStream *stream)
+{
+    (void)stream;
+    dev.started = 0;
+    pthread_join(dev.thread, NULL);
+    return paNoError;
+}
+
+PaError Pa_CloseStream(PaStream *stream) { (void)stream; return paNoError; }
+
+void Pa_Sleep(long msec)
+{
+    if (dev.speed > 0)
+        usleep(msec * 1000 / dev.speed);
+    else
+        sched_yield();
+}
+
+void *PaUtil_AllocateMemory(long size) { return malloc(size); }
+void PaUtil_FreeMemory(void *block) { free(block); }
+
+/* Scenarios */
+
+static void scenario_detect(ring_buf_t *fifo, double seconds)
+{
+    std::vector<int16_t> data;
+    uint64_t start = stats_now(), clock = dev.clock;
+    unsigned long lost = audio_stats.input_lost_samples.load();
+    size_t samples = 0, reads = 0, backlog = 0;
+
+    is_in = REAL_TIME_INPUT;
+    while (samples < seconds * ALEXA_SAMPLE_RATE)
+    {
+        ring_buffer_size_t sz = stream_read(&fifo->pa_input_ring_buf, &data);
+        samples += sz;
+        reads++;
+        if ((size_t)sz > backlog)
+            backlog = sz;
+    }
+
+    printf("{\"scenario\":\"detect\",\"reads\":%zu,\"samples\":%zu,\"mean_chunk_ms\":%.3f,"
+            "\"max_backlog_ms\":%.3f,\"lost_samples\":%lu,\"sim_ms\":%.3f,\"wall_ms\":%.3f}\n",
+            reads, samples, frames_ms(samples) / reads, frames_ms(backlog),
+            audio_stats.input_lost_samples.load() - lost, frames_ms(dev.clock - clock), wall_ms(start));
+}
+
+static void scenario_record(ring_buf_t *fifo)
+{
+    data_stream_t pooh;
+    std::vector<char> body;
+    char buf[FAKE_READ_SIZE], header[MAXBUF], tailer[MAXBUF];
+    size_t n, expected, pauses = 0;
+    uint64_t start = stats_now(), drained;
+
+    is_in = REAL_TIME_INPUT;
+    dev.record_start = dev.record_stop = 0;
+    pooh.pa_ring_buf = &fifo->pa_input_ring_buf;
+    pooh.curl = NULL;
+    pooh.audio = NULL;
+    pooh.hedge = NULL;
+    speech_body_init(&pooh, 0);
+    expected = pooh.sizeleft;
+
+    while ((n = read_callback(buf, 1, sizeof(buf), &pooh)) > 0)
+    {
+        if (n == CURL_READFUNC_PAUSE)
+        {
+            /* no network thread here to resume it, poll the fake device instead */
+            pauses++;
+            Pa_Sleep(1);
+            continue;
+        }
+        body.insert(body.end(), buf, buf + n);
+    }
+    drained = dev.clock;
+
+    sprintf(header, DATA_HEADER, BOUNDARY, ALEXA_SAMPLE_RATE, BOUNDARY, ALEXA_SAMPLE_RATE);
+    sprintf(tailer, DATA_TAILER, BOUNDARY);
+    printf("{\"scenario\":\"record\",\"expected_bytes\":%zu,\"body_bytes\":%zu,\"header_intact\":%s,\"tailer_intact\":%s,\"pauses\":%zu,"
+            "\"record_ms\":%.3f,\"recording_time_ms\":%u,\"drain_ms\":%.3f,\"wall_ms\":%.3f}\n",
+            expected, body.size(),
+            (body.size() >= strlen(header) && !memcmp(body.data(), header, strlen(header))) ? "true" : "false",
+            (body.size() >= strlen(tailer) &&
+             !memcmp(body.data() + body.size() - strlen(tailer), tailer, strlen(tailer))) ? "true" : "false",
+            pauses,
+            frames_ms(dev.record_stop - dev.record_start), recording_time,
+            frames_ms(drained - dev.record_stop), wall_ms(start));
+
+    is_in = REAL_TIME_INPUT;
+}
+
+static void scenario_playback(ring_buf_t *fifo, double seconds)
+{
+    std::vector<int16_t> clip((size_t)(seconds * ALEXA_SAMPLE_RATE));
+    uint64_t start = stats_now(), clock;
+    unsigned long underflows = audio_stats.output_underflows.load();
+    size_t i, written = 0, played = 0, first = 0, chunk = 1152; // one mp3 frame, as stream_write writes them
+
+    for (i = 0; i < clip.size(); i++)
+        clip[i] = (int16_t)(8000 * sin(2 * M_PI * 440 * i / ALEXA_SAMPLE_RATE)) | 1;
+
+    is_in = STOP_INPUT;
+    dev.output.clear();
+    dev.capture = 1;
+    clock = dev.clock;
+
+    /* as stream_write() does, so a ring running dry meanwhile is an underflow */
+    output_playing = true;
+    while (written < clip.size())
+    {
+        if (dev.stall && written < clip.size() / 2 && written + chunk >= clip.size() / 2)
+        {
+            /* a decoder falling behind, the ring runs dry and stays short of a buffer */
+            while (PaUtil_GetRingBufferReadAvailable(&fifo->pa_output_ring_buf) >= (ring_buffer_size_t)dev.frames)
+                Pa_Sleep(10);
+            Pa_Sleep(dev.stall);
+        }
+        size_t n = (clip.size() - written < chunk) ? clip.size() - written : chunk;
+        while (PaUtil_GetRingBufferWriteAvailable(&fifo->pa_output_ring_buf) < (ring_buffer_size_t)n)
+            Pa_Sleep(10);
+        pthread_mutex_lock(&out_ring_mutex);
+        PaUtil_WriteRingBuffer(&fifo->pa_output_ring_buf, &clip[written], n);
+        pthread_mutex_unlock(&out_ring_mutex);
+        written += n;
+    }
+    output_playing = false;
+    while (PaUtil_GetRingBufferReadAvailable(&fifo->pa_output_ring_buf) >= (ring_buffer_size_t)dev.frames)
+        Pa_Sleep(10);
+    dev.capture = 0;
+
+    while (first < dev.output.size() && dev.output[first] == 0)
+        first++;
+    for (i = first; i < dev.output.size(); i++)
+    {
+        if (dev.output[i] != 0)
+            played++;
+    }
+
+    printf("{\"scenario\":\"playback\",\"clip_samples\":%zu,\"played_samples\":%zu,\"underflows\":%lu,"
+            "\"start_latency_ms\":%.3f,\"sim_ms\":%.3f,\"wall_ms\":%.3f}\n",
+            clip.size(), played,
+            audio_stats.output_underflows.load() - underflows, frames_ms(first),
+            frames_ms(dev.clock - clock), wall_ms(start));
+
+    is_in = REAL_TIME_INPUT;
+}
+
+static void reload_write(const char *path, const char *text)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
+        return;
+    fputs(text, fp);
+    fclose(fp);
+}
+
+/* Waits up to a second in wall time, the watcher and the config writer are not on the device clock */
+static int reload_until(std::atomic<alexa_settings_t *> *settings, Config *cfg)
+{
+    int i;
+
+    for (i = 0; i < 100; i++)
+    {
+        if (settings != NULL ? settings->load() != NULL : !ConfigIsDirty(cfg))
+            return 1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+/*
+ * alexa.conf edited while the app runs, then a token refresh saved by the
+ * config writer, then the reload the writer's own save triggers. The edit
+ * has to survive in the file and in the settings handed to the main thread.
+ */
+static void scenario_reload(void)
+{
+    char dir[] = "/tmp/fake_driver.XXXXXX", conf[64], sensitivity[16] = "", token[16] = "";
+    alexa_settings_t *settings = NULL;
+    Config *cfg = NULL, *saved = NULL;
+    uint64_t start = stats_now();
+    int reloaded, written;
+
+    if (mkdtemp(dir) == NULL)
+        return;
+    snprintf(conf, sizeof(conf), "%s/alexa.conf", dir);
+    reload_write(conf, "[alexa]\nsensitivity = 0.5\naccess_token = old\ncreated_time = 1\nexpired_in = 3600\n");
+    if (ConfigReadFile(conf, &cfg) != CONFIG_OK || ConfigPersistStart(cfg, conf, CONFIG_SAVE_DELAY) != CONFIG_OK)
+        goto __RELOAD_FREE;
+
+    strcpy(cli_settings.sensitivity, "0.5");
+    cli_settings.audio_gain = 1;
+    cli_settings.recording_time = RECORDING_TIME;
+    settings_read(cfg, &cli_settings, &watch_settings);
+    watch_config = cfg;
+    if (watch_start(conf, settings_reload, conf))
+        goto __RELOAD_FREE;
+    usleep(WATCH_SETTLE * 1000);
+
+    reload_write(conf, "[alexa]\nsensitivity = 0.6\naccess_token = old\ncreated_time = 1\nexpired_in = 3600\n");
+    reloaded = reload_until(&pending_settings, NULL);
+    settings_free(pending_settings.exchange(NULL));
+
+    /* as token_refresh_apply() saves a new token */
+    ConfigAddString(cfg, ALEXA_SECTION, ALEXA_ACCESS_TOKEN, "new");
+    ConfigAddUnsignedInt(cfg, ALEXA_SECTION, ALEXA_CREATED_TIME, 2);
+    written = reload_until(NULL, cfg);
+    usleep(WATCH_SETTLE * 3000);
+    watch_stop();
+
+    if (ConfigReadFile(conf, &saved) == CONFIG_OK)
+    {
+        ConfigReadString(saved, ALEXA_SECTION, ALEXA_SENSITIVITY, sensitivity, sizeof(sensitivity), "");
+        ConfigReadString(saved, ALEXA_SECTION, ALEXA_ACCESS_TOKEN, token, sizeof(token), "");
+    }
+    settings = pending_settings.exchange(NULL);
+
+    printf("{\"scenario\":\"reload\",\"edit_reloaded\":%s,\"token_written\":%s,\"file_sensitivity\":\"%s\",\"file_token\":\"%s\","
+            "\"reverted\":%s,\"wall_ms\":%.3f}\n",
+            reloaded ? "true" : "false", written ? "true" : "false", sensitivity, token,
+            (settings != NULL && strcmp(settings->sensitivity, "0.6")) ? "true" : "false", wall_ms(start));
+
+__RELOAD_FREE:
+    watch_config = NULL;
+    settings_free(settings);
+    ConfigFree(saved);
+    ConfigFree(cfg);
+    unlink(conf);
+    rmdir(dir);
+}
+
+static int load_input(const char *filename)
+{
+    size_t i;
+
+    if (filename == NULL)
+    {
+        /* One second of a 440 Hz tone */
+        dev.input_len = ALEXA_SAMPLE_RATE;
+        dev.input = (int16_t *)malloc(dev.input_len * sizeof(int16_t));
+        for (i = 0; i < dev.input_len; i++)
+            dev.input[i] = (int16_t)(8000 * sin(2 * M_PI * 440 * i / ALEXA_SAMPLE_RATE));
+        return 0;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    size_t size;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Open file %s failed\n", filename);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (wav_file_read(fp, &size) || size < BYTES_PER_SAMPLE)
+    {
+        fclose(fp);
+        return 1;
+    }
+    dev.input_len = size / BYTES_PER_SAMPLE;
+    dev.input = (int16_t *)malloc(dev.input_len * sizeof(int16_t));
+    dev.input_len = fread(dev.input, BYTES_PER_SAMPLE, dev.input_len, fp);
+    fclose(fp);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    printf("Drives the audio pipeline from a simulated PortAudio device.\n");
+    printf("Usage:\n %s [options..]\n", name);
+    printf("Options:\n");
+    printf("-i | --input <wav_file>      16 kHz mono input, looped (default: 440 Hz tone).\n");
+    printf("-f | --frames <count>        Frames per callback (default: 256).\n");
+    printf("-j | --jitter <count>        Random +/- frames per callback (default: 0).\n");
+    printf("-F | --flags <mask>          statusFlags to inject, e.g. 0x2 for paInputOverflow.\n");
+    printf("-e | --flags-every <count>   Inject the flags on every n-th callback (default: 100).\n");
+    printf("-x | --speed <factor>        Device clock speed-up, 0 runs unpaced (default: 20).\n");
+    printf("-r | --scenario <name>       detect, record, playback, reload or all (default: all).\n");
+    printf("-d | --duration <seconds>    Length of the detect and playback scenarios (default: 10).\n");
+    printf("-s | --stall <ms>            Let the output ring run dry halfway through playback, for that long (default: 0).\n");
+    printf("-S | --stats                 Print audio statistics at the end.\n");
+    printf("-h | --help                  Display usage instructions.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    PaStream *pa_stream = NULL;
+    ring_buf_t fifo;
+    const char *input = NULL, *scenario = "all";
+    double duration = 10;
+    uint8_t print_stats = 0;
+    int i;
+
+    dev.frames = 256;
+    dev.flags_every = 100;
+    dev.speed = 20;
+
+    for (i = 1; i < argc; i++)
+    {
+        if ((!strcmp(argv[i], "-i") || !strcmp(argv[i], "--input")) && i + 1 < argc)
+            input = argv[++i];
+        else if ((!strcmp(argv[i], "-f") || !strcmp(argv[i], "--frames")) && i + 1 < argc)
+            dev.frames = strtoul(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jitter")) && i + 1 < argc)
+            dev.jitter = strtoul(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-F") || !strcmp(argv[i], "--flags")) && i + 1 < argc)
+            dev.flags = strtoul(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-e") || !strcmp(argv[i], "--flags-every")) && i + 1 < argc)
+            dev.flags_every = strtoul(argv[++i], NULL, 0);
+        else if ((!strcmp(argv[i], "-x") || !strcmp(argv[i], "--speed")) && i + 1 < argc)
+            dev.speed = atof(argv[++i]);
+        else if ((!strcmp(argv[i], "-r") || !strcmp(argv[i], "--scenario")) && i + 1 < argc)
+            scenario = argv[++i];
+        else if ((!strcmp(argv[i], "-d") || !strcmp(argv[i], "--duration")) && i + 1 < argc)
+            duration = atof(argv[++i]);
+        else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stall")) && i + 1 < argc)
+            dev.stall = strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-S") || !strcmp(argv[i], "--stats"))
+            print_stats = 1;
+        else
+        {
+            usage(argv[0]);
+            return strcmp(argv[i], "-h") && strcmp(argv[i], "--help") ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+    }
+
+    if (dev.frames < 1 || dev.frames > FAKE_MAX_FRAMES || dev.jitter >= dev.frames)
+    {
+        fprintf(stderr, "Frames must be within 1..%d and larger than the jitter\n", FAKE_MAX_FRAMES);
+        return EXIT_FAILURE;
+    }
+    if (load_input(input))
+        return EXIT_FAILURE;
+
+    pthread_mutex_init(&in_ring_mutex, NULL);
+    pthread_mutex_init(&out_ring_mutex, NULL);
+    stats_init();
+
+    is_in = REAL_TIME_INPUT;
+    if (stream_init(&pa_stream, &fifo))
+        return EXIT_FAILURE;
+
+    if (!strcmp(scenario, "detect") || !strcmp(scenario, "all"))
+        scenario_detect(&fifo, duration);
+    if (!strcmp(scenario, "record") || !strcmp(scenario, "all"))
+        scenario_record(&fifo);
+    if (!strcmp(scenario, "playback") || !strcmp(scenario, "all"))
+        scenario_playback(&fifo, duration);
+    if (!strcmp(scenario, "reload") || !strcmp(scenario, "all"))
+        scenario_reload();
+
+    stream_close(pa_stream, &fifo);
+    if (print_stats)
+        stats_print(stderr);
+
+    pthread_mutex_destroy(&in_ring_mutex);
+    pthread_mutex_destroy(&out_ring_mutex);
+    free(dev.input);
+    return EXIT_SUCCESS;
+}
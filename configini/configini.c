@@ -31,8 +31,16 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "configini.h"
 #include "queue.h"
@@ -45,6 +53,71 @@
 
 #define CONFIG_INIT_MAGIC    0x12F0ED1
 
+#define HASH_INIT_SIZE       16     /* slots of a new index, always a power of two */
+
+#define ARENA_CHUNK_MIN      4096   /* first chunk, each next one doubles up to ARENA_CHUNK_MAX */
+#define ARENA_CHUNK_MAX      (1024 * 1024)
+#define ARENA_ALIGN          sizeof(void *)
+
+#define IS_COMMENT(cfg, c)   ((cfg)->comment_map[(unsigned char)(c)])
+
+#define SNAP_MAGIC           0x53474643     /* "CFGS" on little endian hosts, another byte order is rebuilt */
+#define SNAP_VERSION         1
+#define SNAP_NO_NAME         0xFFFFFFFFu    /* name of the flat section */
+
+#ifdef __APPLE__
+#define ST_MTIME_NSEC(st)    ((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st)    ((st)->st_mtim.tv_nsec)
+#endif
+
+/* tables of a snapshot, in the order they follow the header */
+#define SNAP_SECTS(s)        ((ConfigSnapSection *)((s) + 1))
+#define SNAP_KVS(s)          ((ConfigSnapKeyValue *)(SNAP_SECTS(s) + (s)->numofsect))
+#define SNAP_SECT_INDEX(s)   ((uint32_t *)(SNAP_KVS(s) + (s)->numofkv))
+#define SNAP_KV_INDEX(s)     (SNAP_SECT_INDEX(s) + (s)->sect_slots)
+#define SNAP_STRINGS(s)      ((char *)(SNAP_KV_INDEX(s) + (s)->kv_slots))
+
+
+/**
+ * \brief Arena chunk, its data follows the header
+ */
+typedef struct ConfigArenaChunk
+{
+	struct ConfigArenaChunk *next;
+	size_t size;
+	size_t used;
+} ConfigArenaChunk;
+
+/**
+ * \brief Bump allocator owning every node, string and index of a config.
+ *        Nothing is freed on its own, ConfigFree() releases the chunks.
+ */
+typedef struct ConfigArena
+{
+	ConfigArenaChunk *chunks;   /* current chunk first */
+	size_t next_size;
+} ConfigArena;
+
+/**
+ * \brief Hash index slot, node is NULL when the slot is empty
+ */
+typedef struct ConfigHashSlot
+{
+	unsigned int hash;
+	void *node;
+} ConfigHashSlot;
+
+/**
+ * \brief Open-addressing (linear probing) index over sections or keys.
+ *        The TAILQs keep the file order, the index only speeds up lookups.
+ */
+typedef struct ConfigHash
+{
+	ConfigHashSlot *slots;
+	unsigned int size;
+	unsigned int count;
+} ConfigHash;
 
 /**
  * \brief Configuration key-value
@@ -53,6 +126,7 @@ typedef struct ConfigKeyValue
 {
 	char *key;
 	char *value;
+	size_t value_size;         /* bytes usable at value, reused when a new value fits */
 	TAILQ_ENTRY(ConfigKeyValue) next;
 } ConfigKeyValue;
 
@@ -63,27 +137,110 @@ typedef struct ConfigSection
 {
 	char *name;
 	int numofkv;
+	ConfigHash kv_hash;
 	TAILQ_HEAD(, ConfigKeyValue) kv_list;
 	TAILQ_ENTRY(ConfigSection) next;
 } ConfigSection;
 
+/**
+ * \brief Loaded file image, owned by the config handle
+ */
+typedef struct ConfigImage
+{
+	char *data;
+	size_t mapped;             /* mapped length, 0 when data was malloc'ed */
+	struct ConfigImage *next;
+} ConfigImage;
+
+/**
+ * \brief Binary snapshot header, see ConfigReadFileCached(). The section table,
+ *        the key table, the section index, the key indexes and the string pool
+ *        follow it. Strings are referred to by their offset in the pool and the
+ *        indexes hold table entry + 1, 0 marks an empty slot.
+ */
+typedef struct ConfigSnapHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;             /* whole snapshot, header included */
+	uint32_t checksum;         /* SnapChecksum() of everything after the header */
+	uint64_t src_size;         /* stat of the text file it was compiled from */
+	uint64_t src_ino;
+	int64_t  src_mtime;
+	int64_t  src_mtime_nsec;
+	uint32_t src_hash;         /* MemHash() of the text */
+	uint32_t numofsect;
+	uint32_t numofkv;
+	uint32_t sect_slots;       /* section index size, a power of two */
+	uint32_t kv_slots;         /* sum of the key index sizes */
+	uint32_t strings;          /* string pool size */
+} ConfigSnapHeader;
+
+/**
+ * \brief Snapshot section, its keys are the numofkv entries from first_kv on
+ */
+typedef struct ConfigSnapSection
+{
+	uint32_t name;             /* SNAP_NO_NAME for the flat section */
+	uint32_t hash;
+	uint32_t first_kv;
+	uint32_t numofkv;
+	uint32_t kv_index;         /* first slot of its key index */
+	uint32_t kv_slots;         /* key index size, a power of two or 0 */
+} ConfigSnapSection;
+
+/**
+ * \brief Snapshot key-value
+ */
+typedef struct ConfigSnapKeyValue
+{
+	uint32_t key;
+	uint32_t value;
+	uint32_t hash;
+} ConfigSnapKeyValue;
+
 /**
  * \brief Configuration handle
  */
 struct Config
 {
 	char *comment_chars;
+	char comment_map[256];     /* non-zero for each of comment_chars */
 	char keyval_sep;
 	char *true_str;
 	char *false_str;
 	int  initnum;
 	int  numofsect;
+	ConfigHash sect_hash;
 	TAILQ_HEAD(, ConfigSection) sect_list;
+	ConfigImage *images;
+	ConfigArena arena;
+	ConfigSnapHeader *snap;    /* answers reads until the first change, see ConfigThaw() */
+
+	/* mutations and the write-behind persister, see ConfigPersistStart() */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long changes;     /* bumped by every mutation */
+	unsigned long saved;       /* value of changes last written out */
+	pthread_t writer;
+	char *persist_file;
+	int persist_delay;         /* mili-seconds to coalesce a burst of updates */
+	bool persisting;
+	bool persist_stop;
+	ConfigRet persist_ret;     /* result of the last background write */
 };
 
 
 
 
+static void ImageFree(char *data, size_t mapped)
+{
+	if (mapped)
+		munmap(data, mapped);
+	else
+		free(data);
+}
+
 static int StrSafeCopy(char *dst, const char *src, int size)
 {
 	char *d = dst;
@@ -107,6 +264,204 @@ static int StrSafeCopy(char *dst, const char *src, int size)
 	return (s - src - 1);
 }
 
+/* FNV-1a, NULL (the flat section) hashes like "" */
+static unsigned int StrHash(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	if (s) {
+		while (*s) {
+			h ^= (unsigned char)*s++;
+			h *= 16777619u;
+		}
+	}
+
+	return h;
+}
+
+/* FNV-1a over a buffer, tells whether the text behind a snapshot changed */
+static uint32_t MemHash(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint32_t h = 2166136261u;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* checksum of a snapshot, FNV-1a style over 64-bit words so it keeps up with the mapping */
+static uint32_t SnapChecksum(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint64_t h = 14695981039346656037ull;
+	uint64_t w;
+
+	for ( ; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h ^= w;
+		h *= 1099511628211ull;
+	}
+	while (len--) {
+		h ^= *p++;
+		h *= 1099511628211ull;
+	}
+
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+static void *ArenaAlloc(ConfigArena *a, size_t size)
+{
+	ConfigArenaChunk *c = a->chunks;
+	size_t            hdr = (sizeof(ConfigArenaChunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	size_t            csize;
+	void             *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (!c || (c->size - c->used < size)) {
+		if (!a->next_size)
+			a->next_size = ARENA_CHUNK_MIN;
+		csize = (size > a->next_size) ? size : a->next_size;
+		if ((c = (ConfigArenaChunk *)malloc(hdr + csize)) == NULL)
+			return NULL;
+		c->size = csize;
+		c->used = 0;
+
+		/* an oversized block does not retire the current chunk */
+		if (size > a->next_size && a->chunks) {
+			c->next = a->chunks->next;
+			a->chunks->next = c;
+		}
+		else {
+			c->next = a->chunks;
+			a->chunks = c;
+			if (a->next_size < ARENA_CHUNK_MAX)
+				a->next_size *= 2;
+		}
+	}
+
+	p = (char *)c + hdr + c->used;
+	c->used += size;
+
+	return p;
+}
+
+static void *ArenaCalloc(ConfigArena *a, size_t size)
+{
+	void *p;
+
+	if ((p = ArenaAlloc(a, size)) != NULL)
+		memset(p, 0, size);
+
+	return p;
+}
+
+static char *ArenaStrndup(ConfigArena *a, const char *s, size_t len)
+{
+	char *p;
+
+	if ((p = (char *)ArenaAlloc(a, len + 1)) != NULL) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+
+	return p;
+}
+
+static void ArenaFree(ConfigArena *a)
+{
+	ConfigArenaChunk *c;
+
+	while ((c = a->chunks) != NULL) {
+		a->chunks = c->next;
+		free(c);
+	}
+	a->next_size = 0;
+}
+
+/* the old slots stay in the arena, growth doubles so that wastes less than the table */
+static ConfigRet HashGrow(ConfigArena *a, ConfigHash *h)
+{
+	ConfigHashSlot *slots;
+	unsigned int    size = h->size ? h->size * 2 : HASH_INIT_SIZE;
+	unsigned int    i, j;
+
+	if ((slots = (ConfigHashSlot *)ArenaCalloc(a, size * sizeof(ConfigHashSlot))) == NULL)
+		return CONFIG_ERR_MEMALLOC;
+
+	for (i = 0; i < h->size; ++i) {
+		if (!h->slots[i].node)
+			continue;
+		for (j = h->slots[i].hash & (size - 1); slots[j].node; j = (j + 1) & (size - 1))
+			;
+		slots[j] = h->slots[i];
+	}
+
+	h->slots = slots;
+	h->size = size;
+
+	return CONFIG_OK;
+}
+
+/* node must not be in the index yet, the load factor is kept under 1/2 */
+static ConfigRet HashInsert(ConfigArena *a, ConfigHash *h, unsigned int hash, void *node)
+{
+	unsigned int i;
+
+	if ((h->count + 1) * 2 > h->size && HashGrow(a, h) != CONFIG_OK)
+		return CONFIG_ERR_MEMALLOC;
+
+	for (i = hash & (h->size - 1); h->slots[i].node; i = (i + 1) & (h->size - 1))
+		;
+	h->slots[i].hash = hash;
+	h->slots[i].node = node;
+	++(h->count);
+
+	return CONFIG_OK;
+}
+
+/* backward shift deletion, so lookups never need tombstones */
+static void HashRemove(ConfigHash *h, unsigned int hash, const void *node)
+{
+	unsigned int mask = h->size - 1;
+	unsigned int i, j, k;
+
+	if (!h->size)
+		return;
+
+	for (i = hash & mask; h->slots[i].node != node; i = (i + 1) & mask) {
+		if (!h->slots[i].node)
+			return;
+	}
+
+	for (j = i; ; ) {
+		j = (j + 1) & mask;
+		if (!h->slots[j].node)
+			break;
+		k = h->slots[j].hash & mask;
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		h->slots[i] = h->slots[j];
+		i = j;
+	}
+
+	h->slots[i].node = NULL;
+	--(h->count);
+}
+
+static void SetCommentMap(Config *cfg)
+{
+	const char *p;
+
+	memset(cfg->comment_map, 0, sizeof(cfg->comment_map));
+	for (p = cfg->comment_chars; p && *p; ++p)
+		cfg->comment_map[(unsigned char)*p] = 1;
+}
+
 static bool StrIsTypeOfTrue(const char *s)
 {
 	if ( !strcasecmp(s, "true") || !strcasecmp(s, "yes") || !strcasecmp(s, "1") )
@@ -163,6 +518,7 @@ ConfigRet ConfigSetCommentCharset(Config *cfg, const char *comment_ch)
 	if (cfg->comment_chars)
 		free(cfg->comment_chars);
 	cfg->comment_chars = p;
+	SetCommentMap(cfg);
 
 	return CONFIG_OK;
 }
@@ -239,19 +595,93 @@ ConfigRet ConfigSetBoolString(Config *cfg, const char *true_str, const char *fal
  */
 static ConfigRet ConfigGetSection(const Config *cfg, const char *section, ConfigSection **sect)
 {
+	const ConfigHash *h;
+	unsigned int      hash, mask, i;
+
 	if (!cfg || !sect)
 		return CONFIG_ERR_INVALID_PARAM;
 
-	TAILQ_FOREACH(*sect, &cfg->sect_list, next) {
+	*sect = NULL;
+	h = &cfg->sect_hash;
+	if (!h->size)
+		return CONFIG_ERR_NO_SECTION;
+
+	hash = StrHash(section);
+	mask = h->size - 1;
+	for (i = hash & mask; h->slots[i].node; i = (i + 1) & mask) {
+		if (h->slots[i].hash != hash)
+			continue;
+		*sect = (ConfigSection *)h->slots[i].node;
 		if ( (section && (*sect)->name && !strcmp((*sect)->name, section)) ||
 			 (!section && !(*sect)->name) ) {
 			return CONFIG_OK;
 		}
 	}
 
+	*sect = NULL;
 	return CONFIG_ERR_NO_SECTION;
 }
 
+/**
+ * \brief              SnapGetSection() gets the requested section of a snapshot
+ *
+ * \param snap         snapshot to search in
+ * \param section      section name to search for
+ *
+ * \return             Returns the section, NULL if it does not exist.
+ */
+static const ConfigSnapSection *SnapGetSection(const ConfigSnapHeader *snap, const char *section)
+{
+	const ConfigSnapSection *sect;
+	const uint32_t          *index   = SNAP_SECT_INDEX(snap);
+	const char              *strings = SNAP_STRINGS(snap);
+	unsigned int             hash, mask, i;
+
+	hash = StrHash(section);
+	mask = snap->sect_slots - 1;
+	for (i = hash & mask; index[i]; i = (i + 1) & mask) {
+		sect = &SNAP_SECTS(snap)[index[i] - 1];
+		if (sect->hash != hash)
+			continue;
+		if ( (section && (sect->name != SNAP_NO_NAME) && !strcmp(strings + sect->name, section)) ||
+			 (!section && (sect->name == SNAP_NO_NAME)) ) {
+			return sect;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * \brief              SnapGetValue() gets the value of a key in a snapshot section
+ *
+ * \param snap         snapshot to search in
+ * \param sect         section of the snapshot
+ * \param key          key to search for
+ *
+ * \return             Returns the value, NULL if the key does not exist.
+ */
+static const char *SnapGetValue(const ConfigSnapHeader *snap, const ConfigSnapSection *sect, const char *key)
+{
+	const ConfigSnapKeyValue *kv;
+	const uint32_t           *index   = SNAP_KV_INDEX(snap) + sect->kv_index;
+	const char               *strings = SNAP_STRINGS(snap);
+	unsigned int              hash, mask, i;
+
+	if (!sect->kv_slots)
+		return NULL;
+
+	hash = StrHash(key);
+	mask = sect->kv_slots - 1;
+	for (i = hash & mask; index[i]; i = (i + 1) & mask) {
+		kv = &SNAP_KVS(snap)[index[i] - 1];
+		if ((kv->hash == hash) && !strcmp(strings + kv->key, key))
+			return strings + kv->value;
+	}
+
+	return NULL;
+}
+
 /**
  * \brief              Checks whether section exists
  *
@@ -264,6 +694,9 @@ bool ConfigHasSection(const Config *cfg, const char *section)
 {
 	ConfigSection *sect = NULL;
 
+	if (cfg && cfg->snap)
+		return ( (SnapGetSection(cfg->snap, section) != NULL) ? true : false );
+
 	return ( (ConfigGetSection(cfg, section, &sect) == CONFIG_OK) ? true : false );
 }
 
@@ -279,17 +712,67 @@ bool ConfigHasSection(const Config *cfg, const char *section)
 static ConfigRet ConfigGetKeyValue(ConfigSection *sect, const char *key,
 		ConfigKeyValue **kv)
 {
+	const ConfigHash *h;
+	unsigned int      hash, mask, i;
+
 	if (!sect || !key || !kv)
 		return CONFIG_ERR_INVALID_PARAM;
 
-	TAILQ_FOREACH(*kv, &sect->kv_list, next) {
+	*kv = NULL;
+	h = &sect->kv_hash;
+	if (!h->size)
+		return CONFIG_ERR_NO_KEY;
+
+	hash = StrHash(key);
+	mask = h->size - 1;
+	for (i = hash & mask; h->slots[i].node; i = (i + 1) & mask) {
+		if (h->slots[i].hash != hash)
+			continue;
+		*kv = (ConfigKeyValue *)h->slots[i].node;
 		if (!strcmp((*kv)->key, key))
 			return CONFIG_OK;
 	}
 
+	*kv = NULL;
 	return CONFIG_ERR_NO_KEY;
 }
 
+/**
+ * \brief              ConfigLookup() gets the value of a key. A cfg loaded from a
+ *                     snapshot answers from it until its first change.
+ *
+ * \param cfg          config handle to search in
+ * \param section      section name to search for
+ * \param key          key to search for
+ * \param value        pointer to the value to save
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+static ConfigRet ConfigLookup(const Config *cfg, const char *section, const char *key,
+		const char **value)
+{
+	const ConfigSnapSection *snap_sect = NULL;
+	ConfigSection           *sect      = NULL;
+	ConfigKeyValue          *kv        = NULL;
+	ConfigRet                ret       = CONFIG_OK;
+
+	if (cfg->snap) {
+		if ((snap_sect = SnapGetSection(cfg->snap, section)) == NULL)
+			return CONFIG_ERR_NO_SECTION;
+		if ((*value = SnapGetValue(cfg->snap, snap_sect, key)) == NULL)
+			return CONFIG_ERR_NO_KEY;
+		return CONFIG_OK;
+	}
+
+	if ( ((ret = ConfigGetSection(cfg, section, &sect)) != CONFIG_OK) ||
+		 ((ret = ConfigGetKeyValue(sect, key, &kv)) != CONFIG_OK) ) {
+		return ret;
+	}
+
+	*value = kv->value;
+	return CONFIG_OK;
+}
+
 /**
  * \brief            ConfigGetSectionCount() gets number of sections
  *
@@ -302,6 +785,9 @@ int ConfigGetSectionCount(const Config *cfg)
 	if (!cfg)
 		return -1;
 
+	if (cfg->snap)
+		return (SNAP_SECTS(cfg->snap)->numofkv > 0 ? (int)cfg->snap->numofsect : (int)cfg->snap->numofsect - 1);
+
 	return (TAILQ_FIRST(&cfg->sect_list)->numofkv > 0 ? cfg->numofsect : cfg->numofsect - 1);
 }
 
@@ -315,11 +801,18 @@ int ConfigGetSectionCount(const Config *cfg)
  */
 int ConfigGetKeyCount(const Config *cfg, const char *section)
 {
-	ConfigSection *sect = NULL;
+	const ConfigSnapSection *snap_sect = NULL;
+	ConfigSection           *sect      = NULL;
 
 	if (!cfg)
 		return -1;
 
+	if (cfg->snap) {
+		if ((snap_sect = SnapGetSection(cfg->snap, section)) == NULL)
+			return -1;
+		return (int)snap_sect->numofkv;
+	}
+
 	if (ConfigGetSection(cfg, section, &sect) != CONFIG_OK)
 		return -1;
 
@@ -350,8 +843,7 @@ int ConfigGetKeyCount(const Config *cfg, const char *section)
 ConfigRet ConfigReadString(const Config *cfg, const char *section, const char *key,
 		char *value, int size, const char *dfl_value)
 {
-	ConfigSection  *sect = NULL;
-	ConfigKeyValue *kv   = NULL;
+	const char     *str  = NULL;
 	ConfigRet       ret  = CONFIG_OK;
 
 	if (!cfg || !key || !value || (size < 1))
@@ -359,14 +851,13 @@ ConfigRet ConfigReadString(const Config *cfg, const char *section, const char *k
 
 	*value = '\0';
 
-	if ( ((ret = ConfigGetSection(cfg, section, &sect)) != CONFIG_OK) ||
-		 ((ret = ConfigGetKeyValue(sect, key, &kv)) != CONFIG_OK) ) {
+	if ((ret = ConfigLookup(cfg, section, key, &str)) != CONFIG_OK) {
 		if (dfl_value)
 			StrSafeCopy(value, dfl_value, size);
 		return ret;
 	}
 
-	StrSafeCopy(value, kv->value, size);
+	StrSafeCopy(value, str, size);
 
 	return CONFIG_OK;
 }
@@ -388,8 +879,7 @@ ConfigRet ConfigReadString(const Config *cfg, const char *section, const char *k
 ConfigRet ConfigReadInt(const Config *cfg, const char *section, const char *key,
 		int *value, int dfl_value)
 {
-	ConfigSection  *sect = NULL;
-	ConfigKeyValue *kv   = NULL;
+	const char     *str  = NULL;
 	ConfigRet       ret  = CONFIG_OK;
 	char           *p    = NULL;
 
@@ -398,12 +888,11 @@ ConfigRet ConfigReadInt(const Config *cfg, const char *section, const char *key,
 
 	*value = dfl_value;
 
-	if ( ((ret = ConfigGetSection(cfg, section, &sect)) != CONFIG_OK) ||
-		 ((ret = ConfigGetKeyValue(sect, key, &kv)) != CONFIG_OK) ) {
+	if ((ret = ConfigLookup(cfg, section, key, &str)) != CONFIG_OK) {
 		return ret;
 	}
 
-	*value = (int) strtol(kv->value, &p, 10);
+	*value = (int) strtol(str, &p, 10);
 	if (*p || (errno == ERANGE))
 		return CONFIG_ERR_INVALID_VALUE;
 
@@ -427,8 +916,7 @@ ConfigRet ConfigReadInt(const Config *cfg, const char *section, const char *key,
 ConfigRet ConfigReadUnsignedInt(const Config *cfg, const char *section, const char *key,
 		unsigned int *value, unsigned int dfl_value)
 {
-	ConfigSection  *sect = NULL;
-	ConfigKeyValue *kv   = NULL;
+	const char     *str  = NULL;
 	ConfigRet       ret  = CONFIG_OK;
 	char           *p    = NULL;
 
@@ -437,12 +925,11 @@ ConfigRet ConfigReadUnsignedInt(const Config *cfg, const char *section, const ch
 
 	*value = dfl_value;
 
-	if ( ((ret = ConfigGetSection(cfg, section, &sect)) != CONFIG_OK) ||
-		 ((ret = ConfigGetKeyValue(sect, key, &kv)) != CONFIG_OK) ) {
+	if ((ret = ConfigLookup(cfg, section, key, &str)) != CONFIG_OK) {
 		return ret;
 	}
 
-	*value = (unsigned int) strtoul(kv->value, &p, 10);
+	*value = (unsigned int) strtoul(str, &p, 10);
 	if (*p || (errno == ERANGE))
 		return CONFIG_ERR_INVALID_VALUE;
 
@@ -466,8 +953,7 @@ ConfigRet ConfigReadUnsignedInt(const Config *cfg, const char *section, const ch
 ConfigRet ConfigReadFloat(const Config *cfg, const char *section, const char *key,
 		float *value, float dfl_value)
 {
-	ConfigSection  *sect = NULL;
-	ConfigKeyValue *kv   = NULL;
+	const char     *str  = NULL;
 	ConfigRet       ret  = CONFIG_OK;
 	char           *p    = NULL;
 
@@ -476,12 +962,11 @@ ConfigRet ConfigReadFloat(const Config *cfg, const char *section, const char *ke
 
 	*value = dfl_value;
 
-	if ( ((ret = ConfigGetSection(cfg, section, &sect)) != CONFIG_OK) ||
-		 ((ret = ConfigGetKeyValue(sect, key, &kv)) != CONFIG_OK) ) {
+	if ((ret = ConfigLookup(cfg, section, key, &str)) != CONFIG_OK) {
 		return ret;
 	}
 
-	*value = strtof(kv->value, &p);
+	*value = strtof(str, &p);
 	if (*p || (errno == ERANGE))
 		return CONFIG_ERR_INVALID_VALUE;
 
@@ -505,8 +990,7 @@ ConfigRet ConfigReadFloat(const Config *cfg, const char *section, const char *ke
 ConfigRet ConfigReadDouble(const Config *cfg, const char *section, const char *key,
 		double *value, double dfl_value)
 {
-	ConfigSection  *sect = NULL;
-	ConfigKeyValue *kv   = NULL;
+	const char     *str  = NULL;
 	ConfigRet       ret  = CONFIG_OK;
 	char           *p    = NULL;
 
@@ -515,12 +999,11 @@ ConfigRet ConfigReadDouble(const Config *cfg, const char *section, const char *k
 
 	*value = dfl_value;
 
-	if ( ((ret = ConfigGetSection(cfg, section, &sect)) != CONFIG_OK) ||
-		 ((ret = ConfigGetKeyValue(sect, key, &kv)) != CONFIG_OK) ) {
+	if ((ret = ConfigLookup(cfg, section, key, &str)) != CONFIG_OK) {
 		return ret;
 	}
 
-	*value = strtod(kv->value, &p);
+	*value = strtod(str, &p);
 	if (*p || (errno == ERANGE))
 		return CONFIG_ERR_INVALID_VALUE;
 
@@ -544,8 +1027,7 @@ ConfigRet ConfigReadDouble(const Config *cfg, const char *section, const char *k
 ConfigRet ConfigReadBool(const Config *cfg, const char *section, const char *key,
 		bool *value, bool dfl_value)
 {
-	ConfigSection  *sect = NULL;
-	ConfigKeyValue *kv   = NULL;
+	const char     *str  = NULL;
 	ConfigRet       ret  = CONFIG_OK;
 
 	if (!cfg || !key || !value)
@@ -553,14 +1035,13 @@ ConfigRet ConfigReadBool(const Config *cfg, const char *section, const char *key
 
 	*value = dfl_value;
 
-	if ( ((ret = ConfigGetSection(cfg, section, &sect)) != CONFIG_OK) ||
-		 ((ret = ConfigGetKeyValue(sect, key, &kv)) != CONFIG_OK) ) {
+	if ((ret = ConfigLookup(cfg, section, key, &str)) != CONFIG_OK) {
 		return ret;
 	}
 
-	if (StrIsTypeOfTrue(kv->value))
+	if (StrIsTypeOfTrue(str))
 		*value = true;
-	else if (StrIsTypeOfFalse(kv->value))
+	else if (StrIsTypeOfFalse(str))
 		*value = false;
 	else
 		return CONFIG_ERR_INVALID_VALUE;
@@ -597,17 +1078,18 @@ static ConfigRet ConfigAddSection(Config *cfg, const char *section, ConfigSectio
 	if ((ret = ConfigGetSection(cfg, section, sect)) != CONFIG_ERR_NO_SECTION)
 		return ret;
 
-	*sect = (ConfigSection *)calloc(1, sizeof(ConfigSection));
+	*sect = (ConfigSection *)ArenaCalloc(&cfg->arena, sizeof(ConfigSection));
 	if (*sect == NULL)
 		return CONFIG_ERR_MEMALLOC;
 
 	if (section) {
-		if (((*sect)->name = strdup(section)) == NULL) {
-			free(*sect);
+		if (((*sect)->name = ArenaStrndup(&cfg->arena, section, strlen(section))) == NULL)
 			return CONFIG_ERR_MEMALLOC;
-		}
 	}
 
+	if (HashInsert(&cfg->arena, &cfg->sect_hash, StrHash(section), *sect) != CONFIG_OK)
+		return CONFIG_ERR_MEMALLOC;
+
 	TAILQ_INIT(&(*sect)->kv_list);
 	TAILQ_INSERT_TAIL(&cfg->sect_list, *sect, next);
 	++(cfg->numofsect);
@@ -615,17 +1097,67 @@ static ConfigRet ConfigAddSection(Config *cfg, const char *section, ConfigSectio
 	return CONFIG_OK;
 }
 
+static ConfigRet ConfigBorrowKeyValue(Config *cfg, ConfigSection *sect, char *key, char *value);
+
 /**
- * \brief              ConfigAddString() adds the key with string value to the cfg
+ * \brief              ConfigThaw() turns a cfg loaded from a snapshot into nodes before
+ *                     its first change. Keys and values keep pointing into the mapped
+ *                     snapshot. Caller holds cfg->lock.
  *
  * \param cfg          config handle
- * \param section      section to add in
- * \param key          key to save as
- * \param value        value to save as
  *
  * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
  */
-ConfigRet ConfigAddString(Config *cfg, const char *section, const char *key, const char *value)
+static ConfigRet ConfigThaw(Config *cfg)
+{
+	ConfigSnapHeader   *snap = cfg->snap;
+	ConfigSnapSection  *snap_sect;
+	ConfigSnapKeyValue *snap_kv;
+	ConfigSection      *sect = NULL;
+	char               *strings;
+	uint32_t            i, j;
+	ConfigRet           ret  = CONFIG_OK;
+
+	if (snap == NULL)
+		return CONFIG_OK;
+
+	/* a failed thaw can be retried, sections and keys already added are found again */
+	strings = SNAP_STRINGS(snap);
+	for (i = 0; i < snap->numofsect; i++) {
+		snap_sect = &SNAP_SECTS(snap)[i];
+		ret = ConfigAddSection(cfg, (snap_sect->name == SNAP_NO_NAME) ? NULL : strings + snap_sect->name, &sect);
+		if (ret != CONFIG_OK)
+			return ret;
+
+		for (j = snap_sect->first_kv; j < snap_sect->first_kv + snap_sect->numofkv; j++) {
+			snap_kv = &SNAP_KVS(snap)[j];
+			if ((ret = ConfigBorrowKeyValue(cfg, sect, strings + snap_kv->key, strings + snap_kv->value)) != CONFIG_OK)
+				return ret;
+		}
+	}
+
+	cfg->snap = NULL;
+	return CONFIG_OK;
+}
+
+/* for readers walking the nodes, the content does not change */
+static ConfigRet ConfigThawLocked(const Config *cfg)
+{
+	Config    *_cfg = (Config *)cfg;
+	ConfigRet  ret  = CONFIG_OK;
+
+	if (cfg->snap == NULL)
+		return CONFIG_OK;
+
+	pthread_mutex_lock(&_cfg->lock);
+	ret = ConfigThaw(_cfg);
+	pthread_mutex_unlock(&_cfg->lock);
+
+	return ret;
+}
+
+/* adds or updates the key, caller holds cfg->lock */
+static ConfigRet _ConfigAddString(Config *cfg, const char *section, const char *key, const char *value)
 {
 	ConfigSection  *sect = NULL;
 	ConfigKeyValue *kv   = NULL;
@@ -636,55 +1168,65 @@ ConfigRet ConfigAddString(Config *cfg, const char *section, const char *key, con
 	if (!cfg || !key || !value)
 		return CONFIG_ERR_INVALID_PARAM;
 
+	if ((ret = ConfigThaw(cfg)) != CONFIG_OK)
+		return ret;
+
 	if ((ret = ConfigAddSection(cfg, section, &sect)) != CONFIG_OK)
 		return ret;
 
+	for (p = value; *p && isspace(*p); ++p)
+		;
+	for (q = p; *q && (*q != '\r') && (*q != '\n') && !IS_COMMENT(cfg, *q); ++q)
+		;
+	while (*q && (q > p) && isspace(*(q - 1)))
+		--q;
+
 	switch (ret = ConfigGetKeyValue(sect, key, &kv)) {
 		case CONFIG_OK:
-			if (kv->value) {
-				free(kv->value);
-				kv->value = NULL;
+			/* token refreshes rewrite values of the same length in place */
+			if ((size_t)(q - p) < kv->value_size) {
+				memmove(kv->value, p, q - p);
+				kv->value[q - p] = '\0';
+				return CONFIG_OK;
 			}
 			break;
 
 		case CONFIG_ERR_NO_KEY:
-			if ((kv = (ConfigKeyValue *)calloc(1, sizeof(ConfigKeyValue))) == NULL)
+			if ((kv = (ConfigKeyValue *)ArenaCalloc(&cfg->arena, sizeof(ConfigKeyValue))) == NULL)
 				return CONFIG_ERR_MEMALLOC;
-			if ((kv->key = strdup(key)) == NULL) {
-				free(kv);
+			if ((kv->key = ArenaStrndup(&cfg->arena, key, strlen(key))) == NULL)
 				return CONFIG_ERR_MEMALLOC;
-			}
-			TAILQ_INSERT_TAIL(&sect->kv_list, kv, next);
-			++(sect->numofkv);
 			break;
 
 		default:
 			return ret;
 	}
 
-	for (p = value; *p && isspace(*p); ++p)
-		;
-	for (q = p; *q && (*q != '\r') && (*q != '\n') && !strchr(cfg->comment_chars, *q); ++q)
-		;
-	while (*q && (q > p) && isspace(*(q - 1)))
-		--q;
-
-	kv->value = (char *) malloc(q - p + 1);
-	if (kv->value == NULL) {
-		TAILQ_REMOVE(&sect->kv_list, kv, next);
-		--(sect->numofkv);
-		free(kv->key);
-		free(kv);
+	/* an old value too short for the new one stays in the arena until ConfigFree() */
+	if ((kv->value = ArenaStrndup(&cfg->arena, p, q - p)) == NULL)
 		return CONFIG_ERR_MEMALLOC;
+	kv->value_size = q - p + 1;
+
+	if (ret == CONFIG_ERR_NO_KEY) {
+		if (HashInsert(&cfg->arena, &sect->kv_hash, StrHash(kv->key), kv) != CONFIG_OK)
+			return CONFIG_ERR_MEMALLOC;
+		TAILQ_INSERT_TAIL(&sect->kv_list, kv, next);
+		++(sect->numofkv);
 	}
-	memcpy(kv->value, p, q - p);
-	kv->value[q - p] = '\0';
 
 	return CONFIG_OK;
 }
 
+/* caller holds cfg->lock */
+static void ConfigTouch(Config *cfg)
+{
+	++(cfg->changes);
+	if (cfg->persisting)
+		pthread_cond_signal(&cfg->cond);
+}
+
 /**
- * \brief              ConfigAddInt() adds the key with integer value to the cfg
+ * \brief              ConfigAddString() adds the key with string value to the cfg
  *
  * \param cfg          config handle
  * \param section      section to add in
@@ -693,11 +1235,77 @@ ConfigRet ConfigAddString(Config *cfg, const char *section, const char *key, con
  *
  * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
  */
-ConfigRet ConfigAddInt(Config *cfg, const char *section, const char *key, int value)
+ConfigRet ConfigAddString(Config *cfg, const char *section, const char *key, const char *value)
 {
-	char buf[64];
+	ConfigRet ret = CONFIG_OK;
 
-	snprintf(buf, sizeof(buf), "%d", value);
+	if (!cfg || !key || !value)
+		return CONFIG_ERR_INVALID_PARAM;
+
+	pthread_mutex_lock(&cfg->lock);
+	if ((ret = _ConfigAddString(cfg, section, key, value)) == CONFIG_OK)
+		ConfigTouch(cfg);
+	pthread_mutex_unlock(&cfg->lock);
+
+	return ret;
+}
+
+/**
+ * \brief              ConfigBorrowKeyValue() adds the key and value parsed from an image
+ *                     without copying them. Both are already trimmed and terminated.
+ *
+ * \param cfg          config handle
+ * \param sect         section to add in
+ * \param key          key inside an image attached to the cfg
+ * \param value        value inside an image attached to the cfg
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+static ConfigRet ConfigBorrowKeyValue(Config *cfg, ConfigSection *sect, char *key, char *value)
+{
+	ConfigKeyValue *kv  = NULL;
+	ConfigRet       ret = CONFIG_OK;
+
+	switch (ret = ConfigGetKeyValue(sect, key, &kv)) {
+		case CONFIG_OK:
+			break;
+
+		case CONFIG_ERR_NO_KEY:
+			if ((kv = (ConfigKeyValue *)ArenaCalloc(&cfg->arena, sizeof(ConfigKeyValue))) == NULL)
+				return CONFIG_ERR_MEMALLOC;
+			if (HashInsert(&cfg->arena, &sect->kv_hash, StrHash(key), kv) != CONFIG_OK)
+				return CONFIG_ERR_MEMALLOC;
+			kv->key = key;
+			TAILQ_INSERT_TAIL(&sect->kv_list, kv, next);
+			++(sect->numofkv);
+			break;
+
+		default:
+			return ret;
+	}
+
+	/* images are private and writable, so the slot can be updated in place too */
+	kv->value = value;
+	kv->value_size = strlen(value) + 1;
+
+	return CONFIG_OK;
+}
+
+/**
+ * \brief              ConfigAddInt() adds the key with integer value to the cfg
+ *
+ * \param cfg          config handle
+ * \param section      section to add in
+ * \param key          key to save as
+ * \param value        value to save as
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+ConfigRet ConfigAddInt(Config *cfg, const char *section, const char *key, int value)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%d", value);
 
 	return ConfigAddString(cfg, section, key, buf);
 }
@@ -782,14 +1390,9 @@ ConfigRet ConfigAddBool(Config * cfg, const char *section, const char *key, bool
 
 static void _ConfigRemoveKey(ConfigSection *sect, ConfigKeyValue *kv)
 {
+	HashRemove(&sect->kv_hash, StrHash(kv->key), kv);
 	TAILQ_REMOVE(&sect->kv_list, kv, next);
 	--(sect->numofkv);
-
-	if (kv->key)
-		free(kv->key);
-	if (kv->value)
-		free(kv->value);
-	free(kv);
 }
 
 /**
@@ -810,31 +1413,28 @@ ConfigRet ConfigRemoveKey(Config *cfg, const char *section, const char *key)
 	if (!cfg || !key)
 		return CONFIG_ERR_INVALID_PARAM;
 
-	if ((ret = ConfigGetSection(cfg, section, &sect)) == CONFIG_OK) {
-		if ((ret = ConfigGetKeyValue(sect, key, &kv)) == CONFIG_OK)
+	pthread_mutex_lock(&cfg->lock);
+	if ( ((ret = ConfigThaw(cfg)) == CONFIG_OK) &&
+		 ((ret = ConfigGetSection(cfg, section, &sect)) == CONFIG_OK) ) {
+		if ((ret = ConfigGetKeyValue(sect, key, &kv)) == CONFIG_OK) {
 			_ConfigRemoveKey(sect, kv);
+			ConfigTouch(cfg);
+		}
 	}
+	pthread_mutex_unlock(&cfg->lock);
 
 	return ret;
 }
 
+/* the section, its keys and its index stay in the arena until ConfigFree() */
 static void _ConfigRemoveSection(Config *cfg, ConfigSection *sect)
 {
-	ConfigKeyValue *kv, *t_kv;
-
 	if (!cfg || !sect)
 		return;
 
+	HashRemove(&cfg->sect_hash, StrHash(sect->name), sect);
 	TAILQ_REMOVE(&cfg->sect_list, sect, next);
 	--(cfg->numofsect);
-
-	TAILQ_FOREACH_SAFE(kv, &sect->kv_list, next, t_kv) {
-		_ConfigRemoveKey(sect, kv);
-	}
-
-	if (sect->name)
-		free(sect->name);
-	free(sect);
 }
 
 /**
@@ -853,8 +1453,110 @@ ConfigRet ConfigRemoveSection(Config *cfg, const char *section)
 	if (!cfg)
 		return CONFIG_ERR_INVALID_PARAM;
 
-	if ((ret = ConfigGetSection(cfg, section, &sect)) == CONFIG_OK)
+	pthread_mutex_lock(&cfg->lock);
+	if ( ((ret = ConfigThaw(cfg)) == CONFIG_OK) &&
+		 ((ret = ConfigGetSection(cfg, section, &sect)) == CONFIG_OK) ) {
 		_ConfigRemoveSection(cfg, sect);
+		ConfigTouch(cfg);
+	}
+	pthread_mutex_unlock(&cfg->lock);
+
+	return ret;
+}
+
+/* one of the keys ConfigMerge() leaves alone */
+static bool ConfigKept(const ConfigSection *sect, const char *key, const char *section, const char *const *keep)
+{
+	if (!keep)
+		return false;
+	if ( (section && (!sect->name || strcmp(sect->name, section))) || (!section && sect->name) )
+		return false;
+
+	for (; *keep; ++keep) {
+		if (!strcmp(*keep, key))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * \brief              ConfigMerge() makes cfg hold what src holds, for a file edited while
+ *                     cfg is saved by the background writer. Keys and sections src does not
+ *                     have are removed. It is one change for the writer, and none at all
+ *                     when nothing differs, so merging the writer's own save is a no-op.
+ *
+ * \param cfg          config handle to update
+ * \param src          config handle read from the edited file
+ * \param section      section of the kept keys
+ * \param keep         NULL terminated keys which keep their value in cfg, or NULL
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+ConfigRet ConfigMerge(Config *cfg, const Config *src, const char *section, const char *const *keep)
+{
+	ConfigSection  *sect      = NULL;
+	ConfigSection  *next_sect = NULL;
+	ConfigSection  *src_sect  = NULL;
+	ConfigKeyValue *kv        = NULL;
+	ConfigKeyValue *next_kv   = NULL;
+	ConfigKeyValue *src_kv    = NULL;
+	bool            changed   = false;
+	ConfigRet       ret       = CONFIG_OK;
+
+	if (!cfg || !src || (cfg == src))
+		return CONFIG_ERR_INVALID_PARAM;
+
+	if ((ret = ConfigThawLocked(src)) != CONFIG_OK)
+		return ret;
+
+	pthread_mutex_lock(&cfg->lock);
+	if ((ret = ConfigThaw(cfg)) != CONFIG_OK)
+		goto exit;
+
+	for (sect = TAILQ_FIRST(&cfg->sect_list); sect; sect = next_sect) {
+		next_sect = TAILQ_NEXT(sect, next);
+		ConfigGetSection(src, sect->name, &src_sect);
+
+		for (kv = TAILQ_FIRST(&sect->kv_list); kv; kv = next_kv) {
+			next_kv = TAILQ_NEXT(kv, next);
+			if (ConfigKept(sect, kv->key, section, keep))
+				continue;
+			if (src_sect && (ConfigGetKeyValue(src_sect, kv->key, &src_kv) == CONFIG_OK))
+				continue;
+			_ConfigRemoveKey(sect, kv);
+			changed = true;
+		}
+
+		/* the flat section always exists */
+		if (!src_sect && sect->name && !sect->numofkv) {
+			_ConfigRemoveSection(cfg, sect);
+			changed = true;
+		}
+	}
+
+	TAILQ_FOREACH(src_sect, &src->sect_list, next) {
+		if (ConfigGetSection(cfg, src_sect->name, &sect) == CONFIG_ERR_NO_SECTION) {
+			if ((ret = ConfigAddSection(cfg, src_sect->name, &sect)) != CONFIG_OK)
+				goto exit;
+			changed = true;
+		}
+
+		TAILQ_FOREACH(src_kv, &src_sect->kv_list, next) {
+			if (ConfigKept(src_sect, src_kv->key, section, keep))
+				continue;
+			if ( (ConfigGetKeyValue(sect, src_kv->key, &kv) == CONFIG_OK) && !strcmp(kv->value, src_kv->value) )
+				continue;
+			if ((ret = _ConfigAddString(cfg, src_sect->name, src_kv->key, src_kv->value)) != CONFIG_OK)
+				goto exit;
+			changed = true;
+		}
+	}
+
+exit:
+	if (changed)
+		ConfigTouch(cfg);
+	pthread_mutex_unlock(&cfg->lock);
 
 	return ret;
 }
@@ -877,11 +1579,16 @@ Config *ConfigNew()
 
 	/* add default section */
 	if (ConfigAddSection(cfg, CONFIG_SECTION_FLAT, NULL) != CONFIG_OK) {
+		ArenaFree(&cfg->arena);
 		free(cfg);
 		return NULL;
 	}
 
+	pthread_mutex_init(&cfg->lock, NULL);
+	pthread_cond_init(&cfg->cond, NULL);
+
 	cfg->comment_chars = strdup(COMMENT_CHARS);
+	SetCommentMap(cfg);
 	cfg->keyval_sep = KEYVAL_SEP;
 	cfg->true_str = strdup(STR_TRUE);
 	cfg->false_str = strdup(STR_FALSE);
@@ -891,20 +1598,26 @@ Config *ConfigNew()
 }
 
 /**
- * \brief          ConfigFree() frees the memory for the cfg handle
+ * \brief          ConfigFree() frees the memory for the cfg handle. Sections and
+ *                 keys live in the arena, so this does not depend on their number.
  *
  * \param cfg      config handle
  */
 void ConfigFree(Config *cfg)
 {
-	ConfigSection *sect, *t_sect;
+	ConfigImage *img;
 
 	if (cfg == NULL)
 		return;
 
-	TAILQ_FOREACH_SAFE(sect, &cfg->sect_list, next, t_sect) {
-		_ConfigRemoveSection(cfg, sect);
-	}
+	/* pending changes are written out before the handle goes away */
+	ConfigPersistStop(cfg);
+	pthread_cond_destroy(&cfg->cond);
+	pthread_mutex_destroy(&cfg->lock);
+
+	for (img = cfg->images; img; img = img->next)
+		ImageFree(img->data, img->mapped);
+	ArenaFree(&cfg->arena);
 
 	if (cfg->comment_chars) free(cfg->comment_chars);
 	if (cfg->true_str)      free(cfg->true_str);
@@ -949,7 +1662,7 @@ static ConfigRet GetSectName(Config *cfg, char *p, char **section)
 		++p;
 
 	for (q = p;
-		 *q && (*q != '\r') && (*q != '\n') && (*q != ']') && !strchr(cfg->comment_chars, *q);
+		 *q && (*q != '\r') && (*q != '\n') && (*q != ']') && !IS_COMMENT(cfg, *q);
 		 ++q)
 		;
 
@@ -972,7 +1685,7 @@ static ConfigRet GetSectName(Config *cfg, char *p, char **section)
 		++r;
 
 	/* there are unrecognized trailing data */
-	if (*r && !strchr(cfg->comment_chars, *r))
+	if (*r && !IS_COMMENT(cfg, *r))
 		return CONFIG_ERR_PARSING;
 
 	return CONFIG_OK;
@@ -1002,7 +1715,7 @@ static ConfigRet GetKeyVal(Config *cfg, char *p, char **key, char **val)
 		++p;
 
 	for (q = p;
-		 *q && (*q != '\r') && (*q != '\n') && (*q != cfg->keyval_sep) && !strchr(cfg->comment_chars, *q);
+		 *q && (*q != '\r') && (*q != '\n') && (*q != cfg->keyval_sep) && !IS_COMMENT(cfg, *q);
 		 ++q)
 		;
 
@@ -1025,7 +1738,7 @@ static ConfigRet GetKeyVal(Config *cfg, char *p, char **key, char **val)
 		++v;
 
 	for (q = v;
-		 *q && (*q != '\r') && (*q != '\n') && !strchr(cfg->comment_chars, *q);
+		 *q && (*q != '\r') && (*q != '\n') && !IS_COMMENT(cfg, *q);
 		 ++q)
 		;
 
@@ -1042,23 +1755,133 @@ static ConfigRet GetKeyVal(Config *cfg, char *p, char **key, char **val)
 }
 
 /**
- * \brief              getLine() reads the line in buffer
+ * \brief              ConfigAttachImage() hands a loaded file image over to the cfg.
+ *                     Keys and values parsed from it point into the image, so it lives
+ *                     as long as the cfg does.
  *
- * \param buffer       buffer handle to read
- * \param cfg          line to retrieved.
+ * \param cfg          config handle
+ * \param data         image, followed by a '\0'
+ * \param mapped       mapped length to munmap() on free, 0 if data was malloc'ed
  *
- * \return             Returns length of line.
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
  */
-static unsigned int getLine(const char *buffer, char *line, size_t line_len)
+static ConfigRet ConfigAttachImage(Config *cfg, char *data, size_t mapped)
 {
-    char *end = line + line_len - 1; /* Allow space for null terminator */
-    char *dst = line;
-    int i = 0;
-    while (buffer[i] != '\0' && buffer[i] != '\n' && dst < end)
-        *dst++ = buffer[i++];
+	ConfigImage *img;
+
+	if ((img = (ConfigImage *)ArenaAlloc(&cfg->arena, sizeof(ConfigImage))) == NULL)
+		return CONFIG_ERR_MEMALLOC;
 
-    *dst = '\0';
-    return (dst - line);
+	img->data = data;
+	img->mapped = mapped;
+	img->next = cfg->images;
+	cfg->images = img;
+
+	return CONFIG_OK;
+}
+
+/**
+ * \brief              ConfigParse() tokenizes the image in one pass. Line ends are
+ *                     replaced by '\0' and keys and values are borrowed in place.
+ *
+ * \param cfg          config handle
+ * \param buf          image attached to cfg, buf[len] must be writable
+ * \param len          image length
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+static ConfigRet ConfigParse(Config *cfg, char *buf, size_t len)
+{
+	ConfigSection *sect    = NULL;
+	char          *end     = buf + len;
+	char          *p       = NULL;
+	char          *eol     = NULL;
+	char          *section = NULL;
+	char          *key     = NULL;
+	char          *val     = NULL;
+	ConfigRet      ret     = CONFIG_OK;
+
+	for (p = buf; p < end; p = eol + 1) {
+		if ((eol = (char *)memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		*eol = '\0';
+
+		for ( ; *p && isspace(*p) ; ++p)
+			;
+		if (!*p || IS_COMMENT(cfg, *p))
+			continue;
+
+		if (*p == '[') {
+			if ((ret = GetSectName(cfg, p, &section)) != CONFIG_OK)
+				return ret;
+
+			if ((ret = ConfigAddSection(cfg, section, &sect)) != CONFIG_OK)
+				return ret;
+		}
+		else {
+			if ((ret = GetKeyVal(cfg, p, &key, &val)) != CONFIG_OK)
+				return ret;
+
+			/* keys before the first section go to the flat one */
+			if (!sect && (ret = ConfigAddSection(cfg, CONFIG_SECTION_FLAT, &sect)) != CONFIG_OK)
+				return ret;
+
+			if ((ret = ConfigBorrowKeyValue(cfg, sect, key, val)) != CONFIG_OK)
+				return ret;
+		}
+	}
+
+	return CONFIG_OK;
+}
+
+/**
+ * \brief              ConfigReadImage() attaches the image to the cfg and parses it
+ *
+ * \param data         image, data[len] must be writable
+ * \param len          image length
+ * \param mapped       mapped length to munmap() on free, 0 if data was malloc'ed
+ * \param cfg          pointer to config handle, created when NULL
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+static ConfigRet ConfigReadImage(char *data, size_t len, size_t mapped, Config **cfg)
+{
+	Config        *_cfg    = NULL;
+	bool           newcfg  = false;
+	ConfigRet      ret     = CONFIG_OK;
+
+	if (*cfg == NULL) {
+		_cfg = ConfigNew();
+		if (_cfg == NULL)
+			ret = CONFIG_ERR_MEMALLOC;
+		*cfg = _cfg;
+		newcfg = true;
+	}
+	else
+		_cfg = *cfg;
+
+	if ((ret != CONFIG_OK) || ((ret = ConfigAttachImage(_cfg, data, mapped)) != CONFIG_OK)) {
+		ImageFree(data, mapped);
+		goto error;
+	}
+
+	/* the image stays attached on error, a given cfg may already borrow from it */
+	pthread_mutex_lock(&_cfg->lock);
+	if ((ret = ConfigThaw(_cfg)) == CONFIG_OK)
+		ret = ConfigParse(_cfg, data, len);
+	pthread_mutex_unlock(&_cfg->lock);
+	if (ret != CONFIG_OK)
+		goto error;
+
+	return CONFIG_OK;
+
+error:
+	if (newcfg) {
+		ConfigFree(_cfg);
+		*cfg = NULL;
+	}
+
+	return ret;
 }
 
 /**
@@ -1073,65 +1896,56 @@ static unsigned int getLine(const char *buffer, char *line, size_t line_len)
  */
 ConfigRet ConfigReadFromBuffer(const char *buffer, Config **cfg)
 {
-    ConfigSection *sect    = NULL;
-    char          *p       = NULL;
-    char          *section = NULL;
-    char          *key     = NULL;
-    char          *val     = NULL;
-    const char    *buf     = buffer;
-    char          line[4096];
-    unsigned int  len      = 0;
-    Config        *_cfg    = NULL;
-    bool           newcfg  = false;
-    ConfigRet      ret     = CONFIG_OK;
+    char   *data = NULL;
+    size_t  len  = 0;
 
     if ( !buffer || !cfg || (*cfg && ((*cfg)->initnum != CONFIG_INIT_MAGIC)) )
         return CONFIG_ERR_INVALID_PARAM;
 
-    if (*cfg == NULL) {
-        _cfg = ConfigNew();
-        if (_cfg == NULL)
-            return CONFIG_ERR_MEMALLOC;
-        *cfg = _cfg;
-        newcfg = true;
-    }
-    else
-        _cfg = *cfg;
-
-    while (buf - buffer < (int)strlen(buffer)) {
-        len = getLine(buf, line, sizeof(line));
-        buf += (len + 1);
-
-        for (p = line; *p && isspace(*p) ; ++p)
-            ;
-        if (!*p || strchr(_cfg->comment_chars, *p))
-            continue;
-
-        if (*p == '[') {
-            if ((ret = GetSectName(_cfg, p, &section)) != CONFIG_OK)
-                goto error;
-
-            if ((ret = ConfigAddSection(_cfg, section, &sect)) != CONFIG_OK)
-                goto error;
-        }
-        else {
-            if ((ret = GetKeyVal(_cfg, p, &key, &val)) != CONFIG_OK)
-                goto error;
-
-            if ((ret = ConfigAddString(_cfg, sect->name, key, val)) != CONFIG_OK)
-                goto error;
-        }
-    }
+    /* one copy of the whole buffer, keys and values are parsed in place */
+    len = strlen(buffer);
+    if ((data = (char *)malloc(len + 1)) == NULL)
+        return CONFIG_ERR_MEMALLOC;
+    memcpy(data, buffer, len + 1);
 
-    return CONFIG_OK;
+    return ConfigReadImage(data, len, 0, cfg);
+}
 
-error:
-    if (newcfg) {
-        ConfigFree(_cfg);
-        *cfg = NULL;
-    }
+/**
+ * \brief              ReadStream() reads the whole stream into a malloc'ed image
+ *
+ * \param fp           FILE handle to read
+ * \param data         pointer to the image to save, followed by a '\0'
+ * \param len          pointer to the image length to save
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+static ConfigRet ReadStream(FILE *fp, char **data, size_t *len)
+{
+	char   *p    = NULL;
+	size_t  size = 4096;
 
-    return ret;
+	*len = 0;
+	if ((*data = (char *)malloc(size)) == NULL)
+		return CONFIG_ERR_MEMALLOC;
+
+	/* keep one byte for the terminating '\0' */
+	while ((*len += fread(*data + *len, 1, size - *len - 1, fp)) == size - 1) {
+		size *= 2;
+		if ((p = (char *)realloc(*data, size)) == NULL) {
+			free(*data);
+			return CONFIG_ERR_MEMALLOC;
+		}
+		*data = p;
+	}
+
+	if (ferror(fp)) {
+		free(*data);
+		return CONFIG_ERR_FILE;
+	}
+	(*data)[*len] = '\0';
+
+	return CONFIG_OK;
 }
 
 /**
@@ -1146,68 +1960,77 @@ error:
  */
 ConfigRet ConfigRead(FILE *fp, Config **cfg)
 {
-	ConfigSection *sect    = NULL;
-	char          *p       = NULL;
-	char          *section = NULL;
-	char          *key     = NULL;
-	char          *val     = NULL;
-	char           buf[4096];
-	Config        *_cfg    = NULL;
-	bool           newcfg  = false;
-	ConfigRet      ret     = CONFIG_OK;
+	char      *data = NULL;
+	size_t     len  = 0;
+	ConfigRet  ret  = CONFIG_OK;
 
 	if ( !fp || !cfg || (*cfg && ((*cfg)->initnum != CONFIG_INIT_MAGIC)) )
 		return CONFIG_ERR_INVALID_PARAM;
 
-	if (*cfg == NULL) {
-		_cfg = ConfigNew();
-		if (_cfg == NULL)
-			return CONFIG_ERR_MEMALLOC;
-		*cfg = _cfg;
-		newcfg = true;
-	}
-	else
-		_cfg = *cfg;
+	if ((ret = ReadStream(fp, &data, &len)) != CONFIG_OK)
+		return ret;
 
-	while (!feof(fp)) {
-		if (fgets(buf, sizeof(buf), fp) == NULL)
-			continue;
+	return ConfigReadImage(data, len, 0, cfg);
+}
 
-		for (p = buf; *p && isspace(*p) ; ++p)
-			;
-		if (!*p || strchr(_cfg->comment_chars, *p))
-			continue;
+/**
+ * \brief              LoadFile() loads the image of a file. It is mapped privately
+ *                     when the tail of its last page can terminate it, read otherwise.
+ *
+ * \param filename     name of file to load
+ * \param data         pointer to the image to save, followed by a '\0'
+ * \param len          pointer to the image length to save
+ * \param mapped       pointer to the mapped length to save, 0 if data was malloc'ed
+ * \param st           stat of the loaded file
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+static ConfigRet LoadFile(const char *filename, char **data, size_t *len, size_t *mapped, struct stat *st)
+{
+	FILE      *fp  = NULL;
+	int        fd  = -1;
+	ConfigRet  ret = CONFIG_OK;
 
-		if (*p == '[') {
-			if ((ret = GetSectName(_cfg, p, &section)) != CONFIG_OK)
-				goto error;
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return CONFIG_ERR_FILE;
 
-			if ((ret = ConfigAddSection(_cfg, section, &sect)) != CONFIG_OK)
-				goto error;
-		}
-		else {
-			if ((ret = GetKeyVal(_cfg, p, &key, &val)) != CONFIG_OK)
-				goto error;
+	if (fstat(fd, st) < 0) {
+		close(fd);
+		return CONFIG_ERR_FILE;
+	}
+	*len = (size_t)st->st_size;
+	*mapped = 0;
+
+	/*
+	 * The tail of the last page reads as zeros, which terminates the image.
+	 * An empty file, or one filling whole pages, has no such tail and goes
+	 * through stdio instead.
+	 */
+	if (S_ISREG(st->st_mode) && (*len % sysconf(_SC_PAGESIZE)) != 0) {
+		*data = (char *)mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (*data == MAP_FAILED)
+			return CONFIG_ERR_FILE;
+		*mapped = *len;
+		return CONFIG_OK;
+	}
 
-			if ((ret = ConfigAddString(_cfg, sect->name, key, val)) != CONFIG_OK)
-				goto error;
-		}
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return CONFIG_ERR_FILE;
 	}
 
-	return CONFIG_OK;
+	ret = ReadStream(fp, data, len);
 
-error:
-	if (newcfg) {
-		ConfigFree(_cfg);
-		*cfg = NULL;
-	}
+	fclose(fp);
 
 	return ret;
 }
 
 /**
  * \brief              ConfigReadFile() opens and reads the file and populates the
- *                     entire content to cfg handle
+ *                     entire content to cfg handle. The file is mapped privately and
+ *                     parsed in place, so loading does not copy keys and values.
  *
  * \param filename     name of file to open and load
  * \param cfg          pointer to config handle.
@@ -1218,22 +2041,284 @@ error:
  */
 ConfigRet ConfigReadFile(const char *filename, Config **cfg)
 {
-	FILE      *fp  = NULL;
-	ConfigRet  ret = CONFIG_OK;
+	char        *data   = NULL;
+	struct stat  st;
+	size_t       len    = 0;
+	size_t       mapped = 0;
+	ConfigRet    ret    = CONFIG_OK;
 
 	if ( !filename || !cfg || (*cfg && ((*cfg)->initnum != CONFIG_INIT_MAGIC)) )
 		return CONFIG_ERR_INVALID_PARAM;
 
-	if ((fp = fopen(filename, "r")) == NULL)
-		return CONFIG_ERR_FILE;
+	if ((ret = LoadFile(filename, &data, &len, &mapped, &st)) != CONFIG_OK)
+		return ret;
 
-	ret = ConfigRead(fp, cfg);
+	return ConfigReadImage(data, len, mapped, cfg);
+}
 
-	fclose(fp);
+static ConfigRet ConfigWriteFile(const char *filename, const char *data, size_t len);
 
-	return ret;
+/* index size for n entries, a power of two at most half full */
+static uint32_t SnapSlots(uint32_t n)
+{
+	uint32_t slots = 2;
+
+	if (!n)
+		return 0;
+	while (slots < 2 * n)
+		slots <<= 1;
+
+	return slots;
+}
+
+static void SnapIndex(uint32_t *index, uint32_t slots, uint32_t hash, uint32_t entry)
+{
+	uint32_t mask = slots - 1;
+	uint32_t i;
+
+	for (i = hash & mask; index[i]; i = (i + 1) & mask)
+		;
+	index[i] = entry + 1;
+}
+
+static uint32_t SnapString(char *strings, uint32_t *used, const char *s)
+{
+	uint32_t off = *used;
+	size_t   len = strlen(s) + 1;
+
+	memcpy(strings + off, s, len);
+	*used += len;
+
+	return off;
+}
+
+static void SnapSetSource(ConfigSnapHeader *snap, const struct stat *st)
+{
+	snap->src_size = (uint64_t)st->st_size;
+	snap->src_ino = (uint64_t)st->st_ino;
+	snap->src_mtime = (int64_t)st->st_mtime;
+	snap->src_mtime_nsec = (int64_t)ST_MTIME_NSEC(st);
+}
+
+/**
+ * \brief              SnapBuild() compiles the cfg into a snapshot. Caller holds
+ *                     cfg->lock or is the only user of the cfg.
+ *
+ * \param cfg          config handle
+ * \param st           stat of the text file the cfg was read from
+ * \param src_hash     MemHash() of that text
+ * \param len          pointer to the snapshot length to save
+ *
+ * \return             Returns the snapshot to free(), NULL on failure.
+ */
+static char *SnapBuild(const Config *cfg, const struct stat *st, uint32_t src_hash, size_t *len)
+{
+	ConfigSnapHeader   *snap;
+	ConfigSnapSection  *snap_sect;
+	ConfigSnapKeyValue *snap_kv;
+	ConfigSection      *sect   = NULL;
+	ConfigKeyValue     *kv     = NULL;
+	uint32_t            nsect  = 0, nkv = 0, kv_slots = 0;
+	uint32_t            i      = 0, j = 0, slot = 0, used = 0;
+	uint64_t            pool   = 0, size;
+	char               *buf;
+
+	TAILQ_FOREACH(sect, &cfg->sect_list, next) {
+		++nsect;
+		if (sect->name)
+			pool += strlen(sect->name) + 1;
+		TAILQ_FOREACH(kv, &sect->kv_list, next)
+			pool += strlen(kv->key) + strlen(kv->value) + 2;
+		nkv += sect->numofkv;
+		kv_slots += SnapSlots(sect->numofkv);
+	}
+
+	size = sizeof(ConfigSnapHeader) + (uint64_t)nsect * sizeof(ConfigSnapSection) +
+	       (uint64_t)nkv * sizeof(ConfigSnapKeyValue) +
+	       ((uint64_t)SnapSlots(nsect) + kv_slots) * sizeof(uint32_t) + pool;
+	if (size > UINT32_MAX)
+		return NULL;
+	if ((buf = (char *)calloc(1, size)) == NULL)
+		return NULL;
+
+	snap = (ConfigSnapHeader *)buf;
+	snap->magic = SNAP_MAGIC;
+	snap->version = SNAP_VERSION;
+	snap->size = (uint32_t)size;
+	snap->src_hash = src_hash;
+	snap->numofsect = nsect;
+	snap->numofkv = nkv;
+	snap->sect_slots = SnapSlots(nsect);
+	snap->kv_slots = kv_slots;
+	snap->strings = (uint32_t)pool;
+	SnapSetSource(snap, st);
+
+	TAILQ_FOREACH(sect, &cfg->sect_list, next) {
+		snap_sect = &SNAP_SECTS(snap)[i];
+		snap_sect->name = sect->name ? SnapString(SNAP_STRINGS(snap), &used, sect->name) : SNAP_NO_NAME;
+		snap_sect->hash = StrHash(sect->name);
+		snap_sect->first_kv = j;
+		snap_sect->numofkv = sect->numofkv;
+		snap_sect->kv_index = slot;
+		snap_sect->kv_slots = SnapSlots(sect->numofkv);
+		SnapIndex(SNAP_SECT_INDEX(snap), snap->sect_slots, snap_sect->hash, i);
+
+		TAILQ_FOREACH(kv, &sect->kv_list, next) {
+			snap_kv = &SNAP_KVS(snap)[j];
+			snap_kv->key = SnapString(SNAP_STRINGS(snap), &used, kv->key);
+			snap_kv->value = SnapString(SNAP_STRINGS(snap), &used, kv->value);
+			snap_kv->hash = StrHash(kv->key);
+			SnapIndex(SNAP_KV_INDEX(snap) + slot, snap_sect->kv_slots, snap_kv->hash, j);
+			++j;
+		}
+		slot += snap_sect->kv_slots;
+		++i;
+	}
+
+	snap->checksum = SnapChecksum(snap + 1, size - sizeof(ConfigSnapHeader));
+
+	*len = size;
+	return buf;
+}
+
+/**
+ * \brief              SnapMap() maps a snapshot privately and checks it. The checksum
+ *                     catches torn or corrupted files, the snapshot is trusted otherwise.
+ *
+ * \param filename     snapshot file
+ * \param len          pointer to the mapped length to save
+ *
+ * \return             Returns the snapshot, NULL if it is missing or invalid.
+ */
+static ConfigSnapHeader *SnapMap(const char *filename, size_t *len)
+{
+	ConfigSnapHeader *snap = NULL;
+	struct stat       st;
+	uint64_t          size;
+	int               fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return NULL;
+
+	if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < sizeof(ConfigSnapHeader))) {
+		close(fd);
+		return NULL;
+	}
+	*len = (size_t)st.st_size;
+
+	/* writable, values are rewritten in place once the cfg is thawed */
+	snap = (ConfigSnapHeader *)mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (snap == (ConfigSnapHeader *)MAP_FAILED)
+		return NULL;
+
+	size = sizeof(ConfigSnapHeader) + (uint64_t)snap->numofsect * sizeof(ConfigSnapSection) +
+	       (uint64_t)snap->numofkv * sizeof(ConfigSnapKeyValue) +
+	       ((uint64_t)snap->sect_slots + snap->kv_slots) * sizeof(uint32_t) + snap->strings;
+
+	if ( (snap->magic != SNAP_MAGIC) || (snap->version != SNAP_VERSION) ||
+		 (snap->size != *len) || (size != *len) || !snap->numofsect || !snap->strings ||
+		 (SNAP_STRINGS(snap)[snap->strings - 1] != '\0') ||
+		 (snap->checksum != SnapChecksum(snap + 1, *len - sizeof(ConfigSnapHeader))) ) {
+		munmap(snap, *len);
+		return NULL;
+	}
+
+	return snap;
+}
+
+/* hands a mapped snapshot over to a new cfg */
+static ConfigRet ConfigUseSnapshot(ConfigSnapHeader *snap, size_t len, Config **cfg)
+{
+	Config *_cfg = NULL;
+
+	if ( ((_cfg = ConfigNew()) == NULL) || (ConfigAttachImage(_cfg, (char *)snap, len) != CONFIG_OK) ) {
+		munmap(snap, len);
+		ConfigFree(_cfg);
+		return CONFIG_ERR_MEMALLOC;
+	}
+
+	_cfg->snap = snap;
+	*cfg = _cfg;
+	return CONFIG_OK;
 }
 
+static bool SnapIsFresh(const ConfigSnapHeader *snap, const struct stat *st)
+{
+	return ( (snap->src_size == (uint64_t)st->st_size) && (snap->src_ino == (uint64_t)st->st_ino) &&
+			 (snap->src_mtime == (int64_t)st->st_mtime) &&
+			 (snap->src_mtime_nsec == (int64_t)ST_MTIME_NSEC(st)) ) ? true : false;
+}
+
+/**
+ * \brief              ConfigReadFileCached() reads the file through a binary snapshot.
+ *                     While the snapshot matches the size and mtime of the file, it is
+ *                     mapped and ConfigRead*() answer from its prehashed tables without
+ *                     reading the text at all. Otherwise the text is read; if only its
+ *                     mtime changed the snapshot is kept, else the text is parsed and
+ *                     the snapshot is rebuilt for the next start.
+ *
+ * \param filename     name of the text file
+ * \param snapshot     name of the snapshot file, created when missing or stale
+ * \param cfg          pointer to config handle, must point to NULL. A given handle may
+ *                     already hold content or custom settings, so it is read by
+ *                     ConfigReadFile() instead.
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+ConfigRet ConfigReadFileCached(const char *filename, const char *snapshot, Config **cfg)
+{
+	ConfigSnapHeader *snap     = NULL;
+	char             *data     = NULL;
+	char             *buf      = NULL;
+	struct stat       st;
+	size_t            snap_len = 0;
+	size_t            len      = 0;
+	size_t            mapped   = 0;
+	uint32_t          hash;
+	ConfigRet         ret      = CONFIG_OK;
+
+	if ( !filename || !snapshot || !cfg || (*cfg && ((*cfg)->initnum != CONFIG_INIT_MAGIC)) )
+		return CONFIG_ERR_INVALID_PARAM;
+
+	if (*cfg)
+		return ConfigReadFile(filename, cfg);
+
+	if (stat(filename, &st) < 0)
+		return CONFIG_ERR_FILE;
+
+	snap = SnapMap(snapshot, &snap_len);
+	if (snap && SnapIsFresh(snap, &st))
+		return ConfigUseSnapshot(snap, snap_len, cfg);
+
+	if ((ret = LoadFile(filename, &data, &len, &mapped, &st)) != CONFIG_OK) {
+		if (snap)
+			munmap(snap, snap_len);
+		return ret;
+	}
+	hash = MemHash(data, len);
+
+	if (snap && (snap->src_hash == hash)) {
+		/* touched but not changed, keep the snapshot and record the new mtime */
+		ImageFree(data, mapped);
+		SnapSetSource(snap, &st);
+		ConfigWriteFile(snapshot, (const char *)snap, snap_len);
+		return ConfigUseSnapshot(snap, snap_len, cfg);
+	}
+	if (snap)
+		munmap(snap, snap_len);
+
+	if ((ret = ConfigReadImage(data, len, mapped, cfg)) != CONFIG_OK)
+		return ret;
+
+	/* a snapshot which cannot be written only costs the next start a parse */
+	if ((buf = SnapBuild(*cfg, &st, hash, &snap_len)) != NULL) {
+		ConfigWriteFile(snapshot, buf, snap_len);
+		free(buf);
+	}
+
+	return CONFIG_OK;
+}
 /**
  * \brief              ConfigPrint() prints all cfg content to the stream
  *
@@ -1246,10 +2331,14 @@ ConfigRet ConfigPrint(const Config *cfg, FILE *stream)
 {
 	ConfigSection  *sect = NULL;
 	ConfigKeyValue *kv   = NULL;
+	ConfigRet       ret  = CONFIG_OK;
 
 	if (!cfg || !stream)
 		return CONFIG_ERR_INVALID_PARAM;
 
+	if ((ret = ConfigThawLocked(cfg)) != CONFIG_OK)
+		return ret;
+
 	TAILQ_FOREACH(sect, &cfg->sect_list, next) {
 		if (sect->name)
 			fprintf(stream, "[%s]\n", sect->name);
@@ -1275,10 +2364,14 @@ ConfigRet ConfigPrintToBuffer(const Config *cfg, char *buffer)
 {
     ConfigSection  *sect = NULL;
     ConfigKeyValue *kv   = NULL;
+    ConfigRet       ret  = CONFIG_OK;
 
     if (!cfg || !buffer)
         return CONFIG_ERR_INVALID_PARAM;
 
+    if ((ret = ConfigThawLocked(cfg)) != CONFIG_OK)
+        return ret;
+
     TAILQ_FOREACH(sect, &cfg->sect_list, next) {
         if (sect->name)
             sprintf(buffer + strlen(buffer), "[%s]\n", sect->name);
@@ -1293,7 +2386,119 @@ ConfigRet ConfigPrintToBuffer(const Config *cfg, char *buffer)
 }
 
 /**
- * \brief              ConfigPrintToFile() prints (saves) all cfg content to the file
+ * \brief              ConfigPrintToMemory() prints all cfg content, the way ConfigPrint()
+ *                     does, to a malloc'ed buffer. Caller holds cfg->lock.
+ *                     A cfg still answering from its snapshot is thawed first.
+ *
+ * \param cfg          config handle
+ * \param len          length of the returned text
+ *
+ * \return             Returns the text to free(), NULL if allocation fails.
+ */
+static char *ConfigPrintToMemory(Config *cfg, size_t *len)
+{
+	ConfigSection  *sect = NULL;
+	ConfigKeyValue *kv   = NULL;
+	size_t          size = 0;
+	char           *buf, *p;
+
+	if (ConfigThaw(cfg) != CONFIG_OK)
+		return NULL;
+
+	TAILQ_FOREACH(sect, &cfg->sect_list, next) {
+		if (sect->name)
+			size += strlen(sect->name) + 3;
+		TAILQ_FOREACH(kv, &sect->kv_list, next)
+			size += strlen(kv->key) + strlen(kv->value) + 2;
+		size += 1;
+	}
+
+	if ((p = buf = (char *)malloc(size + 1)) == NULL)
+		return NULL;
+
+	TAILQ_FOREACH(sect, &cfg->sect_list, next) {
+		if (sect->name)
+			p += sprintf(p, "[%s]\n", sect->name);
+		TAILQ_FOREACH(kv, &sect->kv_list, next)
+			p += sprintf(p, "%s=%s\n", kv->key, kv->value);
+		*p++ = '\n';
+	}
+	*p = '\0';
+
+	*len = p - buf;
+	return buf;
+}
+
+/**
+ * \brief              ConfigWriteFile() replaces the file atomically: the data goes to
+ *                     a temporary file next to it, which is synced and renamed over it.
+ *                     A crash leaves either the old or the new content.
+ *
+ * \param filename     filename to save in
+ * \param data         content to save
+ * \param len          length of data
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+static ConfigRet ConfigWriteFile(const char *filename, const char *data, size_t len)
+{
+	char        tmp[PATH_MAX];
+	char        dir[PATH_MAX];
+	const char *slash;
+	struct stat st;
+	mode_t      mode = 0600;
+	ssize_t     n;
+	int         fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int)sizeof(tmp))
+		return CONFIG_ERR_INVALID_PARAM;
+
+	/* keep the permissions of the file being replaced, it holds tokens */
+	if (stat(filename, &st) == 0)
+		mode = st.st_mode & 0777;
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, mode)) < 0)
+		return CONFIG_ERR_FILE;
+	fchmod(fd, mode);
+
+	while (len > 0) {
+		if ((n = write(fd, data, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		data += n;
+		len -= n;
+	}
+
+	if ((len > 0) || (fsync(fd) < 0)) {
+		close(fd);
+		unlink(tmp);
+		return CONFIG_ERR_FILE;
+	}
+	close(fd);
+
+	if (rename(tmp, filename) < 0) {
+		unlink(tmp);
+		return CONFIG_ERR_FILE;
+	}
+
+	/* make the rename itself durable */
+	if ((slash = strrchr(filename, '/')) != NULL)
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - filename + 1), filename);
+	else
+		strcpy(dir, ".");
+	if ((fd = open(dir, O_RDONLY)) >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+
+	return CONFIG_OK;
+}
+
+/**
+ * \brief              ConfigPrintToFile() prints (saves) all cfg content to the file.
+ *                     The file is replaced atomically, see ConfigWriteFile().
  *
  * \param cfg          config handle
  * \param filename     filename to save in
@@ -1302,18 +2507,23 @@ ConfigRet ConfigPrintToBuffer(const Config *cfg, char *buffer)
  */
 ConfigRet ConfigPrintToFile(const Config *cfg, char *filename)
 {
-	FILE      *fp  = NULL;
-	ConfigRet  ret = CONFIG_OK;
+	Config    *_cfg = (Config *)cfg;
+	char      *data = NULL;
+	size_t     len  = 0;
+	ConfigRet  ret  = CONFIG_OK;
 
 	if (!cfg || !filename)
 		return CONFIG_ERR_INVALID_PARAM;
 
-	if ((fp = fopen(filename, "wb")) == NULL)
-		return CONFIG_ERR_FILE;
+	pthread_mutex_lock(&_cfg->lock);
+	data = ConfigPrintToMemory(_cfg, &len);
+	pthread_mutex_unlock(&_cfg->lock);
+	if (data == NULL)
+		return CONFIG_ERR_MEMALLOC;
 
-	ret = ConfigPrint(cfg, fp);
+	ret = ConfigWriteFile(filename, data, len);
 
-	fclose(fp);
+	free(data);
 
 	return ret;
 }
@@ -1341,3 +2551,210 @@ ConfigRet ConfigPrintSettings(const Config *cfg, FILE *stream)
 	return CONFIG_OK;
 }
 
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+/* p lies in a file mapping, which a rewrite of the file in place changes under it */
+static bool ConfigInMapping(const Config *cfg, const char *p)
+{
+	const ConfigImage *img;
+
+	for (img = cfg->images; img; img = img->next) {
+		if (img->mapped && (p >= img->data) && (p < img->data + img->mapped))
+			return true;
+	}
+
+	return false;
+}
+
+/* copies the keys and values borrowed from file mappings into the arena, caller holds cfg->lock */
+static ConfigRet ConfigOwnStrings(Config *cfg)
+{
+	ConfigSection  *sect = NULL;
+	ConfigKeyValue *kv   = NULL;
+	ConfigRet       ret  = CONFIG_OK;
+	char           *p    = NULL;
+
+	if ((ret = ConfigThaw(cfg)) != CONFIG_OK)
+		return ret;
+
+	TAILQ_FOREACH(sect, &cfg->sect_list, next) {
+		TAILQ_FOREACH(kv, &sect->kv_list, next) {
+			if (ConfigInMapping(cfg, kv->key)) {
+				if ((p = ArenaStrndup(&cfg->arena, kv->key, strlen(kv->key))) == NULL)
+					return CONFIG_ERR_MEMALLOC;
+				kv->key = p;
+			}
+			if (ConfigInMapping(cfg, kv->value)) {
+				if ((p = ArenaStrndup(&cfg->arena, kv->value, strlen(kv->value))) == NULL)
+					return CONFIG_ERR_MEMALLOC;
+				kv->value = p;
+				kv->value_size = strlen(p) + 1;
+			}
+		}
+	}
+
+	return CONFIG_OK;
+}
+
+static void *ConfigPersistThread(void *arg)
+{
+	Config          *cfg  = (Config *)arg;
+	struct timeval   tv;
+	struct timespec  deadline;
+	unsigned long    changes;
+	char            *data = NULL;
+	size_t           len  = 0;
+	bool             stop = false;
+	ConfigRet        ret  = CONFIG_OK;
+
+	pthread_mutex_lock(&cfg->lock);
+	while (!stop) {
+		while ((cfg->changes == cfg->saved) && !cfg->persist_stop)
+			pthread_cond_wait(&cfg->cond, &cfg->lock);
+
+		/* let a burst of updates settle, a stop request flushes right away */
+		gettimeofday(&tv, NULL);
+		deadline.tv_sec = tv.tv_sec + cfg->persist_delay / 1000;
+		deadline.tv_nsec = tv.tv_usec * 1000L + (cfg->persist_delay % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (!cfg->persist_stop &&
+				(pthread_cond_timedwait(&cfg->cond, &cfg->lock, &deadline) != ETIMEDOUT))
+			;
+
+		stop = cfg->persist_stop;
+		if (cfg->changes == cfg->saved)
+			continue;
+
+		changes = cfg->changes;
+		data = ConfigPrintToMemory(cfg, &len);
+		pthread_mutex_unlock(&cfg->lock);
+
+		ret = data ? ConfigWriteFile(cfg->persist_file, data, len) : CONFIG_ERR_MEMALLOC;
+		free(data);
+
+		/* a failed write stays dirty and is retried after the next delay */
+		pthread_mutex_lock(&cfg->lock);
+		if (ret == CONFIG_OK)
+			cfg->saved = changes;
+		cfg->persist_ret = ret;
+	}
+	pthread_mutex_unlock(&cfg->lock);
+
+	return NULL;
+}
+
+/**
+ * \brief              ConfigPersistStart() starts a background writer which saves the cfg
+ *                     to the file after each burst of changes. Mutating calls only mark
+ *                     the cfg dirty, so they never wait for the disk.
+ *                     Reads take no lock, keep reads and writes on one thread.
+ *                     Keys and values stop borrowing from a mapped file, which may be
+ *                     edited in place while the cfg lives on, a truncation would even
+ *                     discard the private copies of its pages.
+ *
+ * \param cfg          config handle, the content is assumed to match the file
+ * \param filename     filename to save in
+ * \param delay_ms     how long to wait for more changes before writing
+ *
+ * \return             Returns CONFIG_RET_OK as success, otherwise is an error.
+ */
+ConfigRet ConfigPersistStart(Config *cfg, const char *filename, int delay_ms)
+{
+	ConfigRet ret = CONFIG_OK;
+
+	if (!cfg || !filename || (delay_ms < 0))
+		return CONFIG_ERR_INVALID_PARAM;
+
+	pthread_mutex_lock(&cfg->lock);
+	if (cfg->persisting) {
+		ret = CONFIG_ERR_INVALID_PARAM;
+		goto exit;
+	}
+	if ((ret = ConfigOwnStrings(cfg)) != CONFIG_OK)
+		goto exit;
+	if ((cfg->persist_file = strdup(filename)) == NULL) {
+		ret = CONFIG_ERR_MEMALLOC;
+		goto exit;
+	}
+	cfg->persist_delay = delay_ms;
+	cfg->persist_stop = false;
+	cfg->persist_ret = CONFIG_OK;
+	cfg->saved = cfg->changes;
+
+	if (pthread_create(&cfg->writer, NULL, ConfigPersistThread, cfg) != 0) {
+		free(cfg->persist_file);
+		cfg->persist_file = NULL;
+		ret = CONFIG_ERR_MEMALLOC;
+		goto exit;
+	}
+	cfg->persisting = true;
+
+exit:
+	pthread_mutex_unlock(&cfg->lock);
+	return ret;
+}
+
+/**
+ * \brief              ConfigPersistStop() writes pending changes and stops the writer
+ *
+ * \param cfg          config handle
+ *
+ * \return             Returns the result of the last write, CONFIG_RET_OK if the writer
+ *                     was not running.
+ */
+ConfigRet ConfigPersistStop(Config *cfg)
+{
+	ConfigRet ret = CONFIG_OK;
+
+	if (!cfg)
+		return CONFIG_ERR_INVALID_PARAM;
+
+	pthread_mutex_lock(&cfg->lock);
+	if (!cfg->persisting) {
+		pthread_mutex_unlock(&cfg->lock);
+		return CONFIG_OK;
+	}
+	cfg->persist_stop = true;
+	pthread_cond_signal(&cfg->cond);
+	pthread_mutex_unlock(&cfg->lock);
+
+	pthread_join(cfg->writer, NULL);
+
+	pthread_mutex_lock(&cfg->lock);
+	cfg->persisting = false;
+	ret = cfg->persist_ret;
+	free(cfg->persist_file);
+	cfg->persist_file = NULL;
+	pthread_mutex_unlock(&cfg->lock);
+
+	return ret;
+}
+
+/**
+ * \brief              ConfigIsDirty() checks whether the cfg changed since it was last
+ *                     saved by the background writer
+ *
+ * \param cfg          config handle
+ *
+ * \return             Returns true if there are unsaved changes.
+ */
+bool ConfigIsDirty(Config *cfg)
+{
+	bool dirty;
+
+	if (!cfg)
+		return false;
+
+	pthread_mutex_lock(&cfg->lock);
+	dirty = (cfg->changes != cfg->saved) ? true : false;
+	pthread_mutex_unlock(&cfg->lock);
+
+	return dirty;
+}
@@ -81,6 +81,7 @@ const char *ConfigRetToString      (ConfigRet ret);
 ConfigRet   ConfigRead             (FILE *fp, Config **cfg);
 ConfigRet   ConfigReadFile         (const char *filename, Config **cfg);
 ConfigRet   ConfigReadFromBuffer   (const char *buffer, Config **cfg);
+ConfigRet   ConfigReadFileCached   (const char *filename, const char *snapshot, Config **cfg);
 
 ConfigRet   ConfigPrint            (const Config *cfg, FILE *stream);
 ConfigRet   ConfigPrintToFile      (const Config *cfg, char *filename);
@@ -113,6 +114,12 @@ bool        ConfigHasSection       (const Config *cfg, const char *sect);
 ConfigRet   ConfigRemoveSection    (Config *cfg, const char *sect);
 ConfigRet   ConfigRemoveKey        (Config *cfg, const char *sect, const char *key);
 
+ConfigRet   ConfigMerge            (Config *cfg, const Config *src, const char *sect, const char *const *keep);
+
+ConfigRet   ConfigPersistStart     (Config *cfg, const char *filename, int delay_ms);
+ConfigRet   ConfigPersistStop      (Config *cfg);
+bool        ConfigIsDirty          (Config *cfg);
+
 
 #ifdef __cplusplus
 }
@@ -2,6 +2,163 @@
 
 #include <stdlib.h>
 
+#if !defined(JSMN_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define JSMN_SSE2
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define JSMN_AVX2
+#endif
+#elif !defined(JSMN_SCALAR) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define JSMN_NEON
+#endif
+
+static int jsmn_simd = 1;
+
+void jsmn_set_simd(int enable) {
+	jsmn_simd = enable;
+}
+
+/**
+ * Returns the offset of the first quote, backslash or NUL at or after pos,
+ * or len.
+ */
+static size_t jsmn_string_end_scalar(const char *js, size_t pos, size_t len) {
+	for (; pos < len; pos++) {
+		char c = js[pos];
+		if (c == '\"' || c == '\\' || c == '\0') {
+			break;
+		}
+	}
+	return pos;
+}
+
+/**
+ * Returns the offset of the first byte other than JSON whitespace at or
+ * after pos, or len.
+ */
+static size_t jsmn_space_end_scalar(const char *js, size_t pos, size_t len) {
+	for (; pos < len; pos++) {
+		char c = js[pos];
+		if (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+			break;
+		}
+	}
+	return pos;
+}
+
+#ifdef JSMN_SSE2
+static size_t jsmn_string_end_sse2(const char *js, size_t pos, size_t len) {
+	const __m128i quote = _mm_set1_epi8('\"');
+	const __m128i slash = _mm_set1_epi8('\\');
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; pos + 16 <= len; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(js + pos));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+				_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash)), _mm_cmpeq_epi8(v, zero)));
+		if (mask) {
+			return pos + __builtin_ctz(mask);
+		}
+	}
+	return jsmn_string_end_scalar(js, pos, len);
+}
+
+static size_t jsmn_space_end_sse2(const char *js, size_t pos, size_t len) {
+	for (; pos + 16 <= len; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(js + pos));
+		int mask = _mm_movemask_epi8(_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+				_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')))));
+		if (mask != 0xffff) {
+			return pos + __builtin_ctz(~mask);
+		}
+	}
+	return jsmn_space_end_scalar(js, pos, len);
+}
+#endif
+
+#ifdef JSMN_AVX2
+__attribute__((target("avx2")))
+static size_t jsmn_string_end_avx2(const char *js, size_t pos, size_t len) {
+	const __m256i quote = _mm256_set1_epi8('\"');
+	const __m256i slash = _mm256_set1_epi8('\\');
+	const __m256i zero = _mm256_setzero_si256();
+
+	for (; pos + 32 <= len; pos += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(js + pos));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(
+				_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, slash)), _mm256_cmpeq_epi8(v, zero)));
+		if (mask) {
+			return pos + __builtin_ctz(mask);
+		}
+	}
+	return jsmn_string_end_sse2(js, pos, len);
+}
+#endif
+
+#ifdef JSMN_NEON
+/* NEON has no movemask, a block with a match is finished byte by byte */
+static size_t jsmn_string_end_neon(const char *js, size_t pos, size_t len) {
+	const uint8x16_t quote = vdupq_n_u8('\"');
+	const uint8x16_t slash = vdupq_n_u8('\\');
+	const uint8x16_t zero = vdupq_n_u8(0);
+
+	for (; pos + 16 <= len; pos += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)(js + pos));
+		uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, slash)), vceqq_u8(v, zero));
+		uint8x8_t m8 = vorr_u8(vget_low_u8(m), vget_high_u8(m));
+		if (vget_lane_u64(vreinterpret_u64_u8(m8), 0)) {
+			break;
+		}
+	}
+	return jsmn_string_end_scalar(js, pos, len);
+}
+
+static size_t jsmn_space_end_neon(const char *js, size_t pos, size_t len) {
+	for (; pos + 16 <= len; pos += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)(js + pos));
+		uint8x16_t m = vorrq_u8(
+				vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t'))),
+				vorrq_u8(vceqq_u8(v, vdupq_n_u8('\r')), vceqq_u8(v, vdupq_n_u8('\n'))));
+		uint8x8_t m8 = vand_u8(vget_low_u8(m), vget_high_u8(m));
+		if (vget_lane_u64(vreinterpret_u64_u8(m8), 0) != ~(uint64_t)0) {
+			break;
+		}
+	}
+	return jsmn_space_end_scalar(js, pos, len);
+}
+#endif
+
+static size_t jsmn_string_end(const char *js, size_t pos, size_t len) {
+	if (jsmn_simd) {
+#ifdef JSMN_AVX2
+		if (__builtin_cpu_supports("avx2")) {
+			return jsmn_string_end_avx2(js, pos, len);
+		}
+#endif
+#if defined(JSMN_SSE2)
+		return jsmn_string_end_sse2(js, pos, len);
+#elif defined(JSMN_NEON)
+		return jsmn_string_end_neon(js, pos, len);
+#endif
+	}
+	return jsmn_string_end_scalar(js, pos, len);
+}
+
+/* runs of whitespace are short, 16 bytes at a time is enough */
+static size_t jsmn_space_end(const char *js, size_t pos, size_t len) {
+	if (jsmn_simd) {
+#if defined(JSMN_SSE2)
+		return jsmn_space_end_sse2(js, pos, len);
+#elif defined(JSMN_NEON)
+		return jsmn_space_end_neon(js, pos, len);
+#endif
+	}
+	return jsmn_space_end_scalar(js, pos, len);
+}
+
 
 /**
  * Allocates a fresh unused token from the token pull.
@@ -94,7 +251,14 @@ static jsmnerr_t jsmn_parse_string(jsmn_parser *parser, const char *js,
 
 	/* Skip starting quote */
 	for (; parser->pos < len && js[parser->pos] != '\0'; parser->pos++) {
-		char c = js[parser->pos];
+		char c;
+
+		/* plain bytes are skipped in blocks */
+		parser->pos = jsmn_string_end(js, parser->pos, len);
+		if (parser->pos >= len || js[parser->pos] == '\0') {
+			break;
+		}
+		c = js[parser->pos];
 
 		/* Quote: end of string */
 		if (c == '\"') {
@@ -236,6 +400,7 @@ jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, size_t len,
 					tokens[parser->toksuper].size++;
 				break;
 			case '\t' : case '\r' : case '\n' : case ' ':
+				parser->pos = jsmn_space_end(js, parser->pos + 1, len) - 1;
 				break;
 			case ':':
 				parser->toksuper = parser->toknext - 1;
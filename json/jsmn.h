@@ -70,6 +70,13 @@ void jsmn_init(jsmn_parser *parser);
 jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, size_t len,
 		jsmntok_t *tokens, unsigned int num_tokens);
 
+/**
+ * Scan strings and whitespace with SSE2/AVX2/NEON when the CPU has them
+ * (the default), or one byte at a time. Tokens are the same either way.
+ * Not thread safe, call it before parsing.
+ */
+void jsmn_set_simd(int enable);
+
 #ifdef __cplusplus
 }
 #endif
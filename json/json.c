@@ -0,0 +1,327 @@
+#include "json.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Doubles the token array, the tokens filled so far are kept.
+ */
+static int json_arena_grow(json_arena_t *arena) {
+	jsmntok_t *tokens;
+	unsigned int size;
+
+	size = arena->size ? arena->size * 2 : JSON_ARENA_INIT;
+	if (size > JSON_ARENA_MAX) {
+		return -1;
+	}
+	tokens = (jsmntok_t *)realloc(arena->tokens, size * sizeof(jsmntok_t));
+	if (tokens == NULL) {
+		return -1;
+	}
+	arena->tokens = tokens;
+	arena->size = size;
+	return 0;
+}
+
+void json_arena_init(json_arena_t *arena) {
+	arena->tokens = NULL;
+	arena->size = 0;
+	arena->count = 0;
+}
+
+void json_arena_free(json_arena_t *arena) {
+	free(arena->tokens);
+	json_arena_init(arena);
+}
+
+/**
+ * jsmn leaves the parser at the token it could not allocate, so after
+ * growing it carries on from there instead of scanning from byte 0.
+ */
+int json_parse(json_arena_t *arena, const char *js, size_t len) {
+	jsmn_parser parser;
+	jsmnerr_t r;
+
+	arena->count = 0;
+	if (arena->size == 0 && json_arena_grow(arena) < 0) {
+		return JSMN_ERROR_NOMEM;
+	}
+
+	jsmn_init(&parser);
+	while ((r = jsmn_parse(&parser, js, len, arena->tokens, arena->size)) == JSMN_ERROR_NOMEM) {
+		if (json_arena_grow(arena) < 0) {
+			return JSMN_ERROR_NOMEM;
+		}
+	}
+	if (r < 0) {
+		return r;
+	}
+
+	/* jsmn counts only the tokens of its last call */
+	arena->count = parser.toknext;
+	return arena->count;
+}
+
+int json_equal(const char *js, const jsmntok_t *t, const char *s) {
+	size_t len = strlen(s);
+
+	return t->type == JSMN_STRING && (size_t)(t->end - t->start) == len &&
+			!strncmp(js + t->start, s, len);
+}
+
+void json_stream_init(json_stream_t *stream, json_arena_t *arena, const char *array_key,
+		json_element_fn element, void *arg) {
+	stream->arena = arena;
+	stream->arena->count = 0;
+	jsmn_init(&stream->parser);
+	stream->array_key = array_key;
+	stream->array = -1;
+	stream->next = 0;
+	stream->element = element;
+	stream->arg = arg;
+}
+
+/**
+ * Reports the elements of the array which closed since the last call.
+ */
+static void json_stream_report(json_stream_t *stream, const char *js) {
+	jsmntok_t *t = stream->arena->tokens;
+	int count = stream->parser.toknext;
+	int el, i;
+
+	if (stream->array < 0) {
+		/* the array token follows its key */
+		for (i = stream->next; i + 1 < count; i++) {
+			if (t[i].size == 1 && t[i + 1].type == JSMN_ARRAY &&
+					json_equal(js, &t[i], stream->array_key)) {
+				stream->array = i + 1;
+				stream->next = i + 2;
+				break;
+			}
+		}
+		if (stream->array < 0) {
+			stream->next = count > 0 ? count - 1 : 0;
+			return;
+		}
+	}
+
+	/* until the array closes, every new token is inside it */
+	while (stream->next < count && (t[stream->array].end == -1 ||
+			t[stream->next].start < t[stream->array].end)) {
+		el = stream->next;
+		if (t[el].end == -1) {
+			break;
+		}
+		/* all children of a closed element exist */
+		for (i = el + 1; i < count && t[i].start < t[el].end; i++)
+			;
+		stream->element(stream->arg, js, &t[el], i - el);
+		stream->next = i;
+	}
+}
+
+/**
+ * A primitive cut by the end of the data would be taken for a complete
+ * one, so jsmn only gets the bytes up to the last delimiter.
+ */
+int json_stream_feed(json_stream_t *stream, const char *js, size_t len) {
+	json_arena_t *arena = stream->arena;
+	jsmnerr_t r;
+
+	/* whatever follows the document is not parsed */
+	if (arena->count > 0 && arena->tokens[0].end != -1) {
+		return 1;
+	}
+	while (len > stream->parser.pos && !strchr("\t\r\n ,:[]{}\"", js[len - 1]))
+		len--;
+	if (len <= stream->parser.pos) {
+		return 0;
+	}
+
+	if (arena->size == 0 && json_arena_grow(arena) < 0) {
+		return JSMN_ERROR_NOMEM;
+	}
+	while ((r = jsmn_parse(&stream->parser, js, len, arena->tokens, arena->size)) == JSMN_ERROR_NOMEM) {
+		if (json_arena_grow(arena) < 0) {
+			return JSMN_ERROR_NOMEM;
+		}
+	}
+	if (r < 0 && r != JSMN_ERROR_PART) {
+		return r;
+	}
+
+	arena->count = stream->parser.toknext;
+	json_stream_report(stream, js);
+	return (arena->count > 0 && arena->tokens[0].end != -1) ? 1 : 0;
+}
+
+int json_path_compile(json_path_t *path, const char *expr) {
+	const char *p = expr;
+	json_step_t *step;
+
+	path->count = 0;
+	while (*p != '\0') {
+		if (path->count == JSON_PATH_MAX) {
+			return -1;
+		}
+		step = &path->steps[path->count++];
+		if (*p == '[') {
+			step->key = NULL;
+			step->len = 0;
+			if (p[1] == '*' && p[2] == ']') {
+				step->index = JSON_PATH_ANY;
+				p += 3;
+			} else {
+				char *end;
+				long index = strtol(p + 1, &end, 10);
+				if (end == p + 1 || *end != ']' || index < 0 || index > INT_MAX) {
+					return -1;
+				}
+				step->index = (int)index;
+				p = end + 1;
+			}
+		} else {
+			step->key = p;
+			step->len = strcspn(p, ".[");
+			step->index = 0;
+			if (step->len == 0) {
+				return -1;
+			}
+			p += step->len;
+		}
+		if (*p == '.') {
+			p++;
+			if (*p == '\0' || *p == '.' || *p == '[') {
+				return -1;
+			}
+		}
+	}
+	return path->count > 0 ? 0 : -1;
+}
+
+/**
+ * Returns the token after the value at i and all of its children. Every
+ * token stands for itself and opens size more, keys have their value as
+ * child.
+ */
+static int json_skip(const jsmntok_t *t, int i, int count) {
+	int open = 1;
+
+	for (; open > 0 && i < count; i++) {
+		open += t[i].size - 1;
+	}
+	return i;
+}
+
+static int json_walk(const json_path_t *path, int depth, const char *js,
+		const jsmntok_t *t, int i, int count, json_match_fn match, void *arg) {
+	const json_step_t *step;
+	int n, j, k, found = 0;
+
+	if (depth == path->count) {
+		match(arg, js, &t[i]);
+		return 1;
+	}
+
+	step = &path->steps[depth];
+	n = t[i].size;
+	j = i + 1;
+	if (step->key != NULL) {
+		if (t[i].type != JSMN_OBJECT) {
+			return 0;
+		}
+		for (k = 0; k < n && j + 1 < count; k++) {
+			/* the length rules out most keys without touching their bytes */
+			if (t[j].type == JSMN_STRING && (size_t)(t[j].end - t[j].start) == step->len &&
+					!memcmp(js + t[j].start, step->key, step->len)) {
+				return json_walk(path, depth + 1, js, t, j + 1, count, match, arg);
+			}
+			j = json_skip(t, j, count);
+		}
+	} else {
+		if (t[i].type != JSMN_ARRAY) {
+			return 0;
+		}
+		for (k = 0; k < n && j < count; k++) {
+			if (step->index == JSON_PATH_ANY || step->index == k) {
+				found += json_walk(path, depth + 1, js, t, j, count, match, arg);
+				if (step->index == k) {
+					break;
+				}
+			}
+			j = json_skip(t, j, count);
+		}
+	}
+	return found;
+}
+
+int json_query(const json_path_t *path, const char *js, const jsmntok_t *tokens, int count,
+		json_match_fn match, void *arg) {
+	if (count < 1) {
+		return 0;
+	}
+	return json_walk(path, 0, js, tokens, 0, count, match, arg);
+}
+
+static void json_match_view(void *arg, const char *js, const jsmntok_t *t) {
+	json_view_t *view = (json_view_t *)arg;
+
+	if (view->ptr == NULL) {
+		view->ptr = js + t->start;
+		view->len = t->end - t->start;
+	}
+}
+
+int json_query_view(const json_path_t *path, const char *js, const jsmntok_t *tokens, int count,
+		json_view_t *view) {
+	view->ptr = NULL;
+	view->len = 0;
+	json_query(path, js, tokens, count, json_match_view, view);
+	return view->ptr != NULL ? 0 : -1;
+}
+
+int json_view_equal(const json_view_t *view, const char *s) {
+	size_t len = strlen(s);
+
+	return view->ptr != NULL && view->len == len && !memcmp(view->ptr, s, len);
+}
+
+int json_view_copy(const json_view_t *view, char *buf, size_t size) {
+	if (view->ptr == NULL || view->len >= size) {
+		return -1;
+	}
+	memcpy(buf, view->ptr, view->len);
+	buf[view->len] = '\0';
+	return 0;
+}
+
+int json_view_int(const json_view_t *view, int *number) {
+	const char *p = view->ptr;
+	const char *end = p + view->len;
+	long long value = 0;
+	int negative = 0;
+
+	if (p == NULL || p == end) {
+		return -1;
+	}
+	if (*p == '-') {
+		negative = 1;
+		p++;
+	}
+	if (p == end) {
+		return -1;
+	}
+	for (; p < end; p++) {
+		if (*p < '0' || *p > '9') {
+			return -1;
+		}
+		value = value * 10 + (*p - '0');
+		if (value > (long long)INT_MAX + negative) {
+			return -1;
+		}
+	}
+	*number = (int)(negative ? -value : value);
+	return 0;
+}
@@ -0,0 +1,160 @@
+#ifndef __JSON_H_
+#define __JSON_H_
+
+#include "jsmn.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JSON_ARENA_INIT		64		/* tokens of a fresh arena */
+#define JSON_ARENA_MAX		(1 << 20)	/* a document needing more is rejected with JSMN_ERROR_NOMEM */
+#define JSON_PATH_MAX		8		/* steps of a compiled path */
+#define JSON_PATH_ANY		-1		/* step index of [*] */
+
+/**
+ * Token arena reused across parses. It only grows, so once it fits the
+ * largest document seen, parsing allocates nothing.
+ * @param		tokens	tokens of the last parse
+ * @param		size	tokens allocated
+ * @param		count	tokens filled by the last parse
+ */
+typedef struct {
+	jsmntok_t *tokens;
+	unsigned int size;
+	unsigned int count;
+} json_arena_t;
+
+/**
+ * Create an empty arena, tokens are allocated by the first parse
+ */
+void json_arena_init(json_arena_t *arena);
+
+/**
+ * Release the tokens of an arena
+ */
+void json_arena_free(json_arena_t *arena);
+
+/**
+ * Parse a JSON string into the arena. When jsmn runs out of tokens the
+ * arena is grown geometrically and jsmn resumes where it stopped.
+ * Returns the number of tokens, or a jsmnerr_t on error.
+ */
+int json_parse(json_arena_t *arena, const char *js, size_t len);
+
+/**
+ * Called with an element of the streamed array once it is complete,
+ * tokens[0] is the element and the rest of its count tokens its children.
+ */
+typedef void (*json_element_fn)(void *arg, const char *js, const jsmntok_t *tokens, int count);
+
+/**
+ * Incremental parse of a document arriving in chunks. Elements of the
+ * first array stored under array_key are reported as soon as they close.
+ * @param		arena		tokens, owned by the caller
+ * @param		array		token of the array, -1 until it is seen
+ * @param		next		token of the next element, or where to look for the array
+ */
+typedef struct {
+	json_arena_t *arena;
+	jsmn_parser parser;
+	const char *array_key;
+	int array;
+	int next;
+	json_element_fn element;
+	void *arg;
+} json_stream_t;
+
+/**
+ * Start a stream, the arena is reused as is
+ */
+void json_stream_init(json_stream_t *stream, json_arena_t *arena, const char *array_key,
+		json_element_fn element, void *arg);
+
+/**
+ * Parse the bytes of the document which arrived since the last call. js
+ * is the start of the document and len the bytes available so far, js may
+ * move between calls. Returns 1 once the document is complete, 0 while
+ * more bytes are needed, or a jsmnerr_t on error.
+ */
+int json_stream_feed(json_stream_t *stream, const char *js, size_t len);
+
+/**
+ * Compare a string token with s
+ */
+int json_equal(const char *js, const jsmntok_t *t, const char *s);
+
+/**
+ * One step of a path, an object member or an array element
+ * @param		key		member name, NULL for an array step
+ * @param		len		length of key
+ * @param		index	element of an array step, or JSON_PATH_ANY
+ */
+typedef struct {
+	const char *key;
+	size_t len;
+	int index;
+} json_step_t;
+
+/**
+ * Compiled path such as messageBody.directives[*].namespace. The keys
+ * point into the expression, which must outlive the path.
+ */
+typedef struct {
+	json_step_t steps[JSON_PATH_MAX];
+	int count;
+} json_path_t;
+
+/**
+ * Bytes of a value in the source buffer, strings without their quotes
+ */
+typedef struct {
+	const char *ptr;
+	size_t len;
+} json_view_t;
+
+/**
+ * Called for each value a path matches
+ */
+typedef void (*json_match_fn)(void *arg, const char *js, const jsmntok_t *t);
+
+/**
+ * Compile a path expression. Returns 0, or -1 if it is malformed or too long.
+ */
+int json_path_compile(json_path_t *path, const char *expr);
+
+/**
+ * Walk the values under tokens[0] matched by path, calling match for each.
+ * Only the members on the path are compared, the rest are skipped whole.
+ * Returns the number of matches.
+ */
+int json_query(const json_path_t *path, const char *js, const jsmntok_t *tokens, int count,
+		json_match_fn match, void *arg);
+
+/**
+ * First value matched by path. Returns 0, or -1 if nothing matched.
+ */
+int json_query_view(const json_path_t *path, const char *js, const jsmntok_t *tokens, int count,
+		json_view_t *view);
+
+/**
+ * Compare a view with s
+ */
+int json_view_equal(const json_view_t *view, const char *s);
+
+/**
+ * Copy a view into a NUL terminated buffer. Returns 0, or -1 if it does not fit.
+ */
+int json_view_copy(const json_view_t *view, char *buf, size_t size);
+
+/**
+ * Parse a view holding a decimal integer. Returns 0, or -1 if it is not
+ * one or overflows an int.
+ */
+int json_view_int(const json_view_t *view, int *number);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __JSON_H_ */
@@ -0,0 +1,555 @@
+/*
+ * Copyright (c) 2016 Trung Huynh
+ * All rights reserved
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <set>
+#include <vector>
+#include <atomic>
+
+#include "net.h"
+#include "trace.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+enum net_op_type {
+    NET_ADD = 0,
+    NET_CANCEL
+};
+
+typedef struct net_op
+{
+    net_op_type type;
+    CURL *curl;
+    net_done_fn done;
+    void *arg;
+}net_op_t;
+
+static CURLM *net_multi;
+static pthread_t net_thread;
+static pthread_mutex_t net_mutex;
+static std::vector<net_op_t> net_queue;         // guarded by net_mutex, drained by the network thread
+static std::atomic<bool> net_running(false);
+static std::set<CURL *> net_active;             // network thread only
+static std::atomic<CURL *> net_resumes[NET_RESUME_SLOTS];   // filled by any thread, emptied by the network thread
+static std::set<CURL *> net_paused_set;         // network thread only, waiting for a resume or the backstop
+static long net_backstop_at;                    // mili-seconds, when net_paused_set is unpaused anyway
+
+static long net_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* How long the loop may sleep, -1 for as long as it takes */
+static long net_sleep(void)
+{
+    long left;
+
+    if (net_paused_set.empty())
+        return -1;
+    left = net_backstop_at - net_now();
+    return left > 0 ? left : 0;
+}
+
+#ifdef __linux__
+static int net_epoll = -1;
+static int net_event = -1;                      // written by other threads to wake the loop
+static int net_timer = -1;                      // armed with curl's next timeout
+
+static int net_socket(CURL *curl, curl_socket_t s, int what, void *userp, void *socketp)
+{
+    struct epoll_event ev;
+
+    (void)curl;
+    (void)userp;
+    if (what == CURL_POLL_REMOVE)
+    {
+        if (socketp != NULL)
+            epoll_ctl(net_epoll, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(net_multi, s, NULL);
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    if (what & CURL_POLL_IN)
+        ev.events |= EPOLLIN;
+    if (what & CURL_POLL_OUT)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = s;
+    if (epoll_ctl(net_epoll, socketp != NULL ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s, &ev) < 0 &&
+            !(errno == EEXIST && epoll_ctl(net_epoll, EPOLL_CTL_MOD, s, &ev) == 0))
+    {
+        fprintf(stderr, "Watch socket %d failed\n", (int)s);
+        return -1;
+    }
+    /* any non-NULL pointer marks the socket as known to epoll */
+    curl_multi_assign(net_multi, s, &net_epoll);
+    return 0;
+}
+
+static int net_timeout(CURLM *multi, long timeout_ms, void *userp)
+{
+    struct itimerspec its;
+
+    (void)multi;
+    (void)userp;
+    memset(&its, 0, sizeof(its));
+    if (timeout_ms == 0)
+    {
+        its.it_value.tv_nsec = 1;   // a zero value would disarm the timer
+    }
+    else if (timeout_ms > 0)
+    {
+        its.it_value.tv_sec = timeout_ms / 1000;
+        its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+    }
+    timerfd_settime(net_timer, 0, &its, NULL);
+    return 0;
+}
+
+static void net_wake(void)
+{
+    uint64_t one = 1;
+
+    if (write(net_event, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "Wake network thread failed\n");
+}
+#else
+static void net_wake(void)
+{
+    curl_multi_wakeup(net_multi);
+}
+#endif
+
+static void net_finish(CURL *curl, CURLcode result)
+{
+    net_op_t *op = NULL;
+
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&op);
+    curl_multi_remove_handle(net_multi, curl);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
+    net_active.erase(curl);
+    net_paused_set.erase(curl);
+
+    op->done(op->arg, curl, result);
+    free(op);
+}
+
+static void net_unpause(CURL *curl)
+{
+    net_paused_set.erase(curl);
+    curl_easy_pause(curl, CURLPAUSE_CONT);
+}
+
+/* Returns 1 if a transfer was resumed and curl has to look at it again.
+ * Resumes and cancels may come in after their transfer finished. */
+static int net_apply(void)
+{
+    std::vector<net_op_t> ops;
+    std::set<CURL *> stale;
+    std::set<CURL *>::iterator it;
+    CURL *curl;
+    size_t i;
+    int resumed = 0;
+
+    for (i = 0; i < NET_RESUME_SLOTS; i++)
+    {
+        if (net_resumes[i].load() != NULL && (curl = net_resumes[i].exchange(NULL)) != NULL &&
+                net_active.count(curl))
+        {
+            net_unpause(curl);
+            trace_instant("net_resume");
+            resumed = 1;
+        }
+    }
+    /* a lost or dropped resume costs at most the backstop */
+    if (!net_paused_set.empty() && net_sleep() == 0)
+    {
+        /* unpausing may run the read callback, which can pause again */
+        stale.swap(net_paused_set);
+        for (it = stale.begin(); it != stale.end(); ++it)
+            curl_easy_pause(*it, CURLPAUSE_CONT);
+        trace_instant("net_backstop");
+        resumed = 1;
+    }
+
+    pthread_mutex_lock(&net_mutex);
+    ops.swap(net_queue);
+    pthread_mutex_unlock(&net_mutex);
+
+    for (i = 0; i < ops.size(); i++)
+    {
+        net_op_t *op;
+
+        if (ops[i].type == NET_CANCEL)
+        {
+            if (net_active.count(ops[i].curl))
+                net_finish(ops[i].curl, CURLE_ABORTED_BY_CALLBACK);
+            continue;
+        }
+
+        op = (net_op_t *)malloc(sizeof(net_op_t));
+        if (op == NULL)
+        {
+            ops[i].done(ops[i].arg, ops[i].curl, CURLE_OUT_OF_MEMORY);
+            continue;
+        }
+        *op = ops[i];
+        curl_easy_setopt(op->curl, CURLOPT_PRIVATE, op);
+        if (curl_multi_add_handle(net_multi, op->curl) != CURLM_OK)
+        {
+            curl_easy_setopt(op->curl, CURLOPT_PRIVATE, NULL);
+            op->done(op->arg, op->curl, CURLE_FAILED_INIT);
+            free(op);
+            continue;
+        }
+        net_active.insert(op->curl);
+    }
+    return resumed;
+}
+
+static void net_complete(void)
+{
+    CURLMsg *msg;
+    CURL *curl;
+    CURLcode result;
+    int left;
+
+    while ((msg = curl_multi_info_read(net_multi, &left)) != NULL)
+    {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        /* msg goes away with the handle */
+        curl = msg->easy_handle;
+        result = msg->data.result;
+        net_finish(curl, result);
+    }
+}
+
+/* Fails whatever is left when the thread stops, so no waiter hangs */
+static void net_abort(void)
+{
+    std::vector<CURL *> active(net_active.begin(), net_active.end());
+    size_t i;
+
+    for (i = 0; i < active.size(); i++)
+        net_finish(active[i], CURLE_ABORTED_BY_CALLBACK);
+
+    pthread_mutex_lock(&net_mutex);
+    std::vector<net_op_t> ops;
+    ops.swap(net_queue);
+    pthread_mutex_unlock(&net_mutex);
+    for (i = 0; i < ops.size(); i++)
+    {
+        if (ops[i].type == NET_ADD)
+            ops[i].done(ops[i].arg, ops[i].curl, CURLE_ABORTED_BY_CALLBACK);
+    }
+}
+
+#ifdef __linux__
+static void *net_loop(void *arg)
+{
+    struct epoll_event events[NET_EVENTS_MAX];
+    uint64_t count;
+    int n, i, still;
+
+    (void)arg;
+    trace_thread_name("net");
+    while (net_running)
+    {
+        n = epoll_wait(net_epoll, events, NET_EVENTS_MAX, (int)net_sleep());
+        for (i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+
+            if (fd == net_event)
+            {
+                if (read(net_event, &count, sizeof(count)) > 0 && net_apply())
+                    curl_multi_socket_action(net_multi, CURL_SOCKET_TIMEOUT, 0, &still);
+            }
+            else if (fd == net_timer)
+            {
+                if (read(net_timer, &count, sizeof(count)) > 0)
+                    curl_multi_socket_action(net_multi, CURL_SOCKET_TIMEOUT, 0, &still);
+            }
+            else
+            {
+                int flags = 0;
+
+                if (events[i].events & EPOLLIN)
+                    flags |= CURL_CSELECT_IN;
+                if (events[i].events & EPOLLOUT)
+                    flags |= CURL_CSELECT_OUT;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    flags |= CURL_CSELECT_ERR;
+                curl_multi_socket_action(net_multi, fd, flags, &still);
+            }
+        }
+        /* the backstop is due, even if the eventfd stayed quiet */
+        if (!net_paused_set.empty() && net_sleep() == 0 && net_apply())
+            curl_multi_socket_action(net_multi, CURL_SOCKET_TIMEOUT, 0, &still);
+        net_complete();
+    }
+    net_abort();
+    return NULL;
+}
+
+static int net_init(void)
+{
+    struct epoll_event ev;
+
+    net_epoll = epoll_create1(EPOLL_CLOEXEC);
+    net_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    net_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (net_epoll < 0 || net_event < 0 || net_timer < 0)
+        return 1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = net_event;
+    if (epoll_ctl(net_epoll, EPOLL_CTL_ADD, net_event, &ev) < 0)
+        return 1;
+    ev.data.fd = net_timer;
+    if (epoll_ctl(net_epoll, EPOLL_CTL_ADD, net_timer, &ev) < 0)
+        return 1;
+
+    curl_multi_setopt(net_multi, CURLMOPT_SOCKETFUNCTION, net_socket);
+    curl_multi_setopt(net_multi, CURLMOPT_TIMERFUNCTION, net_timeout);
+    return 0;
+}
+
+static void net_close(void)
+{
+    if (net_timer >= 0)
+        close(net_timer);
+    if (net_event >= 0)
+        close(net_event);
+    if (net_epoll >= 0)
+        close(net_epoll);
+    net_epoll = net_event = net_timer = -1;
+}
+#else
+static void *net_loop(void *arg)
+{
+    int still;
+
+    (void)arg;
+    trace_thread_name("net");
+    while (net_running)
+    {
+        net_apply();
+        curl_multi_perform(net_multi, &still);
+        net_complete();
+        curl_multi_poll(net_multi, NULL, 0, (int)(net_paused_set.empty() ? NET_POLL_TIMEOUT : net_sleep()), NULL);
+    }
+    net_abort();
+    return NULL;
+}
+
+static int net_init(void)
+{
+    return 0;
+}
+
+static void net_close(void)
+{
+}
+#endif
+
+int net_start(void)
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    net_multi = curl_multi_init();
+    if (net_multi == NULL)
+    {
+        fprintf(stderr, "Create multi handle failed\n");
+        return 1;
+    }
+    /* HTTP/2 transfers to one host run as streams of a single connection */
+    curl_multi_setopt(net_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    if (net_init())
+    {
+        fprintf(stderr, "Init network event loop failed\n");
+        goto __ERROR;
+    }
+
+    pthread_mutex_init(&net_mutex, NULL);
+    net_running = true;
+    if (pthread_create(&net_thread, NULL, net_loop, NULL))
+    {
+        fprintf(stderr, "Create network thread failed\n");
+        net_running = false;
+        pthread_mutex_destroy(&net_mutex);
+        goto __ERROR;
+    }
+    return 0;
+
+__ERROR:
+    net_close();
+    curl_multi_cleanup(net_multi);
+    net_multi = NULL;
+    return 1;
+}
+
+void net_stop(void)
+{
+    if (net_multi == NULL)
+        return;
+
+    pthread_mutex_lock(&net_mutex);
+    net_running = false;
+    pthread_mutex_unlock(&net_mutex);
+    net_wake();
+    pthread_join(net_thread, NULL);
+
+    pthread_mutex_destroy(&net_mutex);
+    net_close();
+    curl_multi_cleanup(net_multi);
+    net_multi = NULL;
+}
+
+int net_submit(CURL *curl, net_done_fn done, void *arg)
+{
+    net_op_t op = {NET_ADD, curl, done, arg};
+
+    if (net_multi == NULL)
+        return 1;
+
+    pthread_mutex_lock(&net_mutex);
+    if (!net_running)
+    {
+        pthread_mutex_unlock(&net_mutex);
+        return 1;
+    }
+    net_queue.push_back(op);
+    pthread_mutex_unlock(&net_mutex);
+    net_wake();
+    return 0;
+}
+
+static void net_control(net_op_type type, CURL *curl)
+{
+    net_op_t op = {type, curl, NULL, NULL};
+
+    if (net_multi == NULL)
+        return;
+
+    pthread_mutex_lock(&net_mutex);
+    if (net_running)
+        net_queue.push_back(op);
+    pthread_mutex_unlock(&net_mutex);
+    net_wake();
+}
+
+void net_resume(CURL *curl)
+{
+    CURL *empty;
+    int i;
+
+    if (net_multi == NULL || !net_running)
+        return;
+    for (i = 0; i < NET_RESUME_SLOTS; i++)
+    {
+        empty = NULL;
+        if (net_resumes[i].compare_exchange_strong(empty, curl) || empty == curl)
+            break;
+    }
+    /* with every slot taken, the backstop unpauses it */
+    net_wake();
+}
+
+void net_paused(CURL *curl)
+{
+    if (net_paused_set.empty())
+        net_backstop_at = net_now() + NET_PAUSE_BACKSTOP;
+    net_paused_set.insert(curl);
+}
+
+void net_cancel(CURL *curl)
+{
+    net_control(NET_CANCEL, curl);
+}
+
+static void net_wait_done(void *arg, CURL *curl, CURLcode result)
+{
+    net_wait_t *wait = (net_wait_t *)arg;
+
+    (void)curl;
+    pthread_mutex_lock(&wait->mutex);
+    wait->result = result;
+    wait->done = 1;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->mutex);
+}
+
+int net_submit_wait(CURL *curl, net_wait_t *wait)
+{
+    pthread_mutex_init(&wait->mutex, NULL);
+    pthread_cond_init(&wait->cond, NULL);
+    wait->done = 0;
+    wait->result = CURLE_FAILED_INIT;
+
+    if (net_submit(curl, net_wait_done, wait))
+    {
+        wait->done = 1;
+        return 1;
+    }
+    return 0;
+}
+
+CURLcode net_wait(net_wait_t *wait)
+{
+    pthread_mutex_lock(&wait->mutex);
+    while (!wait->done)
+        pthread_cond_wait(&wait->cond, &wait->mutex);
+    pthread_mutex_unlock(&wait->mutex);
+
+    pthread_cond_destroy(&wait->cond);
+    pthread_mutex_destroy(&wait->mutex);
+    return wait->result;
+}
+
+int net_wait_for(net_wait_t *wait, long ms)
+{
+    struct timespec ts;
+    int done;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&wait->mutex);
+    while (!wait->done && pthread_cond_timedwait(&wait->cond, &wait->mutex, &ts) == 0)
+        ;
+    done = wait->done;
+    pthread_mutex_unlock(&wait->mutex);
+    return done;
+}
+
+CURLcode net_perform(CURL *curl)
+{
+    net_wait_t wait;
+
+    net_submit_wait(curl, &wait);
+    return net_wait(&wait);
+}
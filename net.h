@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2016 Trung Huynh
+ * All rights reserved
+ */
+
+#ifndef __NET_H__
+#define __NET_H__
+
+#include <pthread.h>
+#include <curl/curl.h>
+
+#define NET_EVENTS_MAX          16     // epoll events handled per wakeup
+#define NET_POLL_TIMEOUT        1000   // mili-seconds, curl_multi_poll() where there is no epoll
+#define NET_RESUME_SLOTS        8      // resumes in flight to the network thread
+#define NET_PAUSE_BACKSTOP      100    // mili-seconds, a paused transfer is looked at again at the latest
+
+/* Runs on the network thread once a transfer is over, the handle is the caller's again */
+typedef void (*net_done_fn)(void *arg, CURL *curl, CURLcode result);
+
+/* Completion of a transfer another thread waits for, see net_submit_wait() */
+typedef struct net_wait
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;
+    CURLcode result;
+}net_wait_t;
+
+/*
+ * Every transfer of the process runs on one network thread, which drives a
+ * curl multi handle from epoll. Other threads hand it configured easy
+ * handles and hear back through completion callbacks. Callbacks of the
+ * transfers (read, write, done) run on the network thread and must not
+ * block, or every other transfer stalls with them.
+ */
+int  net_start(void);
+void net_stop(void);
+
+/* Queues a transfer. Returns 0, or 1 if the network thread is not running. */
+int  net_submit(CURL *curl, net_done_fn done, void *arg);
+
+/* Unpauses a transfer whose read callback returned CURL_READFUNC_PAUSE, safe from any thread.
+ * It neither locks nor allocates, so the audio callback may call it. */
+void net_resume(CURL *curl);
+
+/* Network thread, a read callback is about to return CURL_READFUNC_PAUSE. The
+ * transfer is unpaused after NET_PAUSE_BACKSTOP even if no net_resume() comes. */
+void net_paused(CURL *curl);
+
+/* Fails a transfer with CURLE_ABORTED_BY_CALLBACK, safe from any thread */
+void net_cancel(CURL *curl);
+
+/* net_submit() with a completion net_wait() collects. Returns 0, or 1 and
+ * then wait already holds CURLE_FAILED_INIT. */
+int  net_submit_wait(CURL *curl, net_wait_t *wait);
+CURLcode net_wait(net_wait_t *wait);
+
+/* Waits up to ms mili-seconds, 1 once the transfer is over and net_wait() returns at once */
+int  net_wait_for(net_wait_t *wait, long ms);
+
+/* net_submit() and wait for the result, for callers which cannot go on without it */
+CURLcode net_perform(CURL *curl);
+
+#endif // __NET_H__
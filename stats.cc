@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2016 Trung Huynh
+ * All rights reserved
+ */
+
+#include <time.h>
+
+#include <algorithm>
+
+#include <portaudio.h>
+
+#include "stats.h"
+
+audio_stats_t audio_stats;
+callback_stats_t callback_stats;
+request_stats_t request_stats;
+
+static uint64_t stats_t0;
+
+/* Counter values at the last warning, only touched by the warning thread */
+static uint64_t warn_time;
+static unsigned long warn_input_lost;
+static unsigned long warn_output_zero;
+static unsigned long warn_xruns;
+static unsigned long warn_partial_reads;
+
+static unsigned long stats_load(const std::atomic<unsigned long> *counter)
+{
+    return counter->load(std::memory_order_relaxed);
+}
+
+static double stats_seconds(const std::atomic<uint64_t> *last)
+{
+    uint64_t ns = last->load(std::memory_order_relaxed);
+    return ns ? (ns - stats_t0) / 1e9 : 0;
+}
+
+static unsigned long stats_xruns(void)
+{
+    return stats_load(&audio_stats.pa_input_underflows) + stats_load(&audio_stats.pa_input_overflows) +
+        stats_load(&audio_stats.pa_output_underflows) + stats_load(&audio_stats.pa_output_overflows);
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_init(void)
+{
+    stats_t0 = warn_time = stats_now();
+}
+
+void stats_count(std::atomic<unsigned long> *counter, unsigned long n, std::atomic<uint64_t> *last)
+{
+    counter->fetch_add(n, std::memory_order_relaxed);
+    if (last != NULL)
+        last->store(stats_now(), std::memory_order_relaxed);
+}
+
+void stats_high_water(std::atomic<long> *mark, long level)
+{
+    long old = mark->load(std::memory_order_relaxed);
+    while (level > old && !mark->compare_exchange_weak(old, level, std::memory_order_relaxed))
+        ;
+}
+
+void stats_xrun(unsigned long status_flags)
+{
+    if (status_flags & paInputUnderflow)
+        stats_count(&audio_stats.pa_input_underflows, 1, &audio_stats.last_xrun);
+    if (status_flags & paInputOverflow)
+        stats_count(&audio_stats.pa_input_overflows, 1, &audio_stats.last_xrun);
+    if (status_flags & paOutputUnderflow)
+        stats_count(&audio_stats.pa_output_underflows, 1, &audio_stats.last_xrun);
+    if (status_flags & paOutputOverflow)
+        stats_count(&audio_stats.pa_output_overflows, 1, &audio_stats.last_xrun);
+}
+
+static void stats_max(std::atomic<uint64_t> *max, uint64_t value)
+{
+    uint64_t old = max->load(std::memory_order_relaxed);
+    while (value > old && !max->compare_exchange_weak(old, value, std::memory_order_relaxed))
+        ;
+}
+
+void stats_request(uint64_t setup_us, uint64_t reply_us, int reused)
+{
+    request_stats.count.fetch_add(1, std::memory_order_relaxed);
+    if (reused)
+        request_stats.reused.fetch_add(1, std::memory_order_relaxed);
+    request_stats.setup_total_us.fetch_add(setup_us, std::memory_order_relaxed);
+    stats_max(&request_stats.setup_max_us, setup_us);
+    request_stats.reply_total_us.fetch_add(reply_us, std::memory_order_relaxed);
+    stats_max(&request_stats.reply_max_us, reply_us);
+    if (reply_us > 0)
+        request_stats.reply_recent[request_stats.reply_next.fetch_add(1, std::memory_order_relaxed) % STATS_REPLY_WINDOW]
+            .store(reply_us, std::memory_order_relaxed);
+}
+
+/* 95th percentile of the recent reply times in micro-seconds, 0 until there are STATS_REPLY_MIN */
+uint64_t stats_reply_p95(void)
+{
+    uint64_t recent[STATS_REPLY_WINDOW];
+    unsigned long i, n = request_stats.reply_next.load(std::memory_order_relaxed);
+
+    if (n < STATS_REPLY_MIN)
+        return 0;
+    if (n > STATS_REPLY_WINDOW)
+        n = STATS_REPLY_WINDOW;
+    for (i = 0; i < n; i++)
+        recent[i] = request_stats.reply_recent[i].load(std::memory_order_relaxed);
+    std::sort(recent, recent + n);
+    return recent[(n * 95 + 99) / 100 - 1];
+}
+
+/* A committed speculation queued bytes early, a cancelled one sent them for nothing */
+void stats_speculation(int committed, uint64_t bytes, uint64_t head_start_us)
+{
+    if (committed)
+    {
+        request_stats.committed.fetch_add(1, std::memory_order_relaxed);
+        request_stats.head_start_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        request_stats.head_start_us.fetch_add(head_start_us, std::memory_order_relaxed);
+    }
+    else
+        request_stats.wasted_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+/**
+ * Records one callback run. Lock-free and allocation free, as it is called
+ * at the end of every pa_stream_callback.
+ */
+void stats_callback(uint64_t start, uint64_t end, unsigned long frames, long rate, const char *state)
+{
+    uint64_t duration = end - start;
+    uint64_t budget = (uint64_t)frames * 1000000000ULL / rate;
+    unsigned long bucket = STATS_HIST_BUCKETS - 1;
+    int i, min;
+
+    callback_stats.count.fetch_add(1, std::memory_order_relaxed);
+    callback_stats.total_ns.fetch_add(duration, std::memory_order_relaxed);
+    if (duration > callback_stats.max_ns.load(std::memory_order_relaxed))
+        callback_stats.max_ns.store(duration, std::memory_order_relaxed);
+
+    if (budget > 0)
+    {
+        if (duration > budget)
+            callback_stats.deadline_misses.fetch_add(1, std::memory_order_relaxed);
+        if (duration * 100 / budget / STATS_HIST_STEP < bucket)
+            bucket = duration * 100 / budget / STATS_HIST_STEP;
+    }
+    callback_stats.hist[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    if (callback_stats.slowest_n == 0)
+        return;
+
+    for (i = 1, min = 0; i < callback_stats.slowest_n; i++)
+    {
+        if (callback_stats.slowest[i].duration < callback_stats.slowest[min].duration)
+            min = i;
+    }
+    if (duration > callback_stats.slowest[min].duration)
+    {
+        callback_stats.slowest[min].at = start;
+        callback_stats.slowest[min].duration = duration;
+        callback_stats.slowest[min].budget = budget;
+        callback_stats.slowest[min].frames = frames;
+        callback_stats.slowest[min].state = state;
+    }
+}
+
+/**
+ * Keeps the `n` slowest callbacks for stats_print(), up to STATS_SLOWEST_MAX,
+ * 0 or less keeps none. Call it before the stream starts.
+ */
+void stats_slowest(int n)
+{
+    if (n < 0)
+        n = 0;
+    callback_stats.slowest_n = (n > STATS_SLOWEST_MAX) ? STATS_SLOWEST_MAX : n;
+}
+
+/**
+ * Logs what went wrong since the previous warning, at most once per
+ * STATS_WARN_INTERVAL. Must always be called from the same non-real-time thread.
+ */
+void stats_warn(void)
+{
+    uint64_t now = stats_now();
+    unsigned long input_lost, output_zero, xruns, partial_reads;
+
+    if (now - warn_time < STATS_WARN_INTERVAL * 1000000ULL)
+        return;
+    warn_time = now;
+
+    input_lost = stats_load(&audio_stats.input_lost_samples);
+    output_zero = stats_load(&audio_stats.output_zero_samples);
+    xruns = stats_xruns();
+    partial_reads = stats_load(&audio_stats.partial_reads);
+
+    if (input_lost > warn_input_lost)
+        fprintf(stderr, "Lost %lu samples due to ring buffer overflow\n", input_lost - warn_input_lost);
+    if (output_zero > warn_output_zero)
+        fprintf(stderr, "Played %lu samples of silence due to ring buffer underflow\n", output_zero - warn_output_zero);
+    if (xruns > warn_xruns)
+        fprintf(stderr, "PortAudio reported %lu xruns\n", xruns - warn_xruns);
+    if (partial_reads > warn_partial_reads)
+        fprintf(stderr, "%lu ring buffer reads returned less than available\n", partial_reads - warn_partial_reads);
+
+    warn_input_lost = input_lost;
+    warn_output_zero = output_zero;
+    warn_xruns = xruns;
+    warn_partial_reads = partial_reads;
+}
+
+void stats_print(FILE *stream)
+{
+    unsigned long count;
+    int i;
+
+    fprintf(stream, "\n");
+    fprintf(stream, "Audio statistics (%.3f s):\n", (stats_now() - stats_t0) / 1e9);
+    fprintf(stream, "   Input overflows    : %lu (%lu samples lost, last at %.3f s)\n",
+            stats_load(&audio_stats.input_overflows), stats_load(&audio_stats.input_lost_samples),
+            stats_seconds(&audio_stats.last_input_overflow));
+    fprintf(stream, "   Output underflows  : %lu (%lu samples zero-filled, last at %.3f s)\n",
+            stats_load(&audio_stats.output_underflows), stats_load(&audio_stats.output_zero_samples),
+            stats_seconds(&audio_stats.last_output_underflow));
+    fprintf(stream, "   PortAudio xruns    : in-under %lu, in-over %lu, out-under %lu, out-over %lu (last at %.3f s)\n",
+            stats_load(&audio_stats.pa_input_underflows), stats_load(&audio_stats.pa_input_overflows),
+            stats_load(&audio_stats.pa_output_underflows), stats_load(&audio_stats.pa_output_overflows),
+            stats_seconds(&audio_stats.last_xrun));
+    fprintf(stream, "   Partial reads      : %lu (last at %.3f s)\n",
+            stats_load(&audio_stats.partial_reads), stats_seconds(&audio_stats.last_partial_read));
+    fprintf(stream, "   Ring high-water    : in %ld, out %ld samples\n",
+            audio_stats.in_ring_high_water.load(std::memory_order_relaxed),
+            audio_stats.out_ring_high_water.load(std::memory_order_relaxed));
+
+    count = stats_load(&callback_stats.count);
+    fprintf(stream, "   Callbacks          : %lu (mean %.1f us, max %.1f us, %lu deadline misses)\n", count,
+            count ? callback_stats.total_ns.load(std::memory_order_relaxed) / 1e3 / count : 0,
+            callback_stats.max_ns.load(std::memory_order_relaxed) / 1e3,
+            stats_load(&callback_stats.deadline_misses));
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+        unsigned long n = stats_load(&callback_stats.hist[i]);
+        if (n == 0)
+            continue;
+        if (i == STATS_HIST_BUCKETS - 1)
+            fprintf(stream, "      >= %3d%% of period: %lu\n", i * STATS_HIST_STEP, n);
+        else
+            fprintf(stream, "   %3d-%3d%% of period: %lu\n", i * STATS_HIST_STEP, (i + 1) * STATS_HIST_STEP, n);
+    }
+
+    /* Live dumps may show a sample the callback is rewriting */
+    for (i = 0; i < callback_stats.slowest_n; i++)
+    {
+        callback_sample_t *s = &callback_stats.slowest[i];
+        if (s->duration == 0)
+            continue;
+        fprintf(stream, "   Slow callback      : %.1f us of %.1f us budget, %lu frames, %s, at %.3f s\n",
+                s->duration / 1e3, s->budget / 1e3, s->frames, s->state ? s->state : "-",
+                (s->at - stats_t0) / 1e9);
+    }
+
+    count = stats_load(&request_stats.count);
+    fprintf(stream, "   Speech requests    : %lu (%lu on a connection already up, %lu warm-ups)\n", count,
+            stats_load(&request_stats.reused), stats_load(&request_stats.warmups));
+    if (count > 0)
+    {
+        fprintf(stream, "   Connection setup   : mean %.1f ms, max %.1f ms\n",
+                request_stats.setup_total_us.load(std::memory_order_relaxed) / 1e3 / count,
+                request_stats.setup_max_us.load(std::memory_order_relaxed) / 1e3);
+        fprintf(stream, "   First reply byte   : mean %.1f ms, max %.1f ms\n",
+                request_stats.reply_total_us.load(std::memory_order_relaxed) / 1e3 / count,
+                request_stats.reply_max_us.load(std::memory_order_relaxed) / 1e3);
+    }
+    count = stats_load(&request_stats.speculations);
+    if (count > 0)
+    {
+        unsigned long committed = stats_load(&request_stats.committed);
+
+        fprintf(stream, "   Speculative uploads: %lu (%lu committed, %.1f KB wasted by the others)\n", count,
+                committed, request_stats.wasted_bytes.load(std::memory_order_relaxed) / 1024.0);
+        if (committed > 0)
+            fprintf(stream, "   Head start         : mean %.1f ms, %.1f KB queued before the hot word\n",
+                    request_stats.head_start_us.load(std::memory_order_relaxed) / 1e3 / committed,
+                    request_stats.head_start_bytes.load(std::memory_order_relaxed) / 1024.0 / committed);
+    }
+    if (stats_load(&request_stats.hedges) > 0 || stats_load(&request_stats.retries) > 0)
+    {
+        fprintf(stream, "   Late or failed     : %lu hedged (%lu answered first), %lu retried, p95 reply %.1f ms\n",
+                stats_load(&request_stats.hedges), stats_load(&request_stats.hedge_wins),
+                stats_load(&request_stats.retries), stats_reply_p95() / 1e3);
+    }
+    fprintf(stream, "\n");
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2016 Trung Huynh
+ * All rights reserved
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#define STATS_WARN_INTERVAL     1000   // mili-seconds between two rate-limited warnings
+#define STATS_HIST_STEP         5      // width of a callback histogram bucket, in % of the buffer period
+#define STATS_HIST_BUCKETS      32     // the last bucket is open ended
+#define STATS_SLOWEST_MAX       16
+#define STATS_REPLY_WINDOW      32     // recent reply times the p95 is taken over
+#define STATS_REPLY_MIN         8      // replies needed before there is a p95
+
+/*
+ * Audio pipeline counters. They are updated with relaxed atomics, so the
+ * PortAudio callback can bump them without locking. Anything that prints
+ * them runs on a non-real-time thread.
+ */
+typedef struct audio_stats {
+    std::atomic<unsigned long> input_overflows;     // callbacks whose input did not fit the ring
+    std::atomic<unsigned long> input_lost_samples;
+    std::atomic<unsigned long> output_underflows;   // callbacks where playback ran dry
+    std::atomic<unsigned long> output_zero_samples;
+    std::atomic<unsigned long> pa_input_underflows; // statusFlags reported by PortAudio
+    std::atomic<unsigned long> pa_input_overflows;
+    std::atomic<unsigned long> pa_output_underflows;
+    std::atomic<unsigned long> pa_output_overflows;
+    std::atomic<unsigned long> partial_reads;       // ring reads returning less than available
+    std::atomic<long> in_ring_high_water;           // in samples
+    std::atomic<long> out_ring_high_water;
+
+    std::atomic<uint64_t> last_input_overflow;      // stats_now() of the last event, 0 if never
+    std::atomic<uint64_t> last_output_underflow;
+    std::atomic<uint64_t> last_xrun;
+    std::atomic<uint64_t> last_partial_read;
+}audio_stats_t;
+
+/*
+ * Execution time of pa_stream_callback against its buffer period
+ * (frameCount / sample rate). Only the callback writes here.
+ */
+typedef struct callback_sample {
+    uint64_t at;                // stats_now() when the callback started
+    uint64_t duration;          // nano-seconds
+    uint64_t budget;
+    unsigned long frames;
+    const char *state;          // input state while running
+}callback_sample_t;
+
+typedef struct callback_stats {
+    std::atomic<unsigned long> count;
+    std::atomic<unsigned long> deadline_misses;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<unsigned long> hist[STATS_HIST_BUCKETS];
+
+    int slowest_n;              // 0 disables the slowest callback log
+    callback_sample_t slowest[STATS_SLOWEST_MAX];
+}callback_stats_t;
+
+/*
+ * Speech request latency, from curl's timing of each transfer. A request
+ * which finds its connection already up spends nothing on setting it up.
+ */
+typedef struct request_stats {
+    std::atomic<unsigned long> count;
+    std::atomic<unsigned long> reused;          // went out on a connection which was up
+    std::atomic<unsigned long> warmups;         // connections opened ahead of a request
+    std::atomic<uint64_t> setup_total_us;       // DNS, TCP and TLS, or waiting for a warm-up to finish them
+    std::atomic<uint64_t> setup_max_us;
+    std::atomic<uint64_t> reply_total_us;       // end of the upload to the first byte of the reply
+    std::atomic<uint64_t> reply_max_us;
+    std::atomic<unsigned long> speculations;    // uploads started on the pre-trigger
+    std::atomic<unsigned long> committed;       // confirmed by the hot word
+    std::atomic<uint64_t> wasted_bytes;         // sent by the cancelled ones
+    std::atomic<uint64_t> head_start_us;        // pre-trigger to hot word of the committed ones
+    std::atomic<uint64_t> head_start_bytes;     // audio they had queued by the hot word
+    std::atomic<unsigned long> hedges;          // second requests for a reply which was late
+    std::atomic<unsigned long> hedge_wins;      // hedges answering before the request they hedged
+    std::atomic<unsigned long> retries;         // requests sent again after they failed
+
+    std::atomic<uint64_t> reply_recent[STATS_REPLY_WINDOW];  // micro-seconds, a ring of the last replies
+    std::atomic<unsigned long> reply_next;
+}request_stats_t;
+
+extern audio_stats_t audio_stats;
+extern callback_stats_t callback_stats;
+extern request_stats_t request_stats;
+
+void     stats_init(void);
+uint64_t stats_now(void);
+
+void stats_count(std::atomic<unsigned long> *counter, unsigned long n, std::atomic<uint64_t> *last);
+void stats_high_water(std::atomic<long> *mark, long level);
+void stats_xrun(unsigned long status_flags);
+void stats_callback(uint64_t start, uint64_t end, unsigned long frames, long rate, const char *state);
+void stats_slowest(int n);
+void stats_request(uint64_t setup_us, uint64_t reply_us, int reused);
+void stats_speculation(int committed, uint64_t bytes, uint64_t head_start_us);
+uint64_t stats_reply_p95(void);
+
+void stats_warn(void);
+void stats_print(FILE *stream);
+
+#endif // __STATS_H__
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2016 Trung Huynh
+ * All rights reserved
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <atomic>
+
+#include "trace.h"
+
+typedef struct trace_event
+{
+    const char *name;
+    uint64_t ts;        // nano-seconds since trace_open()
+    long value;
+    char phase;
+}trace_event_t;
+
+typedef struct trace_buf
+{
+    std::atomic<uint32_t> count;
+    uint32_t dropped;
+    const char *name;
+    trace_event_t *events;
+}trace_buf_t;
+
+static std::atomic<int> trace_on;
+static FILE *trace_fp;
+static uint64_t trace_t0;
+static trace_event_t *trace_events;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_buf_t trace_bufs[TRACE_MAX_THREADS];
+static int trace_nbufs;
+
+static __thread trace_buf_t *trace_self;
+
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static trace_buf_t *trace_bind(const char *name)
+{
+    trace_buf_t *buf = NULL;
+    int i;
+
+    pthread_mutex_lock(&trace_mutex);
+    for (i = 0; name != NULL && i < trace_nbufs; i++)
+    {
+        if (trace_bufs[i].name != NULL && !strcmp(trace_bufs[i].name, name))
+        {
+            buf = &trace_bufs[i];
+            break;
+        }
+    }
+    if (buf == NULL && trace_nbufs < TRACE_MAX_THREADS)
+    {
+        buf = &trace_bufs[trace_nbufs];
+        buf->name = name;
+        buf->events = trace_events + (size_t)trace_nbufs * TRACE_MAX_EVENTS;
+        trace_nbufs++;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+
+    trace_self = buf;
+    return buf;
+}
+
+static void trace_push(char phase, const char *name, long value)
+{
+    trace_buf_t *buf = trace_self;
+    trace_event_t *ev;
+    uint32_t n;
+
+    if (buf == NULL && (buf = trace_bind(NULL)) == NULL)
+        return;
+
+    n = buf->count.load(std::memory_order_relaxed);
+    if (n >= TRACE_MAX_EVENTS)
+    {
+        buf->dropped++;
+        return;
+    }
+
+    ev = &buf->events[n];
+    ev->name = name;
+    ev->ts = trace_now() - trace_t0;
+    ev->value = value;
+    ev->phase = phase;
+    buf->count.store(n + 1, std::memory_order_release);
+}
+
+int trace_open(const char *filename)
+{
+    trace_fp = fopen(filename, "w");
+    if (trace_fp == NULL)
+    {
+        fprintf(stderr, "Open trace file %s failed\n", filename);
+        return 1;
+    }
+
+    /* Pages are only touched by threads that actually record events */
+    trace_events = (trace_event_t *)calloc((size_t)TRACE_MAX_THREADS * TRACE_MAX_EVENTS, sizeof(trace_event_t));
+    if (trace_events == NULL)
+    {
+        fprintf(stderr, "Fail to allocate memory for trace buffers\n");
+        fclose(trace_fp);
+        trace_fp = NULL;
+        return 1;
+    }
+
+    trace_t0 = trace_now();
+    trace_on.store(1, std::memory_order_release);
+    return 0;
+}
+
+void trace_close(void)
+{
+    int i, pid = getpid();
+    uint32_t j, n;
+    const char *sep = "";
+
+    if (trace_fp == NULL)
+        return;
+    trace_on.store(0, std::memory_order_release);
+
+    fprintf(trace_fp, "{\"traceEvents\":[\n");
+    for (i = 0; i < trace_nbufs; i++)
+    {
+        trace_buf_t *buf = &trace_bufs[i];
+
+        fprintf(trace_fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", sep, pid, i + 1, buf->name ? buf->name : "thread");
+        sep = ",\n";
+
+        n = buf->count.load(std::memory_order_acquire);
+        for (j = 0; j < n; j++)
+        {
+            trace_event_t *ev = &buf->events[j];
+
+            fprintf(trace_fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+                    ev->name, ev->phase, pid, i + 1, ev->ts / 1000.0);
+            if (ev->phase == 'C')
+                fprintf(trace_fp, ",\"args\":{\"value\":%ld}", ev->value);
+            else if (ev->phase == 'i')
+                fprintf(trace_fp, ",\"s\":\"t\"");
+            fprintf(trace_fp, "}");
+        }
+
+        if (buf->dropped > 0)
+        {
+            fprintf(stderr, "Trace buffer of %s is full, %u events were dropped\n",
+                    buf->name ? buf->name : "thread", buf->dropped);
+        }
+    }
+    fprintf(trace_fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    fclose(trace_fp);
+    trace_fp = NULL;
+    free(trace_events);
+    trace_events = NULL;
+}
+
+void trace_thread_name(const char *name)
+{
+    if (!trace_on.load(std::memory_order_relaxed))
+        return;
+    if (trace_self != NULL && trace_self->name == name)
+        return;
+    trace_bind(name);
+}
+
+void trace_begin(const char *name)
+{
+    if (trace_on.load(std::memory_order_relaxed))
+        trace_push('B', name, 0);
+}
+
+void trace_end(const char *name)
+{
+    if (trace_on.load(std::memory_order_relaxed))
+        trace_push('E', name, 0);
+}
+
+void trace_instant(const char *name)
+{
+    if (trace_on.load(std::memory_order_relaxed))
+        trace_push('i', name, 0);
+}
+
+void trace_counter(const char *name, long value)
+{
+    if (trace_on.load(std::memory_order_relaxed))
+        trace_push('C', name, value);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2016 Trung Huynh
+ * All rights reserved
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * Chrome/Perfetto trace-event recorder.
+ *
+ * Every thread appends into its own preallocated event buffer, so recording
+ * never takes a lock and never allocates; when tracing is disabled each call
+ * is a single load and branch. Event names are stored by pointer and must be
+ * string literals. The buffers are serialized to JSON by trace_close(), after
+ * the audio stream and workers have been stopped.
+ */
+
+#define TRACE_MAX_THREADS       16
+#define TRACE_MAX_EVENTS        65536   // per thread, extra events are dropped
+
+int  trace_open(const char *filename);
+void trace_close(void);
+
+/* Binds the calling thread to the buffer called `name`. Threads that run one
+ * after another (like the per-request wav thread) share a buffer by name, so
+ * a name must not be used by two threads at the same time. */
+void trace_thread_name(const char *name);
+
+void trace_begin(const char *name);
+void trace_end(const char *name);
+void trace_instant(const char *name);
+void trace_counter(const char *name, long value);
+
+#endif // __TRACE_H__
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2016 Trung Huynh
+ * All rights reserved
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "watch.h"
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <limits.h>
+#include <sys/inotify.h>
+
+static int watch_fd = -1;
+static int watch_pipe[2] = {-1, -1};     // written by watch_stop() to wake the thread
+static char watch_dir[PATH_MAX];
+static const char *watch_name;
+static watch_fn watch_changed;
+static void *watch_arg;
+static pthread_t watch_thread;
+
+/* Returns 1 if one of the queued events touched the watched file */
+static int watch_drain(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *ptr;
+    int hit = 0;
+
+    while ((len = read(watch_fd, buf, sizeof(buf))) > 0)
+    {
+        for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (const struct inotify_event *)ptr;
+            if (ev->len > 0 && !strcmp(ev->name, watch_name))
+                hit = 1;
+        }
+    }
+    return hit;
+}
+
+static void *watch_loop(void *arg)
+{
+    struct pollfd fds[2];
+    int pending = 0;
+
+    (void)arg;
+    fds[0].fd = watch_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watch_pipe[0];
+    fds[1].events = POLLIN;
+
+    while (1)
+    {
+        int n = poll(fds, 2, pending ? WATCH_SETTLE : -1);
+        if (n < 0)
+            continue;
+        if (fds[1].revents)
+            break;
+
+        if (n == 0)
+        {
+            /* quiet for WATCH_SETTLE, the file is complete */
+            pending = 0;
+            watch_changed(watch_arg);
+        }
+        else if (fds[0].revents && watch_drain())
+        {
+            pending = 1;
+        }
+    }
+    return NULL;
+}
+
+int watch_start(const char *filename, watch_fn changed, void *arg)
+{
+    const char *slash = strrchr(filename, '/');
+
+    if (slash != NULL)
+    {
+        snprintf(watch_dir, sizeof(watch_dir), "%.*s", (int)(slash - filename + 1), filename);
+        watch_name = slash + 1;
+    }
+    else
+    {
+        strcpy(watch_dir, ".");
+        watch_name = filename;
+    }
+    watch_changed = changed;
+    watch_arg = arg;
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0)
+    {
+        fprintf(stderr, "Init inotify failed\n");
+        return 1;
+    }
+    if (inotify_add_watch(watch_fd, watch_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+    {
+        fprintf(stderr, "Watch %s failed\n", watch_dir);
+        goto __ERROR;
+    }
+    if (pipe(watch_pipe) < 0)
+    {
+        fprintf(stderr, "Create watch pipe failed\n");
+        goto __ERROR;
+    }
+    if (pthread_create(&watch_thread, NULL, watch_loop, NULL))
+    {
+        fprintf(stderr, "Create watch thread failed\n");
+        close(watch_pipe[0]);
+        close(watch_pipe[1]);
+        watch_pipe[0] = watch_pipe[1] = -1;
+        goto __ERROR;
+    }
+    return 0;
+
+__ERROR:
+    close(watch_fd);
+    watch_fd = -1;
+    return 1;
+}
+
+void watch_stop(void)
+{
+    if (watch_fd < 0)
+        return;
+
+    if (write(watch_pipe[1], "", 1) != 1)
+        fprintf(stderr, "Wake watch thread failed\n");
+    pthread_join(watch_thread, NULL);
+
+    close(watch_pipe[0]);
+    close(watch_pipe[1]);
+    close(watch_fd);
+    watch_pipe[0] = watch_pipe[1] = watch_fd = -1;
+}
+
+#else
+
+int watch_start(const char *filename, watch_fn changed, void *arg)
+{
+    (void)changed;
+    (void)arg;
+    fprintf(stderr, "Hot reload of %s needs inotify, it is disabled on this platform\n", filename);
+    return 1;
+}
+
+void watch_stop(void)
+{
+}
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2016 Trung Huynh
+ * All rights reserved
+ */
+
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#define WATCH_SETTLE            100    // mili-seconds without events before a change is reported
+
+typedef void (*watch_fn)(void *arg);
+
+/*
+ * Watches a file from a background thread and calls `changed` on that
+ * thread once writes to it settle. Editors and the config writer replace
+ * the file by renaming, so the directory is watched rather than the inode.
+ */
+int  watch_start(const char *filename, watch_fn changed, void *arg);
+void watch_stop(void);
+
+#endif // __WATCH_H__